@@ -79,6 +79,8 @@ Usage: $PROGNAME [OPTIONS] INPUT_DIR [OUTPUT_DIR]
   OPTIONS
    -k, --ksize KSIZE   Use k-mer size KSIZE (default $K_SIZE)
    -f, --force         Overwrite database files that exist in OUTPUT_DIR
+   -p, --partition     Partition $MLST_DB by scheme, so that kcst loads only
+                       the schemes it needs (with kcst --pre, see khc --help)
    -x, --khc=KHC       Path to the khc binary, if not on PATH or in ../bin
        --fsa-ext=FSA   File extension of FASTA files (if not \"$FSA_EXT\")
        --tsv-ext=TSV   File extension of TSV files (if not \"$TSV_EXT\")
@@ -103,7 +105,7 @@ Usage: $PROGNAME [OPTIONS] INPUT_DIR [OUTPUT_DIR]
 
 # Parse options
 
-unset FORCE VERBOSE
+unset FORCE VERBOSE PARTITION
 while [ $# -ne 0 -a "$(expr "$1" : '\(.\)..*')" = "-" ]; do
     case $1 in
     --ksize=*)    K_SIZE="${1##--ksize=}" ;;
@@ -115,6 +117,7 @@ while [ $# -ne 0 -a "$(expr "$1" : '\(.\)..*')" = "-" ]; do
     --tsv*=*)     TSV_EXT="${1##--tsv*=}" ;;
     --tsv*)       shift || usage_exit; TSV_EXT="$1" ;;
     -f|--force)   FORCE=1 ;;
+    -p|--part*)   PARTITION=1 ;;
     -v|--verbose) VERBOSE=1 ;;
     -h|--help)    usage_exit 0 ;;
     *)            usage_exit ;;
@@ -195,7 +198,7 @@ done
 
 emit "compiling FASTA files to $MLST_DB"
 
-echo | $KHC_EXE ${VERBOSE:+"-v"} -k $K_SIZE -w "$MLST_DB" "$MLST_DB.TMP"
+echo | $KHC_EXE ${VERBOSE:+"-v"} -k $K_SIZE -w "$MLST_DB" ${PARTITION:+--partition} "$MLST_DB.TMP"
 
 rm -f "$MLST_DB.TMP"
 
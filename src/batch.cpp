@@ -0,0 +1,114 @@
+/* batch.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <thread>
+#include "batch.h"
+#include "trace.h"
+#include "utils.h"
+
+namespace khc {
+
+
+void
+read_batch(const std::string& fname, std::vector<query_job>& jobs)
+{
+    std::ifstream is(fname);
+
+    if (!is)
+        raise_error("failed to open batch file: %s", fname.c_str());
+
+    std::string line;
+    int lineno = 0;
+
+    while (std::getline(is, line))
+    {
+        ++lineno;
+
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::string::size_type tab = line.find('\t');
+
+        if (tab == std::string::npos)
+            jobs.push_back({line, line});
+        else if (tab == 0 || tab == line.length() - 1)
+            raise_error("%s:%d: invalid batch line, expected NAME<tab>PATH", fname.c_str(), lineno);
+        else
+            jobs.push_back({line.substr(0, tab), line.substr(tab + 1)});
+    }
+}
+
+std::string
+output_path(const std::string& out_dir, const query_job& job, const std::string& ext)
+{
+    return out_dir + "/" + job.name.substr(job.name.rfind('/') + 1) + ext;
+}
+
+void
+check_output_paths(const std::string& out_dir, const std::vector<query_job>& jobs, const std::string& ext)
+{
+    std::map<std::string, const query_job*> seen;
+
+    for (const query_job& job : jobs)
+    {
+        auto ins = seen.insert(std::make_pair(output_path(out_dir, job, ext), &job));
+
+        if (!ins.second)
+            raise_error("queries %s and %s would both write output file %s; name them apart in a batch file",
+                    ins.first->second->name.c_str(), job.name.c_str(), ins.first->first.c_str());
+    }
+}
+
+void
+run_batch(std::size_t n_jobs, int n_threads, const std::function<void(std::size_t)>& run)
+{
+    std::atomic<std::size_t> next_job(0);
+
+    auto worker = [&]() {
+        std::size_t i;
+
+        if (n_threads > 1)
+            tracer::name_thread("worker");
+
+        while ((i = next_job++) < n_jobs)
+            run(i);
+    };
+
+    if (n_threads <= 1)
+        worker();
+    else
+    {
+        verbose_emit("running %d queries on %d threads", static_cast<int>(n_jobs), n_threads);
+
+        std::vector<std::thread> threads;
+
+        for (int t = 0; t != n_threads; ++t)
+            threads.push_back(std::thread(worker));
+
+        for (auto& t : threads)
+            t.join();
+    }
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,60 @@
+/* batch.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef batch_h_INCLUDED
+#define batch_h_INCLUDED
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace khc {
+
+// This header defines the batch of queries that khc runs: the QUERY files on
+// its command line and in a batch file (-b), the names of their output files
+// (-o), and the running of the queries on a number of threads (-p).
+
+
+// query_job - a single QUERY to run against the template database
+//
+struct query_job {
+    std::string name;   // the name used in titles and output file names
+    std::string fname;  // the file to read the query from, or "-" for stdin
+};
+
+// read_batch - append the queries listed in batch file fname to jobs; each
+//              line is NAME<tab>PATH or PATH, blank or starting with '#'
+//              for a comment
+extern void read_batch(const std::string& fname, std::vector<query_job>& jobs);
+
+// output_path - the file in out_dir that the output for job goes to: its
+//               name without directory, with extension ext appended
+extern std::string output_path(const std::string& out_dir, const query_job& job, const std::string& ext);
+
+// check_output_paths - raise an error if two jobs have the same output_path,
+//                      so that neither overwrites the other
+extern void check_output_paths(const std::string& out_dir, const std::vector<query_job>& jobs, const std::string& ext);
+
+// run_batch - call run(i) for each job i < n_jobs, on n_threads threads that
+//             each take the next job when done with one; run must not throw
+extern void run_batch(std::size_t n_jobs, int n_threads, const std::function<void(std::size_t)>& run);
+
+
+} // namespace khc
+
+#endif // batch_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
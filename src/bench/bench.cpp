@@ -0,0 +1,258 @@
+/* bench.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "utils.h"
+
+using namespace khc;
+
+static const double DEFAULT_MIN_TIME = 0.5;
+
+static const char USAGE[] = "\n"
+"Usage: run-benchmarks [-t SECS] [-l] [FILTER ...]\n"
+"\n"
+"  Run the khc microbenchmarks whose name contains any FILTER, or all, and\n"
+"  write the results as JSON to standard output, and a summary to standard\n"
+"  error.  Each benchmark runs for at least SECS seconds (default %.1f).\n"
+"\n"
+"  For every benchmark the JSON has the number of kmers processed, the time\n"
+"  taken, the ns per kmer and kmers per second, and the peak RSS in kB of the\n"
+"  process that ran it.\n"
+"\n"
+"  OPTIONS\n"
+"   -t SECS   minimum time to run each benchmark\n"
+"   -l        list the benchmarks, do not run them\n"
+"\n";
+
+namespace {
+
+struct entry {
+    std::string name;
+    void (*f)(bench&);
+};
+
+std::vector<entry>& registry()
+{
+    static std::vector<entry> benches;
+    return benches;
+}
+
+// run_child - run benchmark e in a child process, and return its results as
+//             a JSON object, or one with an error
+//
+std::string run_child(const entry& e, double min_time)
+{
+    int fds[2];
+
+    if (pipe(fds) == -1)
+        raise_error("failed to create pipe: %s", std::strerror(errno));
+
+    std::fflush(stdout);
+    std::fflush(stderr);
+
+    pid_t pid = fork();
+
+    if (pid == -1)
+        raise_error("failed to fork: %s", std::strerror(errno));
+
+    if (pid == 0)
+    {
+        close(fds[0]);
+
+        std::string res;
+        char line[512];
+
+        try
+        {
+            bench b(min_time);
+            e.f(b);
+
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+
+            double ns = b.kmers() ? 1e9 * b.seconds() / b.kmers() : 0.0;
+            double rate = b.seconds() > 0.0 ? b.kmers() / b.seconds() : 0.0;
+
+            std::snprintf(line, sizeof(line),
+                    "\"iterations\": %llu, \"kmers\": %llu, \"seconds\": %.6f, "
+                    "\"ns_per_kmer\": %.4f, \"kmers_per_sec\": %.0f, \"peak_rss_kb\": %ld",
+                    static_cast<unsigned long long>(b.iterations()),
+                    static_cast<unsigned long long>(b.kmers()),
+                    b.seconds(), ns, rate, ru.ru_maxrss);
+
+            res = line;
+        }
+        catch (const std::exception& ex)
+        {
+            res = "\"error\": " + json_string(ex.what());
+        }
+
+        if (write(fds[1], res.data(), res.size()) != static_cast<ssize_t>(res.size()))
+            _exit(1);
+
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    std::string res;
+    char buf[512];
+    ssize_t n;
+
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0)
+        res.append(buf, n);
+
+    close(fds[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    if (res.empty())
+        res = "\"error\": \"benchmark process died\"";
+
+    return "{ \"name\": " + json_string(e.name) + ", " + res + " }";
+}
+
+} // namespace
+
+
+bool
+khc::register_bench(const char *group, const char *name, void (*f)(bench&))
+{
+    registry().push_back({ std::string(group) + "/" + name, f });
+    return true;
+}
+
+void
+bench::run(fn_t fn, setup_t setup)
+{
+    iterations_ = kmers_ = 0;
+    seconds_ = 0.0;
+
+    do {
+        if (setup)
+            setup();
+
+        double t0 = wall_time();
+        kmers_ += fn();
+        seconds_ += wall_time() - t0;
+        ++iterations_;
+    } while (seconds_ < min_time_);
+}
+
+
+int
+main(int, char *argv[])
+{
+    set_progname("run-benchmarks");
+
+    try
+    {
+        double min_time = DEFAULT_MIN_TIME;
+        bool list = false;
+        std::vector<std::string> filters;
+
+        while (*++argv)
+        {
+            if (!std::strcmp("-t", *argv) && *++argv) {
+                min_time = std::atof(*argv);
+                if (min_time <= 0.0)
+                    raise_error("invalid SECS: %s", *argv);
+            }
+            else if (!std::strcmp("-l", *argv)) {
+                list = true;
+            }
+            else if (**argv == '-') {
+                std::fprintf(stderr, USAGE, DEFAULT_MIN_TIME);
+                return 1;
+            }
+            else {
+                filters.push_back(*argv);
+            }
+        }
+
+        std::vector<const entry*> selected;
+
+        for (const entry& e : registry())
+        {
+            bool match = filters.empty();
+
+            for (const std::string& f : filters)
+                match = match || e.name.find(f) != std::string::npos;
+
+            if (match)
+                selected.push_back(&e);
+        }
+
+        if (list)
+        {
+            for (const entry *e : selected)
+                std::printf("%s\n", e->name.c_str());
+
+            return 0;
+        }
+
+        char date[32];
+        std::time_t t = std::time(0);
+        std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&t));
+
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+
+        std::printf("{\n  \"context\": { \"date\": \"%s\", \"host\": %s, \"compiler\": %s, \"min_time\": %.2f },\n"
+                "  \"benchmarks\": [",
+                date, json_string(host).c_str(), json_string(__VERSION__).c_str(), min_time);
+
+        for (std::size_t i = 0; i != selected.size(); ++i)
+        {
+            std::fprintf(stderr, "%-40s ", selected[i]->name.c_str());
+
+            std::string res = run_child(*selected[i], min_time);
+
+            std::printf("%s\n    %s", i ? "," : "", res.c_str());
+
+            std::size_t p = res.find("\"ns_per_kmer\": ");
+            if (p != std::string::npos)
+                std::fprintf(stderr, "%10.2f ns/kmer\n", std::atof(res.c_str() + p + 15));
+            else
+                std::fprintf(stderr, "%s\n", res.c_str());
+        }
+
+        std::printf("\n  ]\n}\n");
+    }
+    catch (const std::exception& e)
+    {
+        report_error(e.what());
+        return 1;
+    }
+
+    return 0;
+}
+
+// vim: sts=4:sw=4:ai:si:et
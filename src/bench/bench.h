@@ -0,0 +1,83 @@
+/* bench.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef bench_h_INCLUDED
+#define bench_h_INCLUDED
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include "testdata.h"
+
+namespace khc {
+
+// This header defines the small harness for the microbenchmarks, which are
+// registered with the BENCH macro, much like gtest's TEST:
+//
+//   BENCH(kmeriser, k15) {
+//       std::string seq = random_bases(1 << 20, 1);  // setup, not timed
+//       b.run([&]() { ...; return n_kmers; });       // timed
+//   }
+//
+// The function passed to run() is called repeatedly until min_time has
+// passed, and returns the number of kmers it processed, from which the rate
+// per kmer is computed.  Every benchmark runs in a child process of its own,
+// so that its peak RSS is its own.
+
+
+// bench - the handle through which a benchmark times its function
+//
+class bench
+{
+    public:
+        typedef std::function<std::uint64_t()> fn_t;
+        typedef std::function<void()> setup_t;
+
+    private:
+        double min_time_;
+        std::uint64_t iterations_;
+        std::uint64_t kmers_;
+        double seconds_;
+
+    public:
+        explicit bench(double min_time)
+            : min_time_(min_time), iterations_(0), kmers_(0), seconds_(0.0) { }
+
+        // time fn, calling setup untimed before each call when given
+        void run(fn_t fn, setup_t setup = setup_t());
+
+        std::uint64_t iterations() const { return iterations_; }
+        std::uint64_t kmers() const { return kmers_; }
+        double seconds() const { return seconds_; }
+};
+
+
+// register_bench - add benchmark group.name to the suite; used by BENCH
+//
+extern bool register_bench(const char *group, const char *name, void (*f)(bench&));
+
+#define BENCH(group, name) \
+    static void group##_##name##_bench(khc::bench&); \
+    static bool group##_##name##_registered = \
+        khc::register_bench(#group, #name, group##_##name##_bench); \
+    static void group##_##name##_bench(khc::bench& b)
+
+
+} // namespace khc
+
+#endif // bench_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
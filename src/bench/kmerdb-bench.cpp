@@ -0,0 +1,146 @@
+/* kmerdb-bench.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "kmerdb.h"
+#include "kmerise.h"
+
+using namespace khc;
+
+namespace {
+
+// The dbs are filled with the kmers of alleles of 100 loci, 50 per locus,
+// which differ from each other at 2% of their bases, much as in MLST.  The
+// vector db is benchmarked at k=13, as its vector at k=15 takes 2G.
+
+static const int ksize = 13;
+static const int n_loci = 100;
+static const int n_alleles = 50;
+static const std::size_t allele_len = 600;
+
+struct kmer_loc {
+    kmer_t kmer;
+    kloc_t loc;
+};
+
+// template_kmers - the kmers and their locations in the test alleles
+//
+static std::vector<kmer_loc>
+template_kmers()
+{
+    std::vector<kmer_loc> ret;
+    kmeriser k(ksize);
+    std::uint64_t sid = 0;
+
+    for (int l = 0; l != n_loci; ++l)
+    {
+        std::string locus = random_bases(allele_len, l + 1);
+
+        for (int a = 0; a != n_alleles; ++a, ++sid)
+        {
+            std::string allele = mutate(locus, 0.02, 1000 * l + a);
+            std::uint64_t pos = 0;
+
+            k.set(allele.data(), allele.data() + allele.size());
+
+            while (k.next())
+                ret.push_back({ k.knum(), (sid << 32) | pos++ });
+        }
+    }
+
+    return ret;
+}
+
+// query_kmers - n kmers, half of them from the templates, half random
+//
+static std::vector<kmer_t>
+query_kmers(const std::vector<kmer_loc>& tpl, std::size_t n)
+{
+    std::vector<kmer_t> ret;
+    std::string seq = random_bases(n / 2 + ksize, 99);
+    kmeriser k(ksize);
+
+    k.set(seq.data(), seq.data() + seq.size());
+
+    for (std::size_t i = 0; i != n / 2 && k.next(); ++i)
+    {
+        ret.push_back(tpl[(i * 7919) % tpl.size()].kmer);
+        ret.push_back(k.knum());
+    }
+
+    return ret;
+}
+
+template <typename kmer_db_t>
+static void
+insert_bench(bench& b)
+{
+    std::vector<kmer_loc> tpl = template_kmers();
+    std::unique_ptr<kmer_db_t> db;
+
+    b.run([&]() {
+        for (const kmer_loc& kl : tpl)
+            db->add_kloc(kl.kmer, kl.loc);
+        return tpl.size();
+    }, [&]() {
+        db.reset(new kmer_db_t(ksize));
+    });
+}
+
+template <typename kmer_db_t>
+static void
+lookup_bench(bench& b)
+{
+    std::vector<kmer_loc> tpl = template_kmers();
+    std::vector<kmer_t> qry = query_kmers(tpl, 1 << 20);
+    kmer_db_t db(ksize);
+    std::uint64_t sink = 0;
+
+    for (const kmer_loc& kl : tpl)
+        db.add_kloc(kl.kmer, kl.loc);
+
+    b.run([&]() {
+        for (kmer_t kmer : qry)
+            for (kloc_t loc : db.get_klocs(kmer))
+                sink += loc;
+        return qry.size();
+    });
+}
+
+BENCH(vector_kmer_db, insert) {
+    insert_bench<vector_kmer_db>(b);
+}
+
+BENCH(vector_kmer_db, lookup) {
+    lookup_bench<vector_kmer_db>(b);
+}
+
+BENCH(map_kmer_db, insert) {
+    insert_bench<map_kmer_db>(b);
+}
+
+BENCH(map_kmer_db, lookup) {
+    lookup_bench<map_kmer_db>(b);
+}
+
+} // namespace
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,112 @@
+/* kmerise-bench.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string>
+#include "bench.h"
+#include "kmerise.h"
+
+using namespace khc;
+
+namespace {
+
+static const int ksize = 15;
+static const std::size_t seq_len = 1 << 20;
+
+// drain - run k to the end, and return the number of kmers, folding them
+//         into sink so that the work is not optimised away
+//
+template <typename K>
+static std::uint64_t
+drain(K& k, knum_t& sink)
+{
+    std::uint64_t n = 0;
+
+    while (k.next())
+    {
+        sink ^= k.knum();
+        ++n;
+    }
+
+    return n;
+}
+
+BENCH(kmeriser, k15) {
+
+    std::string seq = random_bases(seq_len, 1);
+    kmeriser k(ksize);
+    knum_t sink = 0;
+
+    b.run([&]() { k.set(seq.data(), seq.data() + seq.size()); return drain(k, sink); });
+}
+
+BENCH(kmeriser, k31) {
+
+    std::string seq = random_bases(seq_len, 1);
+    kmeriser k(31);
+    knum_t sink = 0;
+
+    b.run([&]() { k.set(seq.data(), seq.data() + seq.size()); return drain(k, sink); });
+}
+
+BENCH(kmeriser, k15_skip_degens_1pct) {
+
+    std::string seq = sprinkle(random_bases(seq_len, 1), 0.01, "N", 2);
+    kmeriser k(ksize, true);
+    knum_t sink = 0;
+
+    b.run([&]() { k.set(seq.data(), seq.data() + seq.size()); return drain(k, sink); });
+}
+
+BENCH(kmeriser, k15_min_qual) {
+
+    std::string seq = random_bases(seq_len, 1);
+    std::string qual = sprinkle(std::string(seq_len, 'I'), 0.01, "#", 3);
+    kmeriser k(ksize, false, 20);
+    knum_t sink = 0;
+
+    b.run([&]() { k.set(seq.data(), seq.data() + seq.size(), qual.data()); return drain(k, sink); });
+}
+
+// The kmerator produces every variant of kmers with degenerate bases, so the
+// kmers per second measure its output, not its progress over the sequence.
+
+static void
+kmerator_bench(bench& b, double degens)
+{
+    std::string seq = sprinkle(random_bases(seq_len, 1), degens, "NRYKMSWBDHV", 4);
+    kmerator k(ksize, 0);
+    knum_t sink = 0;
+
+    b.run([&]() { k.set(seq.data(), seq.data() + seq.size()); return drain(k, sink); });
+}
+
+BENCH(kmerator, k15_degens_0) {
+    kmerator_bench(b, 0.0);
+}
+
+BENCH(kmerator, k15_degens_0_1pct) {
+    kmerator_bench(b, 0.001);
+}
+
+BENCH(kmerator, k15_degens_1pct) {
+    kmerator_bench(b, 0.01);
+}
+
+} // namespace
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,112 @@
+/* query-bench.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bench.h"
+#include "templatedb.h"
+
+using namespace khc;
+
+namespace {
+
+// The database has 20 loci of 100 alleles each, differing at 2% of their
+// bases.  The query is reads of 150 bases at 5x depth, with 1% errors, off a
+// 1Mb genome that carries one allele of every locus.  The db is read from
+// FASTA with max_gb 1, which makes it a vector db at k=13 and a map at k=15.
+
+static const int n_loci = 20;
+static const int n_alleles = 100;
+static const std::size_t allele_len = 600;
+static const std::size_t read_len = 150;
+
+static std::string
+template_fasta()
+{
+    std::string ret;
+
+    for (int l = 0; l != n_loci; ++l)
+    {
+        std::string locus = random_bases(allele_len, l + 1);
+
+        for (int a = 0; a != n_alleles; ++a)
+            ret += to_fasta("bench:locus" + std::to_string(l) + ":" + std::to_string(a + 1),
+                    mutate(locus, 0.02, 1000 * l + a));
+    }
+
+    return ret;
+}
+
+static std::string
+query_fastq(std::size_t& n_reads)
+{
+    std::string genome = random_bases(1 << 20, 42);
+    std::size_t spacing = genome.size() / n_loci;
+
+    for (int l = 0; l != n_loci; ++l)
+        genome.replace(l * spacing, allele_len, mutate(random_bases(allele_len, l + 1), 0.02, 1000 * l + l));
+
+    std::string ret;
+    n_reads = 5 * genome.size() / read_len;
+
+    for (std::size_t i = 0; i != n_reads; ++i)
+        ret += "@read" + std::to_string(i) + "\n"
+            + mutate(genome.substr((i * 104729) % (genome.size() - read_len), read_len), 0.01, i)
+            + "\n+\n" + std::string(read_len, 'I') + "\n";
+
+    return ret;
+}
+
+static void
+query_bench(bench& b, int ksize, const query_options& opts)
+{
+    std::istringstream is(template_fasta());
+    std::unique_ptr<template_db> db = template_db::read(is, 1, ksize, 1024);
+
+    std::size_t n_reads;
+    std::string qry = query_fastq(n_reads);
+    std::uint64_t n_kmers = n_reads * (read_len - ksize + 1);
+
+    b.run([&]() { db->query(qry.data(), qry.size(), opts); return n_kmers; });
+}
+
+BENCH(template_db, query_vector_k13) {
+    query_bench(b, 13, query_options());
+}
+
+BENCH(template_db, query_map_k15) {
+    query_bench(b, 15, query_options());
+}
+
+BENCH(template_db, query_map_k15_dedup) {
+    query_options opts;
+    opts.dedup_kmers = true;
+    query_bench(b, 15, opts);
+}
+
+BENCH(template_db, query_map_k15_depth) {
+    query_options opts;
+    opts.min_depth = 1;
+    query_bench(b, 15, opts);
+}
+
+} // namespace
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,137 @@
+/* seqreader-bench.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include <string>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+#include "bench.h"
+#include "seqreader.h"
+
+using namespace khc;
+
+namespace {
+
+// The reader does not kmerise, but its rate is given per kmer of size 15 in
+// the sequences it returns, so that it compares with the other stages.
+
+static const std::size_t ksize = 15;
+
+// test_fasta - an assembly of 100 contigs of 40kb, on lines of 60 bases
+//
+static std::string
+test_fasta()
+{
+    std::string ret;
+
+    for (int i = 0; i != 100; ++i)
+        ret += to_fasta("contig" + std::to_string(i) + " len=40000", random_bases(40000, i + 1));
+
+    return ret;
+}
+
+// test_fastq - 30000 reads of 150 bases
+//
+static std::string
+test_fastq()
+{
+    std::string ret;
+    std::string genome = random_bases(1 << 20, 7);
+
+    for (int i = 0; i != 30000; ++i)
+        ret += "@read" + std::to_string(i) + "\n" + mutate(genome.substr((i * 7919) % (genome.size() - 150), 150), 0.01, i)
+            + "\n+\n" + std::string(150, 'I') + "\n";
+
+    return ret;
+}
+
+#ifndef NO_ZLIB
+static std::string
+gzipped(const std::string& s)
+{
+    z_stream zs = z_stream();
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY);
+
+    std::string out(deflateBound(&zs, s.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(s.data()));
+    zs.avail_in = s.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+
+    deflate(&zs, Z_FINISH);
+    out.resize(out.size() - zs.avail_out);
+    deflateEnd(&zs);
+
+    return out;
+}
+#endif
+
+static std::uint64_t
+read_all(sequence_reader& r)
+{
+    std::uint64_t n = 0;
+    sequence_span s;
+
+    while (r.next(s))
+        if (s.data_len >= ksize)
+            n += s.data_len - ksize + 1;
+
+    return n;
+}
+
+BENCH(sequence_reader, fasta) {
+
+    std::string data = test_fasta();
+
+    b.run([&]() { sequence_reader r(data.data(), data.size()); return read_all(r); });
+}
+
+BENCH(sequence_reader, fasta_stream) {
+
+    std::string data = test_fasta();
+
+    b.run([&]() { std::istringstream is(data); sequence_reader r(is); return read_all(r); });
+}
+
+BENCH(sequence_reader, fastq) {
+
+    std::string data = test_fastq();
+
+    b.run([&]() { sequence_reader r(data.data(), data.size()); return read_all(r); });
+}
+
+#ifndef NO_ZLIB
+BENCH(sequence_reader, fasta_gz) {
+
+    std::string data = gzipped(test_fasta());
+
+    b.run([&]() { sequence_reader r(data.data(), data.size()); return read_all(r); });
+}
+
+BENCH(sequence_reader, fastq_gz) {
+
+    std::string data = gzipped(test_fastq());
+
+    b.run([&]() { sequence_reader r(data.data(), data.size()); return read_all(r); });
+}
+#endif
+
+} // namespace
+
+// vim: sts=4:sw=4:ai:si:et
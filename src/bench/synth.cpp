@@ -0,0 +1,442 @@
+/* synth.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "testdata.h"
+#include "utils.h"
+
+using namespace khc;
+
+static const char USAGE[] = "\n"
+"Usage: synth [OPTIONS] OUTPUT_DIR\n"
+"\n"
+"  Generate a synthetic MLST database and query samples in OUTPUT_DIR, for\n"
+"  performance testing at scale.  The same options and SEED always produce\n"
+"  the same files.\n"
+"\n"
+"  OUTPUT_DIR/db has the input for data/make-kcst-db.sh: a 'config' with the\n"
+"  schemes, and per scheme a FASTA file of alleles and a TSV of profiles.\n"
+"  The alleles of a locus descend from one another by a few substitutions\n"
+"  and the odd indel, as in real MLST databases, and some carry a degenerate\n"
+"  base.\n"
+"\n"
+"  OUTPUT_DIR/queries has per sample an assembly (sampleN.fa) and, unless\n"
+"  DEPTH is 0, reads (sampleN.fq) off a random genome carrying the alleles\n"
+"  of a sequence type of one of the schemes, and truth.tsv, which lists the\n"
+"  scheme, ST and profile of each sample.\n"
+"\n"
+"  OPTIONS (defaults in brackets)\n"
+"   -s SEED   random seed [%d]\n"
+"   -S NUM    number of schemes [%d]\n"
+"   -l NUM    number of loci per scheme [%d]\n"
+"   -a NUM    number of alleles per locus [%d]\n"
+"   -L LEN    mean allele length [%d]\n"
+"   -p NUM    number of profiles (STs) per scheme [%d]\n"
+"   -g PCT    percentage of alleles with a degenerate base [%.1f]\n"
+"   -n NUM    number of query samples [%d]\n"
+"   -G LEN    genome length of the samples [%d]\n"
+"   -c LEN    mean contig length of the assemblies [%d]\n"
+"   -d DEPTH  read depth, or 0 for no reads [%d]\n"
+"   -r LEN    read length [%d]\n"
+"   -e PCT    percentage of read bases in error [%.1f]\n"
+"   -v        report progress on stderr\n"
+"\n";
+
+struct params {
+    int seed = 1;
+    int n_schemes = 10;
+    int n_loci = 7;
+    int n_alleles = 1000;
+    int allele_len = 450;
+    int n_profiles = 1000;
+    double degen_pct = 1.0;
+    int n_samples = 4;
+    int genome_len = 5000000;
+    int contig_len = 200000;
+    int depth = 10;
+    int read_len = 150;
+    double error_pct = 1.0;
+};
+
+// an allele as it is written, and as it occurs in genomes (without degens)
+struct allele {
+    std::string seq;
+    std::string clean;
+};
+
+struct scheme {
+    std::string name;
+    std::vector<std::string> loci;
+    std::vector<std::vector<allele> > alleles;      // per locus
+    std::vector<std::vector<int> > profiles;         // per ST, allele numbers
+};
+
+static std::string
+scheme_name(int i)
+{
+    return "synth" + std::to_string(i + 1);
+}
+
+static std::string
+locus_name(int i)
+{
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "l%02d", i + 1);
+    return buf;
+}
+
+static void
+make_dir(const std::string& path)
+{
+    if (mkdir(path.c_str(), 0777) == -1 && errno != EEXIST)
+        raise_error("failed to create directory: %s: %s", path.c_str(), std::strerror(errno));
+}
+
+static void
+open_file(std::ofstream& f, const std::string& path)
+{
+    f.open(path.c_str(), std::ios_base::out|std::ios_base::binary);
+
+    if (!f)
+        raise_error("failed to create file: %s", path.c_str());
+}
+
+// make_alleles - the alleles of a locus, each derived from a random earlier
+//                one by 1 to 3 substitutions, and in 1 in 20 by an indel
+//
+static std::vector<allele>
+make_alleles(const params& p, rng& rand)
+{
+    std::vector<allele> ret;
+    std::size_t len = p.allele_len * 9 / 10 + rand.below(p.allele_len / 5 + 1);
+
+    ret.push_back({ std::string(), random_bases(len, rand()) });
+
+    while (ret.size() != static_cast<std::size_t>(p.n_alleles))
+    {
+        std::string s = ret[rand.below(ret.size())].clean;
+
+        for (int n = 1 + rand.below(3); n; --n)
+        {
+            char& c = s[rand.below(s.size())];
+            char b;
+            while ((b = rand.base()) == c)
+                ;
+            c = b;
+        }
+
+        if (rand.chance(0.05))
+        {
+            std::size_t pos = rand.below(s.size()), n = 1 + rand.below(3);
+
+            if (rand.chance(0.5) && s.size() > 2 * n)
+                s.erase(std::min(pos, s.size() - n), n);
+            else
+                s.insert(pos, random_bases(n, rand()));
+        }
+
+        ret.push_back({ std::string(), s });
+    }
+
+    for (allele& a : ret)
+    {
+        a.seq = a.clean;
+
+        if (rand.chance(p.degen_pct / 100.0))
+            a.seq[rand.below(a.seq.size())] = "RYKMSWN"[rand.below(7)];
+    }
+
+    return ret;
+}
+
+// make_profiles - distinct profiles, favouring the low allele numbers as in
+//                 real schemes, where the early alleles are the common ones
+//
+static std::vector<std::vector<int> >
+make_profiles(const params& p, rng& rand)
+{
+    std::vector<std::vector<int> > ret;
+    std::set<std::vector<int> > seen;
+
+    for (int tries = 0; ret.size() != static_cast<std::size_t>(p.n_profiles) && tries != 100 * p.n_profiles; ++tries)
+    {
+        std::vector<int> prof;
+
+        for (int l = 0; l != p.n_loci; ++l)
+        {
+            double u = static_cast<double>(rand()) / rng::RANGE;
+            prof.push_back(1 + static_cast<int>(p.n_alleles * u * u));
+        }
+
+        if (seen.insert(prof).second)
+            ret.push_back(prof);
+    }
+
+    return ret;
+}
+
+static void
+write_db(const std::string& dir, const std::vector<scheme>& schemes)
+{
+    std::ofstream cfg;
+    open_file(cfg, dir + "/config");
+
+    cfg << "# Synthetic MLST database written by synth\n";
+
+    for (const scheme& s : schemes)
+    {
+        std::string loci;
+
+        for (const std::string& l : s.loci)
+            loci += (loci.empty() ? "" : ",") + l;
+
+        cfg << s.name << '\t' << "Synthetic " << s.name << '\t' << loci << '\n';
+
+        std::ofstream fsa, tsv;
+        open_file(fsa, dir + "/" + s.name + ".fsa");
+        open_file(tsv, dir + "/" + s.name + ".tsv");
+
+        for (std::size_t l = 0; l != s.loci.size(); ++l)
+            for (std::size_t a = 0; a != s.alleles[l].size(); ++a)
+                fsa << to_fasta(s.loci[l] + "_" + std::to_string(a + 1), s.alleles[l][a].seq);
+
+        tsv << "ST";
+        for (const std::string& l : s.loci)
+            tsv << '\t' << l;
+        tsv << '\n';
+
+        for (std::size_t st = 0; st != s.profiles.size(); ++st)
+        {
+            tsv << st + 1;
+            for (int a : s.profiles[st])
+                tsv << '\t' << a;
+            tsv << '\n';
+        }
+    }
+}
+
+// write_sample - write the assembly and reads of a genome carrying the
+//                alleles of profile st of scheme s
+//
+static void
+write_sample(const std::string& dir, const std::string& id, const params& p,
+        const scheme& s, std::size_t st, rng& rand)
+{
+    std::string genome = random_bases(p.genome_len, rand());
+    std::vector<std::pair<std::size_t,std::size_t> > loci;   // [begin,end) in genome
+    std::size_t spacing = genome.size() / (s.loci.size() + 1);
+
+    for (std::size_t l = 0; l != s.loci.size(); ++l)
+    {
+        const std::string& a = s.alleles[l][s.profiles[st][l] - 1].clean;
+        std::size_t pos = (l + 1) * spacing;
+
+        if (pos + a.size() > genome.size())
+            raise_error("genome length %d is too short for %lu loci", p.genome_len,
+                    static_cast<unsigned long>(s.loci.size()));
+
+        genome.replace(pos, a.size(), rand.chance(0.5) ? a : reverse_complement(a));
+        loci.push_back(std::make_pair(pos, pos + a.size()));
+    }
+
+    // the assembly has contigs of 1/2 to 3/2 the mean length, never cut
+    // inside a locus
+
+    std::ofstream fa;
+    open_file(fa, dir + "/" + id + ".fa");
+
+    for (std::size_t beg = 0, n = 1; beg < genome.size(); ++n)
+    {
+        std::size_t end = std::min(genome.size(), beg + p.contig_len / 2 + rand.below(p.contig_len + 1));
+
+        for (const auto& l : loci)
+            if (end > l.first && end < l.second)
+                end = l.second;
+
+        fa << to_fasta(id + "_contig" + std::to_string(n) + " len=" + std::to_string(end - beg),
+                genome.substr(beg, end - beg));
+        beg = end;
+    }
+
+    if (!p.depth)
+        return;
+
+    // the reads come off either strand at uniform positions, with errors
+    // that have phred quality 10
+
+    std::ofstream fq;
+    open_file(fq, dir + "/" + id + ".fq");
+
+    std::size_t n_reads = static_cast<std::size_t>(p.depth) * genome.size() / p.read_len;
+    std::string seq, qual;
+
+    for (std::size_t i = 0; i != n_reads; ++i)
+    {
+        seq = genome.substr(rand.below(genome.size() - p.read_len + 1), p.read_len);
+        qual.assign(p.read_len, 'I');
+
+        if (rand.chance(0.5))
+            seq = reverse_complement(seq);
+
+        for (int j = 0; j != p.read_len; ++j)
+            if (rand.chance(p.error_pct / 100.0))
+            {
+                char b;
+                while ((b = rand.base()) == seq[j])
+                    ;
+                seq[j] = b;
+                qual[j] = '+';
+            }
+
+        fq << '@' << id << "_read" << i + 1 << '\n' << seq << "\n+\n" << qual << '\n';
+    }
+}
+
+static int
+run_synth(char *argv[])
+{
+    params p;
+    std::string out_dir;
+
+    while (*++argv)
+    {
+        if (!std::strcmp("-v", *argv))
+            set_verbose(true);
+        else if (!std::strcmp("-s", *argv) && *++argv)
+            p.seed = std::atoi(*argv);
+        else if (!std::strcmp("-S", *argv) && *++argv)
+            p.n_schemes = std::atoi(*argv);
+        else if (!std::strcmp("-l", *argv) && *++argv)
+            p.n_loci = std::atoi(*argv);
+        else if (!std::strcmp("-a", *argv) && *++argv)
+            p.n_alleles = std::atoi(*argv);
+        else if (!std::strcmp("-L", *argv) && *++argv)
+            p.allele_len = std::atoi(*argv);
+        else if (!std::strcmp("-p", *argv) && *++argv)
+            p.n_profiles = std::atoi(*argv);
+        else if (!std::strcmp("-g", *argv) && *++argv)
+            p.degen_pct = std::atof(*argv);
+        else if (!std::strcmp("-n", *argv) && *++argv)
+            p.n_samples = std::atoi(*argv);
+        else if (!std::strcmp("-G", *argv) && *++argv)
+            p.genome_len = std::atoi(*argv);
+        else if (!std::strcmp("-c", *argv) && *++argv)
+            p.contig_len = std::atoi(*argv);
+        else if (!std::strcmp("-d", *argv) && *++argv)
+            p.depth = std::atoi(*argv);
+        else if (!std::strcmp("-r", *argv) && *++argv)
+            p.read_len = std::atoi(*argv);
+        else if (!std::strcmp("-e", *argv) && *++argv)
+            p.error_pct = std::atof(*argv);
+        else if (**argv == '-' || !out_dir.empty())
+        {
+            params d;
+            std::fprintf(stderr, USAGE, d.seed, d.n_schemes, d.n_loci, d.n_alleles, d.allele_len,
+                    d.n_profiles, d.degen_pct, d.n_samples, d.genome_len, d.contig_len, d.depth,
+                    d.read_len, d.error_pct);
+            return 1;
+        }
+        else
+            out_dir = *argv;
+    }
+
+    if (out_dir.empty())
+        raise_error("no OUTPUT_DIR specified (see -h for help)");
+
+    if (p.n_schemes < 1 || p.n_loci < 1 || p.n_alleles < 1 || p.allele_len < 20 || p.n_profiles < 1 ||
+            p.n_samples < 0 || p.contig_len < 1 || p.depth < 0 || p.read_len < 1 || p.genome_len < p.read_len ||
+            p.degen_pct < 0.0 || p.degen_pct > 100.0 || p.error_pct < 0.0 || p.error_pct > 100.0)
+        raise_error("invalid option value (see -h for help)");
+
+    rng rand(p.seed);
+    std::vector<scheme> schemes(p.n_schemes);
+
+    for (int i = 0; i != p.n_schemes; ++i)
+    {
+        scheme& s = schemes[i];
+        s.name = scheme_name(i);
+
+        for (int l = 0; l != p.n_loci; ++l)
+        {
+            s.loci.push_back(locus_name(l));
+            s.alleles.push_back(make_alleles(p, rand));
+        }
+
+        s.profiles = make_profiles(p, rand);
+
+        verbose_emit("generated scheme %s: %d loci of %d alleles, %lu profiles", s.name.c_str(),
+                p.n_loci, p.n_alleles, static_cast<unsigned long>(s.profiles.size()));
+    }
+
+    make_dir(out_dir);
+    make_dir(out_dir + "/db");
+    make_dir(out_dir + "/queries");
+
+    write_db(out_dir + "/db", schemes);
+
+    std::ofstream truth;
+    open_file(truth, out_dir + "/queries/truth.tsv");
+
+    truth << "sample\tscheme\tST\tprofile\n";
+
+    for (int i = 0; i != p.n_samples; ++i)
+    {
+        std::string id = "sample" + std::to_string(i + 1);
+        const scheme& s = schemes[rand.below(schemes.size())];
+        std::size_t st = rand.below(s.profiles.size());
+
+        write_sample(out_dir + "/queries", id, p, s, st, rand);
+
+        truth << id << '\t' << s.name << '\t' << st + 1 << '\t';
+        for (std::size_t l = 0; l != s.loci.size(); ++l)
+            truth << (l ? "-" : "") << s.profiles[st][l];
+        truth << '\n';
+
+        verbose_emit("generated %s: %s ST%lu", id.c_str(), s.name.c_str(), static_cast<unsigned long>(st + 1));
+    }
+
+    return 0;
+}
+
+int
+main(int, char *argv[])
+{
+    set_progname("synth");
+
+    try
+    {
+        return run_synth(argv);
+    }
+    catch (const std::exception& e)
+    {
+        report_error(e.what());
+        return 1;
+    }
+}
+
+// vim: sts=4:sw=4:ai:si:et
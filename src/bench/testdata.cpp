@@ -0,0 +1,99 @@
+/* testdata.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include "testdata.h"
+
+namespace khc {
+
+static const char BASES[] = "ACGT";
+
+std::string
+random_bases(std::size_t n, unsigned seed)
+{
+    rng rand(seed);
+    std::string s(n, 'A');
+
+    for (char& c : s)
+        c = rand.base();
+
+    return s;
+}
+
+std::string
+mutate(const std::string& s, double rate, unsigned seed)
+{
+    rng rand(seed);
+    std::string ret(s);
+
+    for (char& c : ret)
+        if (rand.chance(rate))
+        {
+            const char *p = std::strchr(BASES, c);
+            c = BASES[((p ? p - BASES : 0) + 1 + rand.below(3)) & 3];
+        }
+
+    return ret;
+}
+
+std::string
+sprinkle(const std::string& s, double rate, const char *degens, unsigned seed)
+{
+    rng rand(seed);
+    std::string ret(s);
+    std::size_t n = std::strlen(degens);
+
+    for (char& c : ret)
+        if (rand.chance(rate))
+            c = degens[rand.below(n)];
+
+    return ret;
+}
+
+std::string
+reverse_complement(const std::string& s)
+{
+    std::string ret(s.rbegin(), s.rend());
+
+    for (char& c : ret)
+        switch (c) {
+            case 'A': c = 'T'; break;
+            case 'C': c = 'G'; break;
+            case 'G': c = 'C'; break;
+            case 'T': c = 'A'; break;
+            default:  c = 'N'; break;
+        }
+
+    return ret;
+}
+
+std::string
+to_fasta(const std::string& id, const std::string& s, std::size_t width)
+{
+    std::string ret = ">" + id + "\n";
+
+    for (std::size_t p = 0; p < s.size(); p += width)
+        ret += s.substr(p, width) + "\n";
+
+    return ret;
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
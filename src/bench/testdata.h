@@ -0,0 +1,83 @@
+/* testdata.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef testdata_h_INCLUDED
+#define testdata_h_INCLUDED
+
+#include <cstdint>
+#include <string>
+
+namespace khc {
+
+// This header defines the deterministic test data used by the benchmarks and
+// the synth workload generator.  Everything derives from a seed through rng,
+// so that the same seed gives the same data on every platform.
+
+
+// rng - a 64-bit linear congruential generator
+//
+// Used rather than std::rand or a std distribution, whose output differs
+// between library implementations.  Its low bits have short periods, so it
+// hands out the top 31 bits only.
+//
+class rng
+{
+    private:
+        std::uint64_t x_;
+
+    public:
+        static const std::uint32_t RANGE = 1U << 31;
+
+        explicit rng(std::uint64_t seed) : x_(seed) { }
+
+        std::uint32_t operator()() {
+            return (x_ = x_ * 6364136223846793005ULL + 1442695040888963407ULL) >> 33;
+        }
+
+        // a number in [0,n)
+        std::uint32_t below(std::uint32_t n) { return (static_cast<std::uint64_t>((*this)()) * n) >> 31; }
+
+        // true with probability p
+        bool chance(double p) { return (*this)() < p * RANGE; }
+
+        // a random base from ACGT
+        char base() { return "ACGT"[(*this)() >> 29]; }
+};
+
+
+// random_bases - n random bases from ACGT
+extern std::string random_bases(std::size_t n, unsigned seed);
+
+// mutate - copy of s with a fraction rate of its bases substituted
+extern std::string mutate(const std::string& s, double rate, unsigned seed);
+
+// sprinkle - copy of s with a fraction rate of its bases replaced by chars
+//            picked from degens
+extern std::string sprinkle(const std::string& s, double rate, const char *degens, unsigned seed);
+
+// reverse_complement - the reverse complement of s, in which anything but
+//                      ACGT becomes N
+extern std::string reverse_complement(const std::string& s);
+
+// to_fasta - s as a FASTA record with header '>id', on lines of width
+extern std::string to_fasta(const std::string& id, const std::string& s, std::size_t width = 60);
+
+
+} // namespace khc
+
+#endif // testdata_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,379 @@
+/* estimate.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <sys/stat.h>
+#ifndef NO_ZLIB
+#include <zlib.h>
+#endif
+#include "estimate.h"
+#include "kmercount.h"
+#include "seqreader.h"
+#include "utils.h"
+
+namespace khc {
+
+static const std::size_t SAMPLE_BYTES = 1 << 22;        // read from a file
+static const std::size_t SAMPLE_INFLATED = 1 << 24;     // at most, once inflated
+static const double NS = 1e-9;
+static const double MB = 1 << 20;
+
+static const struct {
+    const char *name;
+    double estimate_coefs::*coef;
+} COEFS[] = {
+    { "parse_ns_per_byte", &estimate_coefs::parse_ns_per_byte },
+    { "inflate_ns_per_byte", &estimate_coefs::inflate_ns_per_byte },
+    { "kmerise_ns_per_kmer", &estimate_coefs::kmerise_ns_per_kmer },
+    { "vector_ns_per_lookup", &estimate_coefs::vector_ns_per_lookup },
+    { "map_ns_per_lookup_level", &estimate_coefs::map_ns_per_lookup_level },
+    { "map_ns_per_uncached_level", &estimate_coefs::map_ns_per_uncached_level },
+    { "cache_mb", &estimate_coefs::cache_mb },
+    { "shared_ns_per_lookup", &estimate_coefs::shared_ns_per_lookup },
+    { "partition_ns_per_lookup", &estimate_coefs::partition_ns_per_lookup },
+    { "count_ns_per_kmer", &estimate_coefs::count_ns_per_kmer },
+    { "distinct_kmer_fraction", &estimate_coefs::distinct_kmer_fraction },
+    { "load_ns_per_kloc", &estimate_coefs::load_ns_per_kloc },
+    { "build_ns_per_kloc", &estimate_coefs::build_ns_per_kloc },
+    { "vector_ns_per_slot", &estimate_coefs::vector_ns_per_slot },
+    { "read_ns_per_byte", &estimate_coefs::read_ns_per_byte },
+    { "kmers_per_position", &estimate_coefs::kmers_per_position },
+    { "base_mb", &estimate_coefs::base_mb },
+    { "stream_mb", &estimate_coefs::stream_mb },
+    { "pipeline_mb_per_lane", &estimate_coefs::pipeline_mb_per_lane },
+};
+
+void
+estimate_coefs::read(const std::string& fname)
+{
+    std::ifstream is(fname);
+
+    if (!is)
+        raise_error("failed to open coefficients file: %s", fname.c_str());
+
+    std::string line;
+    int lineno = 0;
+
+    while (std::getline(is, line))
+    {
+        ++lineno;
+
+        std::istringstream ls(line);
+        std::string name, rest;
+        double value;
+
+        if (!(ls >> name) || name[0] == '#')
+            continue;
+
+        if (!(ls >> value) || value < 0 || ((ls >> rest) && rest[0] != '#'))
+            raise_error("%s:%d: expected 'NAME VALUE', with VALUE a non-negative number", fname.c_str(), lineno);
+
+        auto p = std::find_if(std::begin(COEFS), std::end(COEFS),
+                [&](const decltype(COEFS[0])& c) { return name == c.name; });
+
+        if (p == std::end(COEFS))
+            raise_error("%s:%d: unknown coefficient: %s", fname.c_str(), lineno, name.c_str());
+
+        this->*p->coef = value;
+    }
+}
+
+std::ostream&
+estimate_coefs::write(std::ostream& os) const
+{
+    for (const auto& c : COEFS)
+        os << c.name << ' ' << this->*c.coef << std::endl;
+
+    return os;
+}
+
+
+#ifndef NO_ZLIB
+
+// inflate_sample - inflate the gzip data in, which may have several members
+//                  and be cut off anywhere, into at most SAMPLE_INFLATED
+//                  bytes, and set used to the bytes of in that it took
+
+static std::string
+inflate_sample(const std::string& in, std::uint64_t& used, const std::string& fname)
+{
+    std::string out(SAMPLE_INFLATED, '\0');
+
+    z_stream zs = z_stream();
+
+    if (inflateInit2(&zs, 15 + 32) != Z_OK)
+        raise_error("failed to initialise zlib");
+
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = in.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+
+    int ret;
+
+    while ((ret = inflate(&zs, Z_NO_FLUSH)) == Z_STREAM_END && zs.avail_in && zs.avail_out)
+        inflateReset(&zs);
+
+    inflateEnd(&zs);
+
+    out.resize(out.size() - zs.avail_out);
+    used = in.size() - zs.avail_in;
+
+    if (out.empty() && ret != Z_OK && ret != Z_STREAM_END)
+        raise_error("failed to inflate %s: invalid gzip data", fname.c_str());
+
+    return out;
+}
+
+#endif
+
+// size_input - parses the sample in chunks, so that a long sequence counts
+//              as it goes, and scales the counts by the size of the file;
+//              the last record of a sample may be cut short, but its bases
+//              still count for the bytes they take
+
+input_size
+size_input(const std::string& fname, int ksize)
+{
+    input_size sz;
+    sz.fname = fname;
+
+    struct stat st;
+
+    if (fname == "-" || stat(fname.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        raise_error("cannot estimate the size of %s: not a regular file", fname.c_str());
+
+    sz.file_bytes = st.st_size;
+
+    std::string sample(std::min<std::uint64_t>(sz.file_bytes, SAMPLE_BYTES), '\0');
+    std::ifstream is(fname, std::ios_base::in|std::ios_base::binary);
+
+    if (!is || !is.read(&sample[0], sample.size()))
+        raise_error("failed to read file: %s", fname.c_str());
+
+    std::uint64_t used = sample.size();
+
+    if (!sample.empty() && static_cast<unsigned char>(sample[0]) == 0x1f)
+    {
+#ifdef NO_ZLIB
+        raise_error("no decompression support");
+#else
+        sz.compressed = true;
+        sample = inflate_sample(sample, used, fname);
+#endif
+    }
+
+    if (sample.empty())
+        return sz;
+
+    sz.format = sample[0] == '>' ? "fasta" : sample[0] == '@' ? "fastq" : "bare";
+    sz.bytes = sz.compressed ? std::llround(static_cast<double>(sz.file_bytes) * sample.size() / used) : sz.file_bytes;
+
+    std::uint64_t seqs = 0, id_bytes = 0, bases = 0, kmers = 0;
+    std::size_t parsed = 0, len = 0;
+
+    sequence_reader reader(sample.data(), sample.size());
+    reader.set_chunking(ksize - 1);
+    sequence_span seq;
+
+    try {
+        while (reader.next(seq))
+        {
+            bases += seq.data_len;
+            kmers += seq.data_len < static_cast<std::size_t>(ksize) ? 0 : seq.data_len - ksize + 1;
+
+            if (!seq.partial)
+            {
+                ++seqs;
+                id_bytes += seq.id_len;
+            }
+
+            reader.input_progress(parsed, len);
+        }
+    }
+    catch (const std::exception&) {
+        if (!parsed)
+            throw;
+    }
+
+    if (!parsed)
+        return sz;
+
+    double scale = static_cast<double>(sz.bytes) / parsed;
+
+    sz.seqs = std::max<std::uint64_t>(1, std::llround(scale * seqs));
+    sz.id_bytes = std::llround(scale * id_bytes);
+    sz.bases = std::llround(scale * bases);
+    sz.kmers = std::llround(scale * kmers);
+
+    return sz;
+}
+
+// size_fasta_db - the kmer positions of a FASTA db are its klocs (but for
+//                 degenerate bases); a fraction of them are distinct kmers
+
+void
+size_fasta_db(const input_size& input, const estimate_coefs& coefs, db_stats& st)
+{
+    st.n_seqs = input.seqs;
+    st.n_id_bytes = input.id_bytes + input.seqs;
+    st.n_positions = input.kmers;
+    st.n_acc_words = input.kmers / 64 + input.seqs;
+    st.n_klocs = input.kmers;
+    st.n_kmers = std::llround(coefs.kmers_per_position * input.kmers);
+
+    estimate_memory(st);
+}
+
+
+// estimate_run - the load reads or builds the klocs, and the vector db first
+//                allocates its kmer index; a shared db is estimated for the
+//                process that publishes it, a partitioned db for reading all
+//                the partitions it uses; each query is parsed, kmerised and
+//                looked up in full, as early termination (-e) cannot be
+//                foreseen; inflating runs on a thread of its own, and with
+//                --pipeline, so do the parse and kmerise stages, but no run
+//                goes faster than the cores can do all of its work
+
+std::vector<run_estimate>
+estimate_run(const db_stats& st, bool from_fasta, const std::vector<input_size>& queries,
+        const query_options& opts, int n_threads, const estimate_coefs& coefs)
+{
+    double n_cpus = std::max(1U, std::thread::hardware_concurrency());
+
+    std::string used = st.backend_name;
+
+    if (used == "partitioned" && opts.prescreen == 1)
+        used = "partitioned, one scheme";
+
+    // the memory of a query, but for its input: the accumulator, and the
+    // kmer counter or sketch; while the counter doubles, it holds the old
+    // table too, which makes 24 bytes per slot
+
+    std::uint64_t acc_bytes = opts.min_depth
+        ? st.n_acc_words * 64 * sizeof(depth_accumulator::depth_t) + st.n_seqs
+        : st.n_acc_words * sizeof(std::uint64_t) + st.n_seqs;
+
+    std::uint64_t max_query_bytes = 0;
+
+    for (const input_size& q : queries)
+    {
+        std::uint64_t n = acc_bytes;
+
+        n += q.compressed ? static_cast<std::uint64_t>(coefs.stream_mb * MB) : q.bytes;
+        n += static_cast<std::uint64_t>(opts.pipeline * coefs.pipeline_mb_per_lane * MB);
+
+        if (opts.dedup_kmers)
+        {
+            std::uint64_t slots = 1 << 16;
+
+            while (slots < 2 * coefs.distinct_kmer_fraction * q.kmers)
+                slots <<= 1;
+
+            n += 24 * slots;
+        }
+        else if (opts.min_kmer_count > 1)
+            n += 16 << 20;      // the count-min sketch of collect()
+
+        max_query_bytes = std::max(max_query_bytes, n);
+    }
+
+    std::uint64_t query_bytes = max_query_bytes * std::min<std::size_t>(n_threads, queries.size());
+
+    std::vector<run_estimate> ret;
+
+    for (const db_stats::backend& be : st.backends)
+    {
+        run_estimate est;
+        est.backend = be.name;
+        est.used = be.name == used;
+        est.db_bytes = be.total();
+        est.query_bytes = query_bytes;
+        est.peak_bytes = static_cast<std::uint64_t>(coefs.base_mb * MB) + est.db_bytes + query_bytes;
+
+        double klocs_ns = st.n_klocs * (from_fasta ? coefs.build_ns_per_kloc : coefs.load_ns_per_kloc);
+        double lookup_ns;
+
+        if (be.name == "vector")
+        {
+            est.load_secs = NS * (klocs_ns + coefs.vector_ns_per_slot * (static_cast<std::uint64_t>(1) << (2 * st.ksize - 1)));
+            lookup_ns = coefs.vector_ns_per_lookup;
+        }
+        else if (be.name == "map")
+        {
+            // the levels of the map beyond those that fit in cache miss it
+
+            double map_mb = be.parts.front().second / MB;
+
+            est.load_secs = NS * klocs_ns;
+            lookup_ns = coefs.map_ns_per_lookup_level * std::log2(st.n_kmers + 2.0)
+                + coefs.map_ns_per_uncached_level * std::max(0.0, std::log2(map_mb / coefs.cache_mb));
+        }
+        else if (be.name == "shared")
+        {
+            est.load_secs = NS * klocs_ns;
+            lookup_ns = coefs.shared_ns_per_lookup;
+        }
+        else
+        {
+            std::uint64_t n_parts = std::max<std::uint64_t>(1, be.name == "partitioned, one scheme" ? 1
+                    : opts.prescreen ? std::min<std::uint64_t>(opts.prescreen, st.n_schemes) : st.n_schemes);
+
+            est.load_secs = NS * coefs.read_ns_per_byte * be.total();
+            lookup_ns = coefs.partition_ns_per_lookup * n_parts;
+        }
+
+        double cpu_secs = 0, wall_secs = 0, max_secs = 0;
+
+        for (const input_size& q : queries)
+        {
+            double inflate = q.compressed ? NS * coefs.inflate_ns_per_byte * q.bytes : 0;
+            double parse = NS * coefs.parse_ns_per_byte * q.bytes;
+            double kmerise = NS * coefs.kmerise_ns_per_kmer * q.kmers;
+            double lookup = NS * q.kmers * (opts.dedup_kmers
+                    ? coefs.count_ns_per_kmer + coefs.distinct_kmer_fraction * lookup_ns : lookup_ns);
+
+            double cpu = inflate + parse + kmerise + lookup;
+            double wall = opts.pipeline
+                ? std::max({ inflate, parse, kmerise / opts.pipeline, lookup })
+                : std::max(inflate, parse + kmerise + lookup);
+
+            wall = std::max(wall, cpu / n_cpus);
+
+            est.secs.push_back(wall);
+            cpu_secs += cpu;
+            wall_secs += wall;
+            max_secs = std::max(max_secs, wall);
+        }
+
+        est.query_secs = std::max({ max_secs, wall_secs / n_threads, cpu_secs / n_cpus });
+
+        ret.push_back(est);
+    }
+
+    return ret;
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
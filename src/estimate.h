@@ -0,0 +1,126 @@
+/* estimate.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef estimate_h_INCLUDED
+#define estimate_h_INCLUDED
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "templatedb.h"
+
+namespace khc {
+
+// This header defines the resource estimator, which predicts the peak memory
+// and run time of a khc run before it starts.  It reads no more than the
+// header of the database and the start of each query file, and multiplies
+// the sizes it finds by costs per unit of work.
+//
+// The costs are the estimate_coefs, whose defaults were measured with the
+// --stats output of khc and the benchmarks (make bench), on a single core.
+// Machines differ, so they can be overridden from a file, for instance with
+// the costs measured on the machine itself.
+
+
+// estimate_coefs - the costs of the units of work, in nanoseconds, and the
+//                  sizes that are not in the headers
+//
+struct estimate_coefs
+{
+    double parse_ns_per_byte = 1.1;         // reading and parsing query input
+    double inflate_ns_per_byte = 3.0;       // per byte of gzipped input, inflated
+    double kmerise_ns_per_kmer = 60.0;
+    double vector_ns_per_lookup = 90.0;
+    double map_ns_per_lookup_level = 13.5;  // per level of the map, log2(kmers)
+    double map_ns_per_uncached_level = 160.0;   // per level that is not in cache
+    double cache_mb = 1.0;                  // the cache a lookup finds levels in
+    double shared_ns_per_lookup = 45.0;
+    double partition_ns_per_lookup = 50.0;  // per partition searched
+    double count_ns_per_kmer = 90.0;        // counting the kmers with -u
+    double distinct_kmer_fraction = 0.16;   // distinct kmers in a query, for -u
+    double load_ns_per_kloc = 40.0;         // reading a binary db
+    double build_ns_per_kloc = 600.0;       // building a db from FASTA
+    double vector_ns_per_slot = 3.0;        // allocating the vector kmer index
+    double read_ns_per_byte = 0.5;          // reading a partition
+    double kmers_per_position = 0.1;        // distinct kmers in a FASTA db
+    double base_mb = 4.0;                   // the program itself
+    double stream_mb = 6.0;                 // the buffers of a streamed query
+    double pipeline_mb_per_lane = 16.0;     // the batches in flight per lane
+
+    // set the coefficients named in file fname, which has lines 'NAME VALUE',
+    // blank or starting with '#' for a comment
+    void read(const std::string& fname);
+
+    // write the coefficients in the format that read() reads
+    std::ostream& write(std::ostream&) const;
+};
+
+
+// input_size - the size of a sequence file, estimated from its file size and
+//              a sample of its start, see size_input()
+//
+struct input_size
+{
+    std::string fname;
+    std::string format;             // fasta, fastq or bare
+    bool compressed = false;
+    std::uint64_t file_bytes = 0;
+    std::uint64_t bytes = 0;        // once decompressed
+    std::uint64_t seqs = 0;
+    std::uint64_t id_bytes = 0;     // of the sequence IDs
+    std::uint64_t bases = 0;
+    std::uint64_t kmers = 0;        // kmer positions at ksize
+};
+
+// size_input - estimate the size of sequence file fname, which must be a
+//              regular file, by parsing at most its first few MB
+extern input_size size_input(const std::string& fname, int ksize);
+
+// size_fasta_db - set the sizes in st of the FASTA db in input, as peek()
+//                 does for a binary db, and its estimate_memory backends
+extern void size_fasta_db(const input_size& input, const estimate_coefs& coefs, db_stats& st);
+
+
+// run_estimate - the predicted memory and time of a run using one backend
+//
+struct run_estimate
+{
+    std::string backend;
+    bool used = false;              // the backend that khc would use
+    std::uint64_t db_bytes = 0;     // see estimate_memory
+    std::uint64_t query_bytes = 0;  // the concurrent queries at their largest
+    std::uint64_t peak_bytes = 0;   // all in
+    double load_secs = 0;
+    double query_secs = 0;          // all queries
+    std::vector<double> secs;       // each query on its own
+
+    double total_secs() const { return load_secs + query_secs; }
+};
+
+// estimate_run - estimate the run of the queries with opts on n_threads (-p)
+//                against db st, for each backend in st.backends; from_fasta
+//                tells whether the db is built, rather than read
+extern std::vector<run_estimate> estimate_run(const db_stats& st, bool from_fasta,
+        const std::vector<input_size>& queries, const query_options& opts, int n_threads,
+        const estimate_coefs& coefs);
+
+
+} // namespace khc
+
+#endif // estimate_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
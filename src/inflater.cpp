@@ -0,0 +1,461 @@
+/* inflater.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NO_ZLIB
+
+#include <algorithm>
+#include <cstring>
+#include <zlib.h>
+
+#include "seqreader.h"
+#include "utils.h"
+
+namespace khc {
+
+static const int MAX_INFLATE_THREADS = 8;
+static const std::size_t INPUT_CHUNK = 1 << 18;
+static const std::size_t BATCH_SIZE = 1 << 19;     // compressed bytes per BGZF batch
+static const std::size_t GZIP_RING = 4;
+static const std::size_t BGZF_HEADER = 12;         // gzip header up to the extra field
+static const std::size_t BGZF_TRAILER = 8;         // CRC32 and ISIZE
+
+static inline std::size_t
+le16(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline std::uint32_t
+le32(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+}
+
+// zstream - z_stream set up for inflate, with windowBits as for inflateInit2
+//
+struct zstream : public z_stream
+{
+    zstream(int window_bits)
+    {
+        zalloc = Z_NULL;
+        zfree = Z_NULL;
+        opaque = Z_NULL;
+        next_in = Z_NULL;
+        avail_in = 0;
+
+        if (inflateInit2(this, window_bits) != Z_OK)
+            raise_error("failed to initialise zlib");
+    }
+
+    ~zstream() { inflateEnd(this); }
+
+    const char* error() const { return msg ? msg : "invalid compressed data"; }
+};
+
+
+gzip_inflater::gzip_inflater(std::istream &is, int n_threads)
+    : is_(is), in_pos_(0), n_in_(0), n_queued_(0), n_claimed_(0), n_read_(0), out_pos_(0), eof_(false), stop_(false)
+{
+    if (n_threads <= 0)
+        n_threads = std::max(1, std::min(static_cast<int>(std::thread::hardware_concurrency()), MAX_INFLATE_THREADS));
+
+    std::size_t avail = fill_input(BGZF_HEADER);
+
+    if (avail >= BGZF_HEADER)
+        avail = fill_input(BGZF_HEADER + le16(reinterpret_cast<const unsigned char*>(in_.data()) + 10));
+
+    bool bgzf = bgzf_block_size(in_.data(), avail) != 0;
+
+    if (bgzf)
+        verbose_emit("inflating BGZF input on %d thread%s", n_threads, n_threads == 1 ? "" : "s");
+
+    ring_.resize(bgzf ? 2 * n_threads + 2 : GZIP_RING);
+
+    threads_.push_back(std::thread([this, bgzf]() {
+        try
+        {
+            if (bgzf)
+                run_bgzf();
+            else
+                run_gzip();
+        }
+        catch (const std::exception& e)
+        {
+            fail(e.what());
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        eof_ = true;
+        cond_.notify_all();
+    }));
+
+    for (int i = 0; bgzf && i != n_threads; ++i)
+        threads_.push_back(std::thread([this]() {
+            try
+            {
+                run_worker();
+            }
+            catch (const std::exception& e)
+            {
+                fail(e.what());
+            }
+        }));
+}
+
+gzip_inflater::~gzip_inflater()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+        cond_.notify_all();
+    }
+
+    for (std::thread& t : threads_)
+        t.join();
+}
+
+std::size_t
+gzip_inflater::bgzf_block_size(const char *p, std::size_t len)
+{
+    const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+
+    if (len < BGZF_HEADER || u[0] != 0x1f || u[1] != 0x8b || u[2] != 8 || u[3] != 4)
+        return 0;
+
+    std::size_t hdr_len = BGZF_HEADER + le16(u + 10);
+
+    if (len < hdr_len)
+        return 0;
+
+    for (std::size_t i = BGZF_HEADER; i + 4 <= hdr_len; i += 4 + le16(u + i + 2))
+        if (u[i] == 'B' && u[i+1] == 'C' && le16(u + i + 2) == 2 && i + 6 <= hdr_len)
+        {
+            std::size_t size = le16(u + i + 4) + 1;
+            return size >= hdr_len + BGZF_TRAILER ? size : 0;
+        }
+
+    return 0;
+}
+
+// fill_input - make at least min bytes of stream data available at in_pos_,
+//              or as many as are left; returns the number available
+//
+std::size_t
+gzip_inflater::fill_input(std::size_t min)
+{
+    if (in_.size() - in_pos_ >= min)
+        return in_.size() - in_pos_;
+
+    in_.erase(in_.begin(), in_.begin() + in_pos_);
+    in_pos_ = 0;
+
+    while (in_.size() < min && is_)
+    {
+        std::size_t n = in_.size();
+        in_.resize(n + std::max(min - n, INPUT_CHUNK));
+        is_.read(in_.data() + n, in_.size() - n);
+        in_.resize(n + is_.gcount());
+        n_in_ += is_.gcount();
+    }
+
+    return in_.size();
+}
+
+// wait_free_slot - wait until slot n_queued_ is no longer in use; returns
+//                  false if the inflater is stopping
+//
+bool
+gzip_inflater::wait_free_slot()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this]() { return stop_ || n_queued_ - n_read_ < ring_.size(); });
+    return !stop_;
+}
+
+// queue_slot - hand slot n_queued_ to the workers (BGZF), or to read() when
+//              it already holds the inflated data
+//
+void
+gzip_inflater::queue_slot()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    ring_[n_queued_ % ring_.size()].ready = ring_[n_queued_ % ring_.size()].in.empty();
+    ++n_queued_;
+    cond_.notify_all();
+}
+
+void
+gzip_inflater::fail(const char *what)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (error_.empty())
+        error_ = what;
+
+    stop_ = true;
+    cond_.notify_all();
+}
+
+// run_gzip - inflate the stream into the ring on this one thread; members
+//            are inflated back to back, and anything after the last member
+//            that does not look like a gzip header is ignored, as gzip does
+//
+void
+gzip_inflater::run_gzip()
+{
+    zstream zs(15 + 16);
+    bool in_member = true;
+    bool done = false;
+
+    zs.next_in = reinterpret_cast<Bytef*>(in_.data() + in_pos_);
+    zs.avail_in = in_.size() - in_pos_;
+
+    while (!done && wait_free_slot())
+    {
+        slot &s = ring_[n_queued_ % ring_.size()];
+        s.in.clear();
+        s.out.resize(BLOCK_SIZE);
+
+        zs.next_out = reinterpret_cast<Bytef*>(s.out.data());
+        zs.avail_out = s.out.size();
+
+        while (zs.avail_out && !done)
+        {
+            if (!zs.avail_in)
+            {
+                in_pos_ = in_.size();
+
+                if (!fill_input(1))
+                {
+                    if (in_member)
+                        raise_error("unexpected end of compressed input");
+                    done = true;
+                    break;
+                }
+
+                if (!in_member)
+                {
+                    if (in_[in_pos_] != 0x1f)
+                    {
+                        done = true;
+                        break;
+                    }
+
+                    inflateReset(&zs);
+                    in_member = true;
+                }
+
+                zs.next_in = reinterpret_cast<Bytef*>(in_.data() + in_pos_);
+                zs.avail_in = in_.size() - in_pos_;
+            }
+
+            int ret = inflate(&zs, Z_NO_FLUSH);
+
+            if (ret == Z_STREAM_END)
+            {
+                // a next member may follow in the data we have, or later
+
+                in_member = false;
+                in_pos_ = in_.size() - zs.avail_in;
+
+                if (zs.avail_in)
+                {
+                    if (in_[in_pos_] != 0x1f)
+                        done = true;
+                    else
+                    {
+                        inflateReset(&zs);
+                        in_member = true;
+                    }
+                }
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+                raise_error("failed to decompress input: %s", zs.error());
+        }
+
+        s.out.resize(s.out.size() - zs.avail_out);
+        queue_slot();
+    }
+}
+
+// run_bgzf - cut the stream into batches of whole BGZF blocks for the workers;
+//            if a member follows that is not a BGZF block, the rest of the
+//            stream is inflated by run_gzip, and as there ignoring anything
+//            that does not look like a gzip header
+//
+void
+gzip_inflater::run_bgzf()
+{
+    bool done = false, serial = false;
+
+    while (!done && wait_free_slot())
+    {
+        slot &s = ring_[n_queued_ % ring_.size()];
+        s.in.clear();
+
+        while (s.in.size() < BATCH_SIZE)
+        {
+            std::size_t avail = fill_input(BGZF_HEADER);
+
+            if (!avail)
+            {
+                done = true;
+                break;
+            }
+
+            if (avail >= BGZF_HEADER)
+                avail = fill_input(BGZF_HEADER + le16(reinterpret_cast<const unsigned char*>(in_.data() + in_pos_) + 10));
+
+            std::size_t size = bgzf_block_size(in_.data() + in_pos_, avail);
+
+            if (!size)
+            {
+                serial = in_[in_pos_] == 0x1f;
+                done = true;
+                break;
+            }
+
+            if (fill_input(size) < size)
+                raise_error("unexpected end of compressed input");
+
+            s.in.insert(s.in.end(), in_.begin() + in_pos_, in_.begin() + in_pos_ + size);
+            in_pos_ += size;
+        }
+
+        if (!s.in.empty())
+            queue_slot();
+    }
+
+    if (serial)
+    {
+        verbose_emit("compressed input has a member that is not BGZF, inflating the rest on one thread");
+        run_gzip();
+    }
+}
+
+// run_worker - inflate queued batches of BGZF blocks, checking each block's
+//              size and CRC against its trailer; slots queued by run_gzip
+//              are ready when queued, and are passed over
+//
+void
+gzip_inflater::run_worker()
+{
+    zstream zs(-15);
+
+    for (;;)
+    {
+        std::size_t seq;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this]() { return stop_ || eof_ || n_claimed_ < n_queued_; });
+
+            if (stop_ || n_claimed_ == n_queued_)
+                return;
+
+            seq = n_claimed_++;
+
+            if (ring_[seq % ring_.size()].ready)
+                continue;
+        }
+
+        slot &s = ring_[seq % ring_.size()];
+        const char *p = s.in.data(), *e = p + s.in.size();
+        std::size_t out_len = 0;
+
+        for (const char *q = p; q != e; q += bgzf_block_size(q, e - q))
+            out_len += le32(reinterpret_cast<const unsigned char*>(q + bgzf_block_size(q, e - q) - 4));
+
+        s.out.resize(out_len);
+        out_len = 0;
+
+        for (; p != e; p += bgzf_block_size(p, e - p))
+        {
+            const unsigned char *u = reinterpret_cast<const unsigned char*>(p);
+            std::size_t size = bgzf_block_size(p, e - p);
+            std::size_t hdr_len = BGZF_HEADER + le16(u + 10);
+            std::uint32_t isize = le32(u + size - 4);
+
+            if (!isize)
+                continue;
+
+            Bytef *out = reinterpret_cast<Bytef*>(s.out.data() + out_len);
+
+            inflateReset(&zs);
+            zs.next_in = const_cast<Bytef*>(u + hdr_len);
+            zs.avail_in = size - hdr_len - BGZF_TRAILER;
+            zs.next_out = out;
+            zs.avail_out = isize;
+
+            if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out)
+                raise_error("failed to decompress BGZF block: %s", zs.error());
+
+            if (crc32(0, out, isize) != le32(u + size - 8))
+                raise_error("failed to decompress BGZF block: CRC mismatch");
+
+            out_len += isize;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        s.ready = true;
+        cond_.notify_all();
+    }
+}
+
+std::size_t
+gzip_inflater::read(char *buf, std::size_t n)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    for (;;)
+    {
+        if (!error_.empty())
+            raise_error("%s", error_.c_str());
+
+        if (n_read_ < n_queued_ && ring_[n_read_ % ring_.size()].ready)
+        {
+            const slot &s = ring_[n_read_ % ring_.size()];
+
+            if (out_pos_ != s.out.size())
+            {
+                lock.unlock();
+
+                n = std::min(n, s.out.size() - out_pos_);
+                std::memcpy(buf, s.out.data() + out_pos_, n);
+                out_pos_ += n;
+
+                return n;
+            }
+
+            ++n_read_;
+            out_pos_ = 0;
+            cond_.notify_all();
+        }
+        else if (eof_ && n_read_ == n_queued_)
+            return 0;
+        else
+            cond_.wait(lock);
+    }
+}
+
+
+} // namespace khc
+
+#endif // NO_ZLIB
+
+// vim: sts=4:sw=4:ai:si:et
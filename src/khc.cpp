@@ -16,26 +16,43 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <vector>
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
+#include <climits>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "templatedb.h"
+#include "estimate.h"
 #include "kmerdb.h"
+#include "batch.h"
+#include "kmerise.h"
+#include "mlst.h"
+#include "server.h"
+#include "trace.h"
 #include "utils.h"
 
 using namespace khc;
 
 static const int MAX_KSIZE = 31;
 static const int MAX_VARS = 1024;
+static const int MAX_THREADS = 256;
 static const double DEFAULT_COV = 90.0;
+static const int NO_SERVER_STATUS = 2;
 
 static const char USAGE[] = "\n"
 "Usage: khc [OPTIONS] SUBJECTS [QUERY ...]\n"
+"       khc [OPTIONS] --serve SOCKET SUBJECTS\n"
+"       khc [OPTIONS] --connect SOCKET [QUERY ...]\n"
 "\n"
 "  For each QUERY in turn, map all its k-mers on each sequence in SUBJECTS.\n"
 "  Report for each QUERY the sequences in SUBJECTS that are covered by QUERY\n"
@@ -50,10 +67,61 @@ static const char USAGE[] = "\n"
 "             that contains degenerate bases\n"
 "   -s        skip k-mers in QUERY that contain degenerate bases (including\n"
 "             N), instead of terminating the program when one is encountered\n"
+"   -q QUAL   skip k-mers in FASTQ QUERY that contain a base with Phred score\n"
+"             below QUAL (scores are read as Phred+33 encoded)\n"
+"   -u        look up each distinct k-mer in QUERY only once; this speeds up\n"
+"             queries on high depth reads, at the cost of memory to count them\n"
+"   -n NUM    look up only 'solid' k-mers that occur at least NUM times in\n"
+"             QUERY, so as to ignore k-mers with sequencing errors in reads;\n"
+"             counts are exact with -u, else estimated in fixed memory (16MB)\n"
+"   -e N      stop reading QUERY when for N consecutive batches of 1M k-mers\n"
+"             the best covered sequence per locus has not changed (see below)\n"
+"   -d DEPTH  count a base as covered only when hit by at least DEPTH k-mers\n"
+"             from QUERY, and add the mean depth of each sequence to the output\n"
+"   --prescreen NUM   first match a sample of QUERY against a sketch of the\n"
+"             k-mers unique to each scheme, then report only sequences in the\n"
+"             NUM best matching schemes (see below)\n"
+"   --pipeline NUM    read and parse QUERY on a thread of its own, and split\n"
+"             it into k-mers on NUM threads, while the k-mers are looked up;\n"
+"             with -v, reports how busy each stage was\n"
+"   --db-stats        report what is in SUBJECTS and the memory it takes in\n"
+"             each backend, then exit, instead of running queries (see below)\n"
+"   --estimate        predict the peak memory and run time of the QUERY runs\n"
+"             with each backend, from the header of SUBJECTS and the size of\n"
+"             each QUERY, then exit, instead of running them (see below)\n"
+"   --coefs FILE      with --estimate, read the costs it uses from FILE\n"
+"   --stats FILE      write the timings and counters of the load and of each\n"
+"             QUERY to FILE as JSON (see below); -v reports them to stderr\n"
+"   --trace FILE      write a timeline of the run to FILE, in Chrome trace\n"
+"             event format, for viewing in chrome://tracing or Perfetto\n"
 "   -t        precede QUERY outputs by a title line '## Query: NAME'\n"
 "   -w FILE   write an optimised binary representation of SUBJECTS to FILE;\n"
 "             FILE can then be used instead of SUBJECT, with large speed gains\n"
+"   --partition       with -w, write FILE partitioned by scheme, so that its\n"
+"             parts are loaded only when a query needs them (see below)\n"
 "   -m MEM    constrain memory use to about MEM GB (default: all minus 2GB)\n"
+"   -b FILE   batch mode: read additional QUERY file names from FILE, one per\n"
+"             line, optionally preceded by a NAME and a tab (see below)\n"
+"   -p NUM    process NUM queries concurrently (default 1); this bounds memory\n"
+"             use to that of SUBJECTS plus NUM queries\n"
+"   -o DIR    write the output for each QUERY to file DIR/NAME.khc, where NAME\n"
+"             is the name given in the batch FILE, or else the QUERY file name,\n"
+"             in either case stripped of any directory part (with --mlst, the\n"
+"             file is DIR/NAME.mlst); queries with the same NAME are refused\n"
+"   --shm NAME        share SUBJECTS between khc processes through shared memory\n"
+"             segment NAME: attach to it if it exists, else read SUBJECTS and\n"
+"             publish it as NAME for later processes (see below)\n"
+"   --shm-remove NAME remove shared memory segment NAME and exit\n"
+"   --mlst DIR        output the MLST typing of each QUERY against the kcst\n"
+"             database in DIR (see below), instead of the k-mer hits\n"
+"   --sep C           separate alleles and loci by character C in the MLST\n"
+"             output (default '-')\n"
+"   --serve SOCKET    load SUBJECTS and keep serving queries on SOCKET, until\n"
+"             terminated by SIGINT or SIGTERM; NUM (-p) bounds the number of\n"
+"             queries served concurrently\n"
+"   --connect SOCKET  send each QUERY to the server on SOCKET, instead of\n"
+"             loading SUBJECTS; the query options (-c, -s, etc) apply; exits\n"
+"             with status 2 if no server is listening on SOCKET\n"
 "   -v        produce verbose output to stderr\n"
 "\n"
 "  File SUBJECTS must be either (optionally compressed) FASTA or an optimised\n"
@@ -69,8 +137,86 @@ static const char USAGE[] = "\n"
 "  have degenerate bases, or option -s must be set to skip query k-mers with\n"
 "  degenerate bases.\n"
 "\n"
+"  The OUTPUT has a line 'SEQID LEN HITS COV' for each sequence in SUBJECTS\n"
+"  that reaches COV, where LEN is its number of k-mers, HITS the number of\n"
+"  those k-mers hit by QUERY, and COV the percentage HITS/LEN.  With -d, it\n"
+"  has a fifth column with the mean depth: total k-mer hits divided by LEN\n"
+"  (saturating at 65535 per base).\n"
+"\n"
 "  The OUTPUT of each QUERY is separated from the preceding QUERY by a single\n"
-"  empty line.  Use option -t to add '## QUERY' title lines.\n"
+"  empty line.  Use option -t to add '## QUERY' title lines.  When NUM > 1 and\n"
+"  no DIR is given, outputs appear in order of completion, and -t is implied.\n"
+"\n"
+"  Early termination (-e N) is meant for raw reads at high depth, where the\n"
+"  result usually settles long before all reads are processed.  The locus of\n"
+"  a sequence in SUBJECTS is taken to be the part of its ID before the last\n"
+"  ':' (as in 'scheme:locus:allele'), or else the last '_' (as in 'adk_12').\n"
+"  Use -v to see how much of QUERY was read.\n"
+"\n"
+"  The prescreen (--prescreen NUM) is meant for databases holding schemes for\n"
+"  many species.  The scheme of a sequence is the part of its ID before the\n"
+"  first ':'.  The first 2M k-mers of QUERY are matched against a 1-in-16\n"
+"  sample of the k-mers that occur in one scheme only; schemes with fewer\n"
+"  than 10%% of the best scheme's matches are dropped.  The sketch is built\n"
+"  when SUBJECTS is loaded, which takes a pass over it, and is stored by -w,\n"
+"  so that a binary or partitioned FILE loads it instead.  With --shm, it is\n"
+"  built when first needed.  Use -v to see the sketch and candidate schemes.\n"
+"\n"
+"  A partitioned FILE (-w FILE --partition) has the k-mers of each scheme in\n"
+"  a separate part, and stores the prescreen sketch.  It is mapped into\n"
+"  memory, and a part is loaded only when a query first needs it, so with a\n"
+"  prescreen, startup time and memory use scale with the schemes queried.\n"
+"  Without a prescreen, all parts are searched, which is slower than using\n"
+"  an unpartitioned FILE.\n"
+"\n"
+"  Batch mode (-b FILE) reads SUBJECTS once, then runs all queries against it.\n"
+"  Each non-empty line in FILE that does not start with '#' names a QUERY, as\n"
+"  either 'PATH' or 'NAME<tab>PATH'.  NAME defaults to PATH.\n"
+"\n"
+"  MLST typing (--mlst DIR) reads the scheme config DIR/kcst.cfg and profile\n"
+"  table DIR/kcst.tsv, both generated by make-kcst-db.sh, and outputs for each\n"
+"  QUERY the lines 'ID NAME ST PROFILE LOCI ALLELE...' documented for kcst.\n"
+"  ID is the QUERY NAME stripped of directory and extensions.  Outputs are not\n"
+"  separated by empty lines, and title lines are not implied by NUM > 1.\n"
+"\n"
+"  Shared memory (--shm NAME) lets concurrent khc processes use one in-memory\n"
+"  copy of SUBJECTS.  NAME is a POSIX shared memory name (on Linux a file in\n"
+"  /dev/shm), or if it has a '/', a file path, e.g. on a hugetlbfs mount.  The\n"
+"  segment persists until removed with --shm-remove.  It records the SUBJECTS\n"
+"  file it was published from, and khc refuses to use it with another one.\n"
+"  A process that finds the segment being published waits for it; a segment\n"
+"  left incomplete for over a minute, by a process that died, is replaced.\n"
+"\n"
+"  Server mode (--serve) saves the time to load SUBJECTS on each invocation.\n"
+"  The server reads QUERY files by their absolute path, so it must be able\n"
+"  to access these.  A QUERY read from stdin is streamed over the socket.\n"
+"\n"
+"  The database report (--db-stats) has the numbers of sequences, distinct\n"
+"  k-mers and k-mer locations, a histogram of k-mers by their number of\n"
+"  locations, the k-mers shared by most sequences, the sequences whose\n"
+"  degenerate bases add the most k-mer variants, and the estimated memory of\n"
+"  SUBJECTS in each backend: vector and map (chosen by -m), shared (--shm),\n"
+"  and partitioned (-w FILE --partition), plus the memory per query (-p).\n"
+"\n"
+"  The stats file (--stats FILE) has the wall and CPU seconds of loading\n"
+"  SUBJECTS, and for each QUERY those of its phases (prescreen, parse,\n"
+"  kmerise, lookup, tally), its counts of sequences, k-mers, skipped k-mers,\n"
+"  lookup hits and misses, and k-mer locations visited, and the k-mers with\n"
+"  the most locations.  With --pipeline, the phases overlap in time.\n"
+"\n"
+"  The estimate (--estimate) reads the header of SUBJECTS, or a sample of it\n"
+"  if it is FASTA, and a sample of each QUERY, which must be a regular file.\n"
+"  It reports the predicted peak memory, load and query seconds for each\n"
+"  backend, the backend khc would use with the given options, the seconds of\n"
+"  each QUERY, and the costs it is based on.  These default to those of the\n"
+"  machine khc was tuned on; --coefs FILE overrides them with lines 'NAME\n"
+"  VALUE' in FILE, in the format of that last report section.  Disk I/O and\n"
+"  early termination (-e) are not foreseen.\n"
+"\n"
+"  The trace (--trace FILE) has spans for the database load, each query and\n"
+"  its prescreen, lookups, tally and output, on a row per thread.  With\n"
+"  --pipeline, each batch of query sequences has its parse, kmerise and\n"
+"  lookup spans, which show where the stages wait for each other.\n"
 "\n"
 "  More information: http://io.zwets.it/kcst.\n"
 "\n";
@@ -83,20 +229,254 @@ usage_exit()
     std::exit(1);
 }
 
-int main (int, char *argv[]) 
+// write_result - write query result res to os in khc's output format
+//
+static void
+write_result(std::ostream& os, const query_result& res, bool with_depth)
+{
+    for (size_t i = 0; i != res.size(); ++i)
+    {
+        os << res[i].seqid << ' ' << res[i].len << ' ' << res[i].hits << ' ' << res[i].phit;
+
+        if (with_depth)
+            os << ' ' << res[i].depth;
+
+        os << std::endl;
+    }
+}
+
+// source_tag - identifies the template file fname by path, size and mtime
+//
+static std::string
+source_tag(const std::string& fname)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!realpath(fname.c_str(), path) || stat(path, &st) != 0)
+        raise_error("cannot access template file: %s", fname.c_str());
+
+    std::ostringstream os;
+    os << path << ' ' << st.st_size << ' ' << st.st_mtime;
+
+    return os.str();
+}
+
+// fixed - x with the given number of decimals
+// mb - n bytes in MB, with one decimal
+
+static std::string
+fixed(double x, int decimals)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.*f", decimals, x);
+    return std::string(buf);
+}
+
+static std::string
+mb(std::uint64_t n)
+{
+    return fixed(n / 1048576.0, 1);
+}
+
+// write_db_stats - write report st on database fname to os
+
+static void
+write_db_stats(std::ostream& os, const std::string& fname, const db_stats& st)
+{
+    os << "# database: " << fname << std::endl
+       << "backend\t" << st.backend_name << std::endl
+       << "ksize\t" << st.ksize << std::endl
+       << "max variants\t" << st.max_vars << std::endl
+       << "sequences\t" << st.n_seqs << std::endl
+       << "loci\t" << st.n_loci << std::endl
+       << "schemes\t" << st.n_schemes << std::endl
+       << "kmer positions\t" << st.n_positions << std::endl
+       << "distinct kmers\t" << st.n_kmers << std::endl
+       << "kmer locations\t" << st.n_klocs << std::endl
+       << "sequences with variants\t" << st.n_blown << std::endl
+       << "prescreen sketch kmers\t" << st.n_sketch << std::endl;
+
+    os << std::endl << "# kmers by locations: min max kmers percent" << std::endl;
+
+    for (std::size_t i = 0; i != st.kloc_hist.size(); ++i)
+        os << (1ULL << i) << '\t' << (2ULL << i) - 1 << '\t' << st.kloc_hist[i] << '\t'
+           << fixed(st.n_kmers ? 100.0 * st.kloc_hist[i] / st.n_kmers : 0.0, 1) << std::endl;
+
+    os << std::endl << "# most shared kmers: kmer sequences locations" << std::endl;
+
+    for (const db_stats::shared_kmer& sk : st.most_shared)
+        os << knum_to_string(sk.kmer, st.ksize) << '\t' << sk.n_seqs << '\t' << sk.n_klocs << std::endl;
+
+    os << std::endl << "# largest variant blow-up: sequence positions locations ratio" << std::endl;
+
+    for (const db_stats::blowup& b : st.blowups)
+        os << b.seq_id << '\t' << b.n_positions << '\t' << b.n_klocs << '\t'
+           << fixed(static_cast<double>(b.n_klocs) / b.n_positions, 2) << std::endl;
+
+    os << std::endl << "# estimated memory in MB: backend total structure:size ..." << std::endl;
+
+    for (const db_stats::backend& be : st.backends)
+    {
+        os << be.name << '\t' << mb(be.total());
+
+        for (const auto& part : be.parts)
+            os << '\t' << part.first << ':' << mb(part.second);
+
+        os << std::endl;
+    }
+
+    os << "per query\t" << mb(st.n_acc_words * sizeof(std::uint64_t) + st.n_seqs)
+       << "\twith -d\t" << mb(st.n_acc_words * 64 * sizeof(depth_accumulator::depth_t) + st.n_seqs) << std::endl;
+}
+
+// write_estimate - write the estimates ests of running queries against the
+//                  database fname, sized in st, to os
+
+static void
+write_estimate(std::ostream& os, const std::string& fname, const db_stats& st, bool from_fasta,
+        const std::vector<input_size>& queries, const std::vector<run_estimate>& ests,
+        const estimate_coefs& coefs)
+{
+    const run_estimate *used = 0;
+
+    for (const run_estimate& est : ests)
+        if (est.used)
+            used = &est;
+
+    os << "# database: " << fname << std::endl
+       << "format\t" << (from_fasta ? "FASTA (sizes estimated from a sample)" :
+               st.part_bytes.empty() ? "binary" : "partitioned") << std::endl
+       << "backend\t" << (used ? used->backend : st.backend_name) << std::endl
+       << "ksize\t" << st.ksize << std::endl
+       << "sequences\t" << st.n_seqs << std::endl;
+
+    if (!from_fasta)
+        os << "schemes\t" << st.n_schemes << std::endl;
+
+    os << "kmer positions\t" << st.n_positions << std::endl;
+
+    if (st.part_bytes.empty())
+        os << "distinct kmers\t" << st.n_kmers << std::endl;
+
+    os << std::endl << "# queries: file format compressed MB sequences bases kmers" << std::endl;
+
+    for (const input_size& q : queries)
+        os << q.fname << '\t' << q.format << '\t' << (q.compressed ? "yes" : "no") << '\t' << mb(q.bytes)
+           << '\t' << q.seqs << '\t' << q.bases << '\t' << q.kmers << std::endl;
+
+    os << std::endl << "# estimates: backend peak_MB database_MB queries_MB load_s queries_s total_s" << std::endl;
+
+    for (const run_estimate& est : ests)
+        os << est.backend << '\t' << mb(est.peak_bytes) << '\t' << mb(est.db_bytes) << '\t' << mb(est.query_bytes)
+           << '\t' << fixed(est.load_secs, 2) << '\t' << fixed(est.query_secs, 2)
+           << '\t' << fixed(est.total_secs(), 2) << std::endl;
+
+    if (used)
+    {
+        os << std::endl << "# seconds per query with the " << used->backend << " backend: file seconds" << std::endl;
+
+        for (std::size_t i = 0; i != queries.size(); ++i)
+            os << queries[i].fname << '\t' << fixed(used->secs[i], 2) << std::endl;
+    }
+
+    os << std::endl << "# coefficients: name value" << std::endl;
+    coefs.write(os);
+}
+
+// json_phase - phase times t as a JSON object
+
+static std::string
+json_phase(const phase_times& t)
+{
+    char buf[80];
+    std::snprintf(buf, sizeof(buf), "{ \"wall\": %.6f, \"cpu\": %.6f }", t.wall, t.cpu);
+    return buf;
+}
+
+// emit_stats - report query stats st with verbose_emit
+
+static void
+emit_stats(const std::string& name, const query_stats& st)
+{
+    std::uint64_t n_lookups = st.n_hits + st.n_misses;
+
+    verbose_emit("query %s: %lu sequences, %lu kmers, %lu skipped, %.0f kmers/s", name.c_str(),
+            static_cast<unsigned long>(st.n_seqs), static_cast<unsigned long>(st.n_kmers),
+            static_cast<unsigned long>(st.n_skipped), st.total.wall > 0.0 ? st.n_kmers / st.total.wall : 0.0);
+    verbose_emit("query %s: %lu lookups, %.1f%% hits, %.1f klocs per hit", name.c_str(),
+            static_cast<unsigned long>(n_lookups), n_lookups ? 100.0 * st.n_hits / n_lookups : 0.0,
+            st.n_hits ? static_cast<double>(st.n_klocs) / st.n_hits : 0.0);
+    verbose_emit("query %s: seconds wall/cpu: prescreen %.3f/%.3f, parse %.3f/%.3f, kmerise %.3f/%.3f, "
+            "lookup %.3f/%.3f, tally %.3f/%.3f, total %.3f/%.3f", name.c_str(),
+            st.prescreen.wall, st.prescreen.cpu, st.parse.wall, st.parse.cpu, st.kmerise.wall, st.kmerise.cpu,
+            st.lookup.wall, st.lookup.cpu, st.tally.wall, st.tally.cpu, st.total.wall, st.total.cpu);
+}
+
+// write_stats - write the load time and the stats of the queries in jobs to
+//               fname as JSON, with the longest kmers decoded at ksize
+
+static void
+write_stats(const std::string& fname, const phase_times& load, int ksize,
+        const std::vector<query_job>& jobs, const std::vector<query_stats>& stats)
+{
+    std::ofstream os(fname);
+
+    os << "{\n  \"load\": " << json_phase(load) << ",\n  \"queries\": [";
+
+    for (std::size_t i = 0; i != jobs.size(); ++i)
+    {
+        const query_stats& st = stats[i];
+
+        os << (i ? ",\n" : "\n")
+           << "    { \"name\": " << json_string(jobs[i].name) << ", \"file\": " << json_string(jobs[i].fname) << ",\n"
+           << "      \"phases\": { \"prescreen\": " << json_phase(st.prescreen) << ", \"parse\": " << json_phase(st.parse)
+           << ", \"kmerise\": " << json_phase(st.kmerise) << ", \"lookup\": " << json_phase(st.lookup)
+           << ", \"tally\": " << json_phase(st.tally) << ", \"total\": " << json_phase(st.total) << " },\n"
+           << "      \"sequences\": " << st.n_seqs << ", \"kmers\": " << st.n_kmers << ", \"skipped\": " << st.n_skipped
+           << ", \"hits\": " << st.n_hits << ", \"misses\": " << st.n_misses << ", \"klocs\": " << st.n_klocs
+           << ", \"kmers_per_sec\": " << static_cast<std::uint64_t>(st.total.wall > 0.0 ? st.n_kmers / st.total.wall : 0.0) << ",\n"
+           << "      \"longest\": [";
+
+        for (std::size_t j = 0; j != st.longest.size(); ++j)
+            os << (j ? ", " : " ") << "{ \"kmer\": \"" << knum_to_string(st.longest[j].first, ksize) << "\", \"klocs\": " << st.longest[j].second << " }";
+
+        os << (st.longest.empty() ? "] }" : " ] }");
+    }
+
+    os << "\n  ],\n  \"peak_rss_kb\": " << (get_peak_rss() >> 10) << "\n}\n";
+
+    if (!os)
+        raise_error("failed to write stats file: %s", fname.c_str());
+}
+
+static int
+run_khc(char *argv[])
 {
     std::string tpl_fname;
-    std::string qry_fname;
     std::string out_fname;
+    bool write_partitioned = false;
+    std::string batch_fname;
+    std::string out_dir;
+    std::string serve_socket;
+    std::string connect_socket;
+    std::string shm_name;
+    std::string mlst_dir;
+    std::string stats_fname;
+    std::string trace_fname;
+    bool db_stats_only = false;
+    bool estimate_only = false;
+    std::string coefs_fname;
+    char mlst_sep = '-';
 
     int ksize = 0;
     int max_mem = 0;
     int max_vars = MAX_VARS;
-    double min_cov = DEFAULT_COV;
-    bool skip_degens = false;
+    int n_threads = 1;
     bool write_titles = false;
 
-    set_progname("khc");
+    query_options opts;
+    opts.min_cov_pct = DEFAULT_COV;
 
         // PARSE ARGUMENTS
 
@@ -106,7 +486,55 @@ int main (int, char *argv[])
             set_verbose(true);
         }
         else if (!std::strcmp("-s", *argv)) {
-            skip_degens = true;
+            opts.skip_degens = true;
+        }
+        else if (!std::strcmp("-q", *argv) && *++argv) {
+            opts.min_qual = std::atoi(*argv);
+            if (opts.min_qual < 0 || opts.min_qual > 93)
+                raise_error("invalid QUAL: %s", *argv);
+        }
+        else if (!std::strcmp("-u", *argv)) {
+            opts.dedup_kmers = true;
+        }
+        else if (!std::strcmp("-d", *argv) && *++argv) {
+            opts.min_depth = std::atoi(*argv);
+            if (opts.min_depth < 1 || opts.min_depth > 65535)
+                raise_error("invalid DEPTH: %s", *argv);
+        }
+        else if (!std::strcmp("-n", *argv) && *++argv) {
+            opts.min_kmer_count = std::atoi(*argv);
+            if (opts.min_kmer_count < 1 || opts.min_kmer_count > 255)
+                raise_error("invalid NUM: %s", *argv);
+        }
+        else if (!std::strcmp("-e", *argv) && *++argv) {
+            opts.converge_batches = std::atoi(*argv);
+            if (opts.converge_batches < 1)
+                raise_error("invalid N: %s", *argv);
+        }
+        else if (!std::strcmp("--prescreen", *argv) && *++argv) {
+            opts.prescreen = std::atoi(*argv);
+            if (opts.prescreen < 1)
+                raise_error("invalid NUM: %s", *argv);
+        }
+        else if (!std::strcmp("--pipeline", *argv) && *++argv) {
+            opts.pipeline = std::atoi(*argv);
+            if (opts.pipeline < 1 || opts.pipeline > MAX_THREADS)
+                raise_error("invalid NUM: %s", *argv);
+        }
+        else if (!std::strcmp("--db-stats", *argv)) {
+            db_stats_only = true;
+        }
+        else if (!std::strcmp("--estimate", *argv)) {
+            estimate_only = true;
+        }
+        else if (!std::strcmp("--coefs", *argv) && *++argv) {
+            coefs_fname = *argv;
+        }
+        else if (!std::strcmp("--stats", *argv) && *++argv) {
+            stats_fname = *argv;
+        }
+        else if (!std::strcmp("--trace", *argv) && *++argv) {
+            trace_fname = *argv;
         }
         else if (!std::strcmp("-t", *argv)) {
             write_titles = true;
@@ -114,13 +542,18 @@ int main (int, char *argv[])
         else if (!std::strcmp("-w", *argv) && *++argv) {
             out_fname = *argv;
         }
+        else if (!std::strcmp("--partition", *argv)) {
+            write_partitioned = true;
+        }
         else if (!std::strcmp("-k", *argv) && *++argv) {
             ksize = std::atoi(*argv);
             if (ksize < 1 || ksize > MAX_KSIZE) 
                 raise_error("invalid KSIZE: %s", *argv);
         }
         else if (!std::strcmp("-c", *argv) && *++argv) {
-            min_cov = std::atof(*argv);
+            opts.min_cov_pct = std::atof(*argv);
+            if (opts.min_cov_pct < 0 || opts.min_cov_pct > 100)
+                raise_error("invalid COV: %s", *argv);
         }
         else if (!std::strcmp("-m", *argv) && *++argv) {
             max_mem = std::atoi(*argv);
@@ -132,9 +565,46 @@ int main (int, char *argv[])
             if (max_vars < 0)
                 raise_error("invalid VARS: %s", *argv);
         }
-        else if (**argv == '-') {
+        else if (!std::strcmp("-b", *argv) && *++argv) {
+            batch_fname = *argv;
+        }
+        else if (!std::strcmp("-p", *argv) && *++argv) {
+            n_threads = std::atoi(*argv);
+            if (n_threads < 1 || n_threads > MAX_THREADS)
+                raise_error("invalid NUM: %s", *argv);
+        }
+        else if (!std::strcmp("-o", *argv) && *++argv) {
+            out_dir = *argv;
+        }
+        else if (!std::strcmp("--serve", *argv) && *++argv) {
+            serve_socket = *argv;
+        }
+        else if (!std::strcmp("--connect", *argv) && *++argv) {
+            connect_socket = *argv;
+        }
+        else if (!std::strcmp("--mlst", *argv) && *++argv) {
+            mlst_dir = *argv;
+        }
+        else if (!std::strcmp("--sep", *argv) && *++argv) {
+            if (std::strlen(*argv) != 1)
+                raise_error("invalid separator, must be a single character: %s", *argv);
+            mlst_sep = **argv;
+        }
+        else if (!std::strcmp("--shm", *argv) && *++argv) {
+            shm_name = *argv;
+        }
+        else if (!std::strcmp("--shm-remove", *argv) && *++argv) {
+            if (!shared_kmer_db::remove(*argv))
+                raise_error("no such shared memory segment: %s", *argv);
+            return 0;
+        }
+        else if (**argv == '-' && (connect_socket.empty() || (*argv)[1])) {
             usage_exit();
         }
+        else if (!connect_socket.empty()) {
+            --argv; // no SUBJECTS, this is the first QUERY
+            break;
+        }
         else {
             tpl_fname = *argv;
             verbose_emit("database file: %s", tpl_fname.c_str());
@@ -142,50 +612,296 @@ int main (int, char *argv[])
         }
     }
 
-    if (tpl_fname.empty())
+    if (!connect_socket.empty())
+    {
+        if (!serve_socket.empty() || !out_fname.empty())
+            raise_error("option --connect cannot be combined with --serve or -w");
+    }
+    else if (tpl_fname.empty())
         usage_exit();
 
+    if (!serve_socket.empty() && (argv[1] || !batch_fname.empty() || !mlst_dir.empty()))
+        raise_error("option --serve takes no QUERY arguments, batch file, or --mlst");
+
+    if (!stats_fname.empty() && (!serve_socket.empty() || !connect_socket.empty()))
+        raise_error("option --stats cannot be combined with --serve or --connect");
+
+    if (!trace_fname.empty() && (!serve_socket.empty() || !connect_socket.empty()))
+        raise_error("option --trace cannot be combined with --serve or --connect");
+
+    if (db_stats_only && (argv[1] || !batch_fname.empty() || !serve_socket.empty() || !connect_socket.empty()))
+        raise_error("option --db-stats takes no QUERY arguments, batch file, --serve or --connect");
+
+    if (estimate_only && (db_stats_only || !out_fname.empty() || !serve_socket.empty() || !connect_socket.empty()))
+        raise_error("option --estimate cannot be combined with --db-stats, -w, --serve or --connect");
+
+    if (!coefs_fname.empty() && !estimate_only)
+        raise_error("option --coefs requires --estimate");
+
+    std::unique_ptr<mlst_typer> typer;
+
+    if (!mlst_dir.empty())
+        typer.reset(new mlst_typer(mlst_dir));
+
+    if (opts.converge_batches && opts.dedup_kmers && opts.min_depth)
+        raise_error("option -e cannot be combined with both -u and -d");
+
+        // COLLECT QUERIES
+
+    std::vector<query_job> jobs;
+
+    while (*argv && *++argv)    // *argv is null if --connect had no QUERY
+        jobs.push_back({*argv, *argv});
+
+    if (!batch_fname.empty())
+        read_batch(batch_fname, jobs);
+
+        // ESTIMATE THE RUN
+
+    if (estimate_only)
+    {
+        estimate_coefs coefs;
+
+        if (!coefs_fname.empty())
+            coefs.read(coefs_fname);
+
+        db_stats st;
+        bool from_fasta = !template_db::peek(tpl_fname, st, max_mem, ksize, max_vars);
+
+        if (from_fasta)
+            size_fasta_db(size_input(tpl_fname, st.ksize), coefs, st);
+
+        if (!shm_name.empty())
+            st.backend_name = "shared";
+
+        std::vector<input_size> queries;
+
+        for (const auto& job : jobs)
+            queries.push_back(size_input(job.fname, st.ksize));
+
+        std::vector<run_estimate> ests = estimate_run(st, from_fasta, queries, opts, n_threads, coefs);
+        write_estimate(std::cout, tpl_fname, st, from_fasta, queries, ests, coefs);
+
+        return 0;
+    }
+
+    if (jobs.empty())
+        jobs.push_back({"-", "-"});
+
+    // check up front, so that a batch does not fail halfway through
+
+    int n_stdin = 0;
+
+    for (const auto& job : jobs)
+        if (job.fname == "-")
+            ++n_stdin;
+        else if (access(job.fname.c_str(), R_OK) != 0)
+            raise_error("cannot read query file: %s", job.fname.c_str());
+
+    if (n_stdin > 1)
+        raise_error("stdin ('-') can be read by one query only");
+
+    const std::string out_ext = typer ? ".mlst" : ".khc";
+
+    if (!out_dir.empty())
+    {
+        if (access(out_dir.c_str(), W_OK) != 0)
+            raise_error("cannot write to output directory: %s", out_dir.c_str());
+
+        check_output_paths(out_dir, jobs, out_ext);
+    }
+
+    if (n_threads > static_cast<int>(jobs.size()) && serve_socket.empty())
+        n_threads = jobs.size();
+
+    if (n_threads > 1 && out_dir.empty() && !write_titles && !typer)
+    {
+        verbose_emit("concurrent queries: adding title lines to output");
+        write_titles = true;
+    }
+
+        // CHECK THE SERVER, so the caller can fall back to loading SUBJECTS
+
+    if (!connect_socket.empty() && !server_listening(connect_socket))
+    {
+        report_error(("no server listening on socket: " + connect_socket).c_str());
+        return NO_SERVER_STATUS;
+    }
+
         // READ TEMPLATE DB
 
-    std::ifstream tpl_file(tpl_fname, std::ios_base::in|std::ios_base::binary);
+    if (!trace_fname.empty())
+        tracer::enable();
 
-    if (!tpl_file)
-        raise_error("failed to open template file: %s", tpl_fname.c_str());
+    std::unique_ptr<template_db> tpldb;
 
-    std::unique_ptr<template_db> tpldb = template_db::read(tpl_file, max_mem, ksize, max_vars);
+    bool with_stats = !stats_fname.empty() || (is_verbose() && connect_socket.empty());
+    phase_times load;
+    load.wall = wall_time();
+    load.cpu = process_cpu_time();
+
+    if (!shm_name.empty() && connect_socket.empty())
+        tpldb = template_db::attach(shm_name, source_tag(tpl_fname));
+
+    if (!tpldb && connect_socket.empty())
+    {
+        tpldb = template_db::open(tpl_fname, max_mem, ksize, max_vars);
+
+        // publish, then swap our private copy for the shared one; if another
+        // process beat us to it, wait for it to finish and use its copy
+
+        if (!shm_name.empty())
+        {
+            if (!tpldb->publish(shm_name, source_tag(tpl_fname)))
+                verbose_emit("shared memory segment %s was created by another process", shm_name.c_str());
+
+            std::unique_ptr<template_db> shared = template_db::attach(shm_name, source_tag(tpl_fname));
+
+            if (shared)
+                tpldb.swap(shared);
+        }
+    }
 
-    tpl_file.close();
+    double loaded = wall_time();
+
+    if (tracer::enabled())
+        tracer::record("load", load.wall, loaded);
+
+    load.wall = loaded - load.wall;
+    load.cpu = process_cpu_time() - load.cpu;
+
+    if (connect_socket.empty())
+        verbose_emit("loaded database in %.3fs (%.3fs cpu), peak RSS %lu MB", load.wall, load.cpu,
+                static_cast<unsigned long>(get_peak_rss() >> 20));
 
         // WRITE TEMPLATE DB
 
-    if (!out_fname.empty() && !tpldb->write(out_fname))
+    if (!out_fname.empty() && write_partitioned)
+        tpldb->write_partitioned(out_fname);
+    else if (!out_fname.empty() && !tpldb->write(out_fname))
         raise_error("failed to write binary template file: %s" , out_fname.c_str());
 
-        // ITERATE OVER QUERY FILES
+        // REPORT ON TEMPLATE DB
+
+    if (db_stats_only)
+    {
+        db_stats st;
+        tpldb->get_stats(st);
+        write_db_stats(std::cout, tpl_fname, st);
+        return 0;
+    }
+
+        // SERVE QUERIES
+
+    if (!serve_socket.empty())
+    {
+        query_server server(*tpldb, serve_socket, n_threads);
+        server.run();
+        return 0;
+    }
+
+        // RUN THE QUERIES
+
+    // Each worker picks the next job off the list, runs it, and writes its
+    // output in a single block, so at most n_threads results are in memory.
+    // A failing query is reported, and does not stop the other queries.
 
-    qry_fname = *(argv+1) ? *++argv : "-";
+    bool single_query = jobs.size() == 1; // when single query we do no newline after results
 
-    bool single_query = !*(argv+1); // when single query we do no newline after results
+    std::atomic<bool> failed(false);
+    std::mutex out_mutex;
+    std::vector<query_stats> job_stats(jobs.size());
 
-    do {
-        verbose_emit("query file: %s", qry_fname.c_str());
+    auto write_output = [&](std::ostream& os, const query_job& job, const query_result& res) {
+        if (typer)
+            typer->type(res, mlst_typer::query_id(job.name), os, mlst_sep);
+        else
+            write_result(os, res, opts.min_depth != 0);
+    };
 
-        if (write_titles)
-            std::cout << "## Query: " << qry_fname << std::endl;
+    run_batch(jobs.size(), n_threads, [&](std::size_t i) {
+        const query_job& job = jobs[i];
 
-        query_result res = tpldb->query(qry_fname, min_cov, skip_degens);
+        verbose_emit("query file: %s", job.fname.c_str());
 
-        for (size_t i = 0; i != res.size(); ++i)
-            std::cout << res[i].seqid << ' ' << res[i].len << ' ' << res[i].hits << ' ' << res[i].phit << std::endl;
+        query_result res;
+        query_options job_opts = opts;
 
-        if (!single_query)
-            std::cout << std::endl;
+        if (with_stats)
+            job_opts.stats = &job_stats[i];
 
-        qry_fname = *++argv ? *argv : "";
+        try
+        {
+            res = connect_socket.empty()
+                ? tpldb->query(job.fname, job_opts)
+                : remote_query(connect_socket, job.fname, opts);
 
-    } while (!qry_fname.empty());
+            if (with_stats)
+                emit_stats(job.name, job_stats[i]);
+        }
+        catch (const std::exception& e)
+        {
+            report_error((job.name + ": " + e.what()).c_str());
+            failed = true;
+            return;
+        }
+
+        trace_span span("output", "query", i);
+
+        if (!out_dir.empty())
+        {
+            std::string fname = output_path(out_dir, job, out_ext);
+            std::ofstream os(fname);
+
+            write_output(os, job, res);
+
+            if (!os)
+            {
+                report_error(("failed to write output file: " + fname).c_str());
+                failed = true;
+            }
+        }
+        else
+        {
+            std::ostringstream os;
+
+            if (write_titles)
+                os << "## Query: " << job.name << std::endl;
+
+            write_output(os, job, res);
+
+            if (!single_query && !typer)
+                os << std::endl;
+
+            std::lock_guard<std::mutex> lock(out_mutex);
+            std::cout << os.str() << std::flush;
+        }
+    });
+
+    verbose_emit("peak RSS %lu MB", static_cast<unsigned long>(get_peak_rss() >> 20));
 
-    return 0;
+    if (!stats_fname.empty())
+        write_stats(stats_fname, load, tpldb->ksize(), jobs, job_stats);
+
+    if (!trace_fname.empty())
+        tracer::write(trace_fname);
+
+    return failed ? 1 : 0;
+}
+
+int main (int, char *argv[]) 
+{
+    set_progname("khc");
+
+    try
+    {
+        return run_khc(argv);
+    }
+    catch (const std::exception& e)
+    {
+        report_error(e.what());
+        return 1;
+    }
 }
 
 // vim: sts=4:sw=4:et:si:ai
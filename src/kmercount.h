@@ -0,0 +1,126 @@
+/* kmercount.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef kmercount_h_INCLUDED
+#define kmercount_h_INCLUDED
+
+#include <cstdint>
+#include <vector>
+#include "kmerise.h"
+
+
+// ABOUT KMER COUNTING
+//
+// This unit defines classes that count the kmers in a query, before these
+// go to the kmer_db.  In high depth read sets, each kmer in the genome occurs
+// about 'depth' times.  Counting them first means each distinct kmer needs
+// to be looked up only once, and the count (its multiplicity) is available
+// to whoever needs it.
+//
+// Counting also separates 'solid' kmers from sequencing errors: kmers with
+// errors occur once or twice, whereas true kmers occur about 'depth' times.
+
+
+namespace khc {
+
+// Counter for the distinct knums in a query.
+//
+// An open addressing hash table (linear probing) from knum to count.  It is
+// compact (16 bytes per slot, at most half of the slots used) and grows by
+// doubling.  The empty slot marker is the all-ones knum, which cannot occur
+// as kmeriser produces at most 2*max_ksize-1 bits.
+//
+class kmer_counter
+{
+    public:
+        typedef std::uint32_t count_t;
+
+    private:
+        struct slot {
+            knum_t knum;
+            count_t count;
+        };
+
+        static const knum_t EMPTY = ~static_cast<knum_t>(0);
+
+        std::vector<slot> slots_;
+        std::size_t size_;
+        int shift_;
+
+        std::size_t index(knum_t knum) const {
+            return static_cast<std::size_t>((knum * 0x9E3779B97F4A7C15ULL) >> shift_);
+        }
+
+        void grow();
+
+    public:
+        kmer_counter(int log2_capacity = 16);
+
+        count_t add(knum_t knum);
+        count_t count(knum_t knum) const;
+
+        std::size_t size() const { return size_; }
+        void clear();
+
+        // calls f(knum, count) for each distinct knum, in no particular order
+        template <typename F> void for_each(F f) const {
+            for (const slot& s : slots_)
+                if (s.knum != EMPTY)
+                    f(s.knum, s.count);
+        }
+};
+
+
+// Approximate counter for the knums in a query.
+//
+// A count-min sketch: ndepth rows of 2^log2_width saturating 8-bit counters,
+// each row indexed by a different hash of the knum.  The estimated count is
+// the minimum over the rows, which never underestimates the true count.  We
+// use the 'conservative update' rule (increment only the counters that equal
+// the minimum), which keeps overestimates low, and makes each add() raise
+// the estimate by exactly one (until it saturates at 255).
+//
+// Unlike kmer_counter, memory use is fixed: the default is 4 x 4M bytes.
+//
+class kmer_sketch
+{
+    public:
+        typedef std::uint8_t count_t;
+        static const int max_count = 255;
+
+    private:
+        std::vector<count_t> counters_;
+        int ndepth_;
+        int shift_;
+        std::size_t width_;
+
+        std::size_t index(int row, knum_t knum) const;
+
+    public:
+        kmer_sketch(int log2_width = 22, int ndepth = 4);
+
+        count_t add(knum_t knum);
+        count_t count(knum_t knum) const;
+
+        void clear();
+};
+
+
+} // namespace khc
+
+#endif // kmercount_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
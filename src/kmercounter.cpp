@@ -0,0 +1,113 @@
+/* kmercounter.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "kmercount.h"
+#include "utils.h"
+
+namespace khc {
+
+
+const knum_t kmer_counter::EMPTY;
+
+
+kmer_counter::kmer_counter(int log2_capacity)
+    : size_(0), shift_(64 - log2_capacity)
+{
+    if (log2_capacity < 1 || log2_capacity > 40)
+        raise_error("invalid kmer counter capacity: 2^%d", log2_capacity);
+
+    slots_.resize(static_cast<std::size_t>(1) << log2_capacity, { EMPTY, 0 });
+}
+
+
+kmer_counter::count_t
+kmer_counter::add(knum_t knum)
+{
+    std::size_t mask = slots_.size() - 1;
+    std::size_t i = index(knum);
+
+    while (slots_[i].knum != EMPTY)
+    {
+        if (slots_[i].knum == knum)
+            return ++slots_[i].count;
+
+        i = (i + 1) & mask;
+    }
+
+    slots_[i] = { knum, 1 };
+
+    if (++size_ > slots_.size() / 2)
+        grow();
+
+    return 1;
+}
+
+
+kmer_counter::count_t
+kmer_counter::count(knum_t knum) const
+{
+    std::size_t mask = slots_.size() - 1;
+    std::size_t i = index(knum);
+
+    while (slots_[i].knum != EMPTY)
+    {
+        if (slots_[i].knum == knum)
+            return slots_[i].count;
+
+        i = (i + 1) & mask;
+    }
+
+    return 0;
+}
+
+
+void
+kmer_counter::grow()
+{
+    std::vector<slot> old(slots_.size() * 2, { EMPTY, 0 });
+    old.swap(slots_);
+    --shift_;
+
+    std::size_t mask = slots_.size() - 1;
+
+    for (const slot& s : old)
+        if (s.knum != EMPTY)
+        {
+            std::size_t i = index(s.knum);
+
+            while (slots_[i].knum != EMPTY)
+                i = (i + 1) & mask;
+
+            slots_[i] = s;
+        }
+}
+
+
+void
+kmer_counter::clear()
+{
+    std::fill(slots_.begin(), slots_.end(), slot { EMPTY, 0 });
+    size_ = 0;
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
@@ -18,10 +18,15 @@
 #ifndef kmerdb_h_INCLUDED
 #define kmerdb_h_INCLUDED
 
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <queue>
+#include <string>
 #include <vector>
 #include <map>
+#include <mutex>
 
 namespace khc {
 
@@ -30,7 +35,8 @@ namespace khc {
 // A 'kmer_db' holds a mapping from kmer_t to vector<kloc_t>, in other words
 // it stores for each kmer the list of locations where it occurs.  Its core
 // operations are add_kloc(k,p) to register location p for kmer k, and
-// get_klocs(k) to retrieve the list of locations p where k occurs.
+// get_klocs(k) to retrieve the list of locations p where k occurs, as a
+// kloc_range pointing into storage owned by the kmer_db.
 
 // Kmers are encoded (by kmeriser, q.v.) in kmer_t, a 64-bit integral. Kmer
 // locations are encoded (by template_db) in kloc_t, a 64-bit integral composed
@@ -49,13 +55,40 @@ typedef std::uint64_t kloc_t;
 typedef std::uint32_t kcnt_t;
 
 
-// We have two kmer_db implementations: vector_kmer_db and map_kmer_db.  The
-// vector db is fast but memory hungry: O(1) by O(4^ksize), whereas the map
-// map db is O(log(ksize)) in time and O(ksize) in storage.
+// kloc_range - the locations of a kmer, as returned by get_klocs()
+//
+// A read-only view on a contiguous array of kloc_t owned by the kmer_db, so
+// that all implementations can return their locations without copying.
+//
+class kloc_range
+{
+    private:
+        const kloc_t *begin_;
+        const kloc_t *end_;
+
+    public:
+        kloc_range(const kloc_t *b, const kloc_t *e) : begin_(b), end_(e) { }
+        kloc_range(const std::vector<kloc_t>& v) : begin_(v.data()), end_(v.data() + v.size()) { }
+
+        const kloc_t* begin() const { return begin_; }
+        const kloc_t* end() const { return end_; }
+        std::size_t size() const { return end_ - begin_; }
+        bool empty() const { return begin_ == end_; }
+        const kloc_t& operator[](std::size_t i) const { return begin_[i]; }
+};
+
+
+// We have four kmer_db implementations: vector_kmer_db, map_kmer_db,
+// shared_kmer_db, and partitioned_kmer_db.  The vector db is fast but memory
+// hungry: O(1) by O(4^ksize), whereas the map db is O(log(ksize)) in time and
+// O(ksize) in storage.  The shared db is a read-only image of either, in memory
+// shared between processes.  The partitioned db is a file holding one such
+// image per scheme, loaded when first needed.
 // 
-// The two implementations have the same interface and semantics, but for
+// The implementations have the same interface and semantics, but for
 // performance reasons are not subclassed from an abstract base.  Instead,
 // virtuality is used at the level of the holding template_db class.
+// They all have for_each(f), which calls f(kmer, kloc_range) in kmer order.
 
 
 // vector_kmer_db - holds a vector indexed by kmer, each element pointing to
@@ -73,7 +106,13 @@ class vector_kmer_db
         int ksize() const { return ksize_; }
 
         void add_kloc(kmer_t, kloc_t);
-        const std::vector<kloc_t>& get_klocs(kmer_t) const;
+        kloc_range get_klocs(kmer_t) const;
+
+        template <typename F> void for_each(F f) const {
+            for (kmer_t k = 0; k != vec_ptrs_.size(); ++k)
+                if (vec_ptrs_[k])
+                    f(k, kloc_range(kloc_vecs_[vec_ptrs_[k]]));
+        }
 
         std::istream& read(std::istream&);
         std::ostream& write(std::ostream&) const;
@@ -95,12 +134,325 @@ class map_kmer_db
         int ksize() const { return ksize_; }
 
         void add_kloc(kmer_t kmer, kloc_t loc);
-        const std::vector<kloc_t>& get_klocs(kmer_t) const;
+        kloc_range get_klocs(kmer_t) const;
+
+        template <typename F> void for_each(F f) const {
+            for (const auto& e : vec_ptrs_)
+                f(e.first, kloc_range(kloc_vecs_[e.second]));
+        }
+
+        std::istream& read(std::istream&);
+        std::ostream& write(std::ostream&) const;
+};
+
+
+// shared_kmer_db - holds a read-only kmer db in a named shared memory segment
+//
+// The segment is a flat image that any number of processes can map: sorted
+// arrays of kmers and of offsets into one array of klocs (as in a sparse CSR
+// matrix), preceded by a bucket index on the high bits of the kmer, which
+// narrows the binary search for a kmer to a handful of entries.
+//
+// Next to the kmer db, the segment holds the template sequence IDs and lengths
+// and a 'source' tag identifying what it was published from, so that a process
+// can attach to it without reading SUBJECTS at all.
+//
+// The segment NAME is a POSIX shared memory name (on Linux in /dev/shm), or
+// when it contains a '/', the path of a file, for instance on a hugetlbfs
+// mount.  It persists until removed, or until the system reboots.
+//
+class shared_kmer_db
+{
+    public:
+        struct header;
+
+    private:
+        std::string name_;
+        void *base_;
+        std::size_t size_;
+        bool owner_;             // base_ is our own mapping of the segment
+        const header *hdr_;
+        std::uint64_t *index_;
+        kmer_t *kmers_;
+        std::uint64_t *offs_;
+        kloc_t *klocs_;
+        kcnt_t *lens_;
+        const char *ids_;
+        int ksize_;
+        int shift_;
+
+        std::uint64_t nkmers_;   // while publishing: number added so far
+
+        void set_pointers();
+        static std::size_t layout(header&, int ksize, std::uint64_t nkmers, std::uint64_t nlocs, int max_vars,
+                const std::vector<std::string>& ids, const std::string& source);
+        static bool is_valid(const header*, std::size_t size);
+        void create_at(void *image, std::uint64_t nkmers, std::uint64_t nlocs, int max_vars,
+                const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens, const std::string& source);
+        bool create(const std::string& name, std::uint64_t nkmers, std::uint64_t nlocs, int max_vars,
+                const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens, const std::string& source,
+                double timeout);
+        void append(kmer_t, kloc_range);
+        void seal();
+
+        friend class partitioned_kmer_db;
+
+    public:
+        shared_kmer_db(int ksize);
+        shared_kmer_db(shared_kmer_db&&);
+        ~shared_kmer_db();
+
+        int ksize() const { return ksize_; }
+
+        void add_kloc(kmer_t, kloc_t);
+        kloc_range get_klocs(kmer_t kmer) const;
+
+        template <typename F> void for_each(F f) const {
+            for (std::uint64_t i = 0; i != nkmers_; ++i)
+                f(kmers_[i], kloc_range(klocs_ + offs_[i], klocs_ + offs_[i+1]));
+        }
+
+        // the i-th kmer in order and its klocs, for i < nkmers()
+        std::uint64_t nkmers() const { return nkmers_; }
+        kmer_t kmer_at(std::uint64_t i) const { return kmers_[i]; }
+        kloc_range klocs_at(std::uint64_t i) const { return kloc_range(klocs_ + offs_[i], klocs_ + offs_[i+1]); }
+
+        std::istream& read(std::istream&);
+        std::ostream& write(std::ostream&) const;
+
+        // seconds that a segment may be incomplete while it is published;
+        // after that, it was left by a publisher that died, and is stale
+        static constexpr double PUBLISH_TIMEOUT = 60.0;
+
+        // attach read-only to segment name, waiting while it is published;
+        // false if it does not exist or is stale, raises an error if it is
+        // not a valid segment
+        bool attach(const std::string& name, double timeout = PUBLISH_TIMEOUT);
+
+        // use the size bytes at image, which must stay valid while this db
+        // is used; false if they are not a valid image
+        bool view(const void *image, std::size_t size);
+
+        int max_vars() const;
+        std::uint32_t nseq() const;
+        const char* seq_id(std::uint32_t i) const;
+        kcnt_t seq_len(std::uint32_t i) const { return lens_[i]; }
+        std::string source() const;
+
+        // publish kmer db and sequences in segment name, return false if
+        // it already exists, or raise an error if it could not be created;
+        // replaces a stale segment, and removes the segment on failure
+        template <typename kmer_db_t>
+        static bool publish(const std::string& name, const kmer_db_t& db, int max_vars,
+                const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens, const std::string& source,
+                double timeout = PUBLISH_TIMEOUT);
+
+        static bool remove(const std::string& name);
+
+        // the bytes in an image of nkmers kmers with nlocs klocs
+        static std::size_t image_size(int ksize, std::uint64_t nkmers, std::uint64_t nlocs,
+                const std::vector<std::string>& ids, const std::string& source);
+};
+
+template <typename kmer_db_t>
+bool
+shared_kmer_db::publish(const std::string& name, const kmer_db_t& db, int max_vars,
+        const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens, const std::string& source,
+        double timeout)
+{
+    std::uint64_t nkmers = 0, nlocs = 0;
+
+    db.for_each([&](kmer_t, kloc_range r) { ++nkmers; nlocs += r.size(); });
+
+    shared_kmer_db shm(db.ksize());
+
+    if (!shm.create(name, nkmers, nlocs, max_vars, ids, lens, source, timeout))
+        return false;
+
+    try
+    {
+        db.for_each([&](kmer_t kmer, kloc_range r) { shm.append(kmer, r); });
+        shm.seal();
+    }
+    catch (...)
+    {
+        remove(name);
+        throw;
+    }
+
+    return true;
+}
+
+
+// partitioned_kmer_db - holds a read-only kmer db in a file, split by scheme
+//
+// The file holds the template sequence IDs and lengths, the prescreen sketch
+// (see template_db), and for each scheme a shared_kmer_db image with the kmers
+// of the sequences in that scheme, their klocs keeping the global sequence
+// numbers.  Partition i holds scheme i as numbered by template_db.
+//
+// Opening the file reads only the part before the images.  The images are
+// mapped into memory, or where that fails, read, each when first needed, so
+// that memory use and startup time scale with the schemes a query touches.
+// Looking up a kmer searches every loaded partition it is asked for, which
+// makes the partitioned db slower than the others when all schemes are used.
+//
+class partitioned_kmer_db
+{
+    public:
+        struct header;
+        typedef std::vector<std::pair<kmer_t,std::uint32_t> > sketch_t;
+
+    private:
+        std::string path_;
+        int fd_;                 // open while partitions are to be read
+        char *base_;             // the file mapped into memory, or null
+        std::size_t size_;
+        int ksize_;
+        int max_vars_;
+        std::vector<std::string> ids_;
+        std::vector<kcnt_t> lens_;
+        std::vector<std::string> names_;
+        std::vector<std::uint64_t> part_offs_;   // file offsets, plus the end
+        sketch_t sketch_;
+
+        mutable std::vector<shared_kmer_db> parts_;
+        mutable std::vector<std::unique_ptr<char[]> > bufs_;
+        mutable std::unique_ptr<std::once_flag[]> loaded_;
+
+        void load(std::size_t part) const;
+        void release();
+
+        void create(const std::string& path, int max_vars,
+                const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens,
+                const std::vector<std::string>& names, const std::vector<std::uint64_t>& nkmers,
+                const std::vector<std::uint64_t>& nlocs, const sketch_t& sketch);
+        void seal();
+
+    public:
+        partitioned_kmer_db(int ksize);
+        partitioned_kmer_db(partitioned_kmer_db&&);
+        ~partitioned_kmer_db();
+
+        int ksize() const { return ksize_; }
+
+        void add_kloc(kmer_t, kloc_t);
+
+        std::size_t nparts() const { return names_.size(); }
+        const std::string& part_name(std::size_t part) const { return names_[part]; }
+        const shared_kmer_db& partition(std::size_t part) const;
+        std::uint64_t part_size(std::size_t part) const { return part_offs_[part + 1] - part_offs_[part]; }
+
+        // calls f(kmer, kloc_range) in kmer order, merging the partitions
+        template <typename F> void for_each(F f) const;
 
         std::istream& read(std::istream&);
         std::ostream& write(std::ostream&) const;
+
+        // open the file at path; false if it is not a partitioned db,
+        // raises an error if it is but cannot be read
+        bool open(const std::string& path);
+
+        int max_vars() const { return max_vars_; }
+        const std::vector<std::string>& seq_ids() const { return ids_; }
+        const std::vector<kcnt_t>& seq_lens() const { return lens_; }
+        const sketch_t& sketch() const { return sketch_; }
+
+        // write db to path, splitting it into the schemes named in names,
+        // where schemes has the scheme number of each sequence
+        template <typename kmer_db_t>
+        static void write(const std::string& path, const kmer_db_t& db, int max_vars,
+                const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens,
+                const std::vector<std::string>& names, const std::vector<std::uint32_t>& schemes,
+                const sketch_t& sketch);
 };
 
+template <typename F>
+void
+partitioned_kmer_db::for_each(F f) const
+{
+    typedef std::pair<kmer_t,std::size_t> head;     // next kmer of partition
+
+    std::priority_queue<head, std::vector<head>, std::greater<head> > heads;
+    std::vector<std::uint64_t> pos(nparts(), 0);
+    std::vector<kloc_t> locs;
+
+    for (std::size_t p = 0; p != nparts(); ++p)
+        if (partition(p).nkmers())
+            heads.push(head(parts_[p].kmer_at(0), p));
+
+    while (!heads.empty())
+    {
+        kmer_t kmer = heads.top().first;
+        locs.clear();
+
+        while (!heads.empty() && heads.top().first == kmer)
+        {
+            std::size_t p = heads.top().second;
+            heads.pop();
+
+            kloc_range r = parts_[p].klocs_at(pos[p]);
+            locs.insert(locs.end(), r.begin(), r.end());
+
+            if (++pos[p] != parts_[p].nkmers())
+                heads.push(head(parts_[p].kmer_at(pos[p]), p));
+        }
+
+        f(kmer, kloc_range(locs));
+    }
+}
+
+template <typename kmer_db_t>
+void
+partitioned_kmer_db::write(const std::string& path, const kmer_db_t& db, int max_vars,
+        const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens,
+        const std::vector<std::string>& names, const std::vector<std::uint32_t>& schemes,
+        const sketch_t& sketch)
+{
+    // split the klocs of each kmer over the partitions of their sequences,
+    // first to size the partitions, then to fill them
+
+    std::vector<std::vector<kloc_t> > split(names.size());
+    std::vector<std::uint32_t> touched;
+
+    auto split_klocs = [&](kloc_range r) {
+        touched.clear();
+        for (const kloc_t& loc : r)
+        {
+            std::uint32_t p = schemes[loc >> 32];
+            if (split[p].empty())
+                touched.push_back(p);
+            split[p].push_back(loc);
+        }
+    };
+
+    std::vector<std::uint64_t> nkmers(names.size(), 0), nlocs(names.size(), 0);
+
+    db.for_each([&](kmer_t, kloc_range r) {
+        split_klocs(r);
+        for (std::uint32_t p : touched)
+        {
+            ++nkmers[p];
+            nlocs[p] += split[p].size();
+            split[p].clear();
+        }
+    });
+
+    partitioned_kmer_db out(db.ksize());
+    out.create(path, max_vars, ids, lens, names, nkmers, nlocs, sketch);
+
+    db.for_each([&](kmer_t kmer, kloc_range r) {
+        split_klocs(r);
+        for (std::uint32_t p : touched)
+        {
+            out.parts_[p].append(kmer, kloc_range(split[p]));
+            split[p].clear();
+        }
+    });
+
+    out.seal();
+}
+
 
 } // namespace khc
 
@@ -18,6 +18,7 @@
 #ifndef kmerise_h_INCLUDED
 #define kmerise_h_INCLUDED
 
+#include <string>
 #include <vector>
 #include <cstdint>
 
@@ -126,27 +127,47 @@ class kmerator
 // When constructor argument skip_degens is true, the class will silently skip
 // kmers with degenerate bases.  By default (false) it raises an error.
 //
+// When constructor argument min_qual is non-zero, and set() is passed the
+// Phred+33 quality scores for the sequence, then the class silently skips
+// kmers containing a base with quality score below min_qual.
+//
+// Degenerate and low quality bases are 'masked' in a single forward scan,
+// so that skipping costs O(1) per base rather than O(ksize) per kmer.
+//
 class kmeriser
 {
     public:
         static const int max_ksize = 4*sizeof(knum_t) - 1;
 
     private:
+        const char* pbeg_;
         const char* pcur_;
         const char* pend_;
+        const char* pclear_;  // bases in [pcur_,pclear_) are known unmasked
+        const char* qual_;
         int ksize_;
         bool skip_degens_;
+        char min_qual_chr_;
+
+        bool is_masked(const char *p) const;
 
     public:
-        kmeriser(int ksize, bool skip_degens = false);
+        kmeriser(int ksize, bool skip_degens = false, int min_qual = 0);
 
-        void set(const char *begin, const char *end);
+        void set(const char *begin, const char *end, const char *qual = 0);
         bool next();
         knum_t knum() const;
         std::vector<knum_t> knums();
 };
 
 
+// knum_to_string - the bases of the k-mer that knum encodes; as the encoding
+//                  is canonical, these may be the reverse complement of the
+//                  bases that were kmerised
+//
+extern std::string knum_to_string(knum_t knum, int ksize);
+
+
 } // namespace khc
 
 #endif // kmerise_h_INCLUDED
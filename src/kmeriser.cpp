@@ -68,50 +68,64 @@ is_degen_base(char c)
 }
 
 
-kmeriser::kmeriser(int ksize, bool skip_degens)
-    : pcur_(0), pend_(0), ksize_(ksize), skip_degens_(skip_degens)
+kmeriser::kmeriser(int ksize, bool skip_degens, int min_qual)
+    : pbeg_(0), pcur_(0), pend_(0), pclear_(0), qual_(0), ksize_(ksize),
+      skip_degens_(skip_degens), min_qual_chr_(static_cast<char>(min_qual + 33))
 {
     if (ksize < 1 || ksize > max_ksize || !(ksize & 1))
         raise_error("invalid kmer size: %d; must be an odd number in range [1,%d]", ksize, max_ksize);
+
+    if (min_qual < 0 || min_qual > 93)
+        raise_error("invalid minimum quality: %d; must be in range [0,93]", min_qual);
 }
 
 
 void
-kmeriser::set(const char *begin, const char *end)
+kmeriser::set(const char *begin, const char *end, const char *qual)
 {
+    pbeg_ = begin;
     pcur_ = begin - 1;          // one before start of first kmer
     pend_ = end - ksize_ + 1;   // one beyond start of last kmer
+    pclear_ = begin;
+    qual_ = min_qual_chr_ != 33 ? qual : 0;
+}
+
+
+// is_masked - whether kmers containing the base at p are to be skipped
+// note: invalid bases are not masked, as these will error out in knum()
+
+bool
+kmeriser::is_masked(const char *p) const
+{
+    return (skip_degens_ && is_degen_base(*p)) || (qual_ && qual_[p - pbeg_] < min_qual_chr_);
 }
 
 
 bool
 kmeriser::next()
 {
-    if (skip_degens_)
+    if (skip_degens_ || qual_)
     {
-        // if we skip_degens, then first bump pcur to one before first kmer not containing a degen
-        // note: ignore invalid bases as these will error out in any case in knum()
+        // extend the scan for masked bases to the end of the kmer at pcur+1,
+        // and whenever one is found, restart the kmer just beyond it
+
+        const char *pstop = ++pcur_ + ksize_;
+
+        if (pclear_ < pcur_)
+            pclear_ = pcur_;
 
-        while (++pcur_ < pend_)
+        while (pclear_ < pstop && pcur_ < pend_)
         {
-            const char *p = pcur_ + ksize_;
-
-            while (p-- != pcur_) 
-                if (is_degen_base(*p))
-                {
-                    pcur_ = p;
-                    break;
-                }
-        
-            // post condition: p == pcur and is degen, or p < pcur and pcur starts good kmer
-
-            if (p != pcur_)
-                break;
-        }
+            if (is_masked(pclear_))
+            {
+                pcur_ = pclear_ + 1;
+                pstop = pcur_ + ksize_;
+            }
 
-        // post condition: pcur on start of non-degen kmer, or pcur on or beyond pend
+            ++pclear_;
+        }
 
-        --pcur_;  // post condition: pcur before good kmer, or before pend
+        return pcur_ < pend_;
     }
 
     return ++pcur_ < pend_;
@@ -168,6 +182,27 @@ kmeriser::knums()
 }
 
 
+std::string
+knum_to_string(knum_t knum, int ksize)
+{
+    static const char BASES[] = "acgt";
+
+    std::string res(ksize, 'a');
+    int mid = ksize / 2;
+
+    for (int i = ksize - 1; i != mid; --i, knum >>= 2)
+        res[i] = BASES[knum & 3];
+
+    res[mid] = BASES[knum & 1];
+    knum >>= 1;
+
+    for (int i = mid; i--; knum >>= 2)
+        res[i] = BASES[knum & 3];
+
+    return res;
+}
+
+
 } // namespace khc
 
 // vim: sts=4:sw=4:ai:si:et
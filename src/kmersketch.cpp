@@ -0,0 +1,103 @@
+/* kmersketch.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "kmercount.h"
+#include "utils.h"
+
+namespace khc {
+
+
+const int kmer_sketch::max_count;
+
+// Odd multipliers for the row hashes; multiply-shift hashing with these
+// gives (nearly) independent indices for each row.
+
+static const knum_t ROW_MULTIPLIERS[] = {
+    0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL,
+    0xFF51AFD7ED558CCDULL, 0xC4CEB9FE1A85EC53ULL, 0x27D4EB2F165667C5ULL, 0x94D049BB133111EBULL
+};
+
+static const int MAX_DEPTH = sizeof(ROW_MULTIPLIERS) / sizeof(ROW_MULTIPLIERS[0]);
+
+
+kmer_sketch::kmer_sketch(int log2_width, int ndepth)
+    : ndepth_(ndepth), shift_(64 - log2_width), width_(static_cast<std::size_t>(1) << log2_width)
+{
+    if (log2_width < 1 || log2_width > 32)
+        raise_error("invalid kmer sketch width: 2^%d", log2_width);
+
+    if (ndepth < 1 || ndepth > MAX_DEPTH)
+        raise_error("invalid kmer sketch depth: %d; must be in range [1,%d]", ndepth, MAX_DEPTH);
+
+    counters_.resize(width_ * ndepth_, 0);
+}
+
+
+std::size_t
+kmer_sketch::index(int row, knum_t knum) const
+{
+    return row * width_ + static_cast<std::size_t>((knum * ROW_MULTIPLIERS[row]) >> shift_);
+}
+
+
+kmer_sketch::count_t
+kmer_sketch::add(knum_t knum)
+{
+    count_t min = max_count;
+
+    for (int r = 0; r != ndepth_; ++r)
+        min = std::min(min, counters_[index(r, knum)]);
+
+    if (min == max_count)
+        return min;
+
+    for (int r = 0; r != ndepth_; ++r)
+    {
+        count_t& c = counters_[index(r, knum)];
+        if (c == min)
+            ++c;
+    }
+
+    return min + 1;
+}
+
+
+kmer_sketch::count_t
+kmer_sketch::count(knum_t knum) const
+{
+    count_t min = max_count;
+
+    for (int r = 0; r != ndepth_; ++r)
+        min = std::min(min, counters_[index(r, knum)]);
+
+    return min;
+}
+
+
+void
+kmer_sketch::clear()
+{
+    std::fill(counters_.begin(), counters_.end(), 0);
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,201 @@
+/* libkhc.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libkhc.h"
+
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "templatedb.h"
+#include "utils.h"
+
+using namespace khc;
+
+// The C handles wrap the C++ objects.  Every entry point catches exceptions
+// and turns them into a NULL or error return, with the message kept per thread.
+
+struct khc_db
+{
+    std::unique_ptr<template_db> db;
+};
+
+struct khc_result
+{
+    query_result res;
+    std::vector<khc_hit> hits;
+};
+
+static thread_local std::string last_error;
+
+template <typename F>
+static auto
+guard(F f) -> decltype(f())
+{
+    last_error.clear();
+
+    try
+    {
+        return f();
+    }
+    catch (const std::exception& e)
+    {
+        last_error = e.what();
+    }
+    catch (...)
+    {
+        last_error = "unknown error";
+    }
+
+    return 0;
+}
+
+static query_options
+to_query_options(const khc_options *opts)
+{
+    khc_options o;
+
+    if (!opts)
+    {
+        khc_options_init(&o);
+        opts = &o;
+    }
+
+    query_options q;
+    q.min_cov_pct = opts->min_cov_pct;
+    q.skip_degens = opts->skip_degens != 0;
+    q.dedup_kmers = opts->dedup_kmers != 0;
+    q.converge_batches = opts->converge_batches;
+    q.min_depth = opts->min_depth;
+    q.min_qual = opts->min_qual;
+    q.min_kmer_count = opts->min_kmer_count;
+    q.prescreen = opts->prescreen;
+    q.pipeline = opts->pipeline;
+
+    if (!(q.min_cov_pct >= 0 && q.min_cov_pct <= 100) ||
+            q.min_depth < 0 || q.min_depth > 65535 || q.min_qual < 0 || q.min_qual > 93 ||
+            q.min_kmer_count < 1 || q.min_kmer_count > 255 || q.converge_batches < 0 || q.prescreen < 0 ||
+            q.pipeline < 0 || q.pipeline > 256)
+        raise_error("invalid query options");
+
+    return q;
+}
+
+static khc_result*
+make_result(query_result&& res)
+{
+    std::unique_ptr<khc_result> ret(new khc_result);
+    ret->res = std::move(res);
+    ret->hits.reserve(ret->res.size());
+
+    for (const seq_hits& h : ret->res)
+        ret->hits.push_back({ h.seqid.c_str(), h.len, h.hits, h.phit, h.depth });
+
+    return ret.release();
+}
+
+
+khc_db*
+khc_db_open(const char *path, int max_gb, int ksize, int max_vars)
+{
+    return guard([&]() {
+        std::unique_ptr<khc_db> ret(new khc_db);
+        ret->db = template_db::open(path, max_gb, ksize, max_vars);
+
+        return ret.release();
+    });
+}
+
+khc_db*
+khc_db_attach(const char *shm_name)
+{
+    return guard([&]() {
+        std::unique_ptr<khc_db> ret(new khc_db);
+        ret->db = template_db::attach(shm_name);
+
+        if (!ret->db)
+            raise_error("no database in shared memory segment: %s", shm_name);
+
+        return ret.release();
+    });
+}
+
+void
+khc_db_close(khc_db *db)
+{
+    delete db;
+}
+
+void
+khc_options_init(khc_options *opts)
+{
+    query_options q;
+
+    opts->min_cov_pct = q.min_cov_pct;
+    opts->skip_degens = q.skip_degens;
+    opts->dedup_kmers = q.dedup_kmers;
+    opts->converge_batches = q.converge_batches;
+    opts->min_depth = q.min_depth;
+    opts->min_qual = q.min_qual;
+    opts->min_kmer_count = q.min_kmer_count;
+    opts->prescreen = q.prescreen;
+    opts->pipeline = q.pipeline;
+}
+
+khc_result*
+khc_query_buffer(const khc_db *db, const char *data, size_t len, const khc_options *opts)
+{
+    return guard([&]() {
+        return make_result(db->db->query(data, len, to_query_options(opts)));
+    });
+}
+
+khc_result*
+khc_query_file(const khc_db *db, const char *path, const khc_options *opts)
+{
+    return guard([&]() {
+        return make_result(db->db->query(std::string(path), to_query_options(opts)));
+    });
+}
+
+size_t
+khc_result_size(const khc_result *res)
+{
+    return res->hits.size();
+}
+
+const khc_hit*
+khc_result_hit(const khc_result *res, size_t i)
+{
+    return i < res->hits.size() ? &res->hits[i] : 0;
+}
+
+void
+khc_result_free(khc_result *res)
+{
+    delete res;
+}
+
+const char*
+khc_last_error(void)
+{
+    return last_error.c_str();
+}
+
+// vim: sts=4:sw=4:ai:si:et
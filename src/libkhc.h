@@ -0,0 +1,112 @@
+/* libkhc.h - C interface to the khc template database
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef libkhc_h_INCLUDED
+#define libkhc_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* This header defines the C interface of libkhc, for programs that want to
+ * load a template database once, and then query it with in-memory data,
+ * without running the khc binary.  C++ programs can use this interface, or
+ * use class khc::template_db (templatedb.h) directly.
+ *
+ * Functions that can fail return NULL, and set a message that is returned
+ * by khc_last_error().  The message is kept per thread.
+ *
+ * A khc_db is safe to query from multiple threads concurrently.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* khc_db - opaque handle to a loaded template database */
+
+typedef struct khc_db khc_db;
+
+/* khc_options - the query parameters, see khc --help for their meaning;
+ * khc_options_init sets them to their defaults */
+
+typedef struct khc_options
+{
+    double min_cov_pct;     /* report templates covered at least this much */
+    int skip_degens;        /* skip query kmers with degenerate bases */
+    int dedup_kmers;        /* look up distinct query kmers once (-u) */
+    int converge_batches;   /* stop when result stable this long (-e) */
+    int min_depth;          /* if > 0, count depth, hits need it (-d) */
+    int min_qual;           /* skip FASTQ kmers with base below it (-q) */
+    int min_kmer_count;     /* look up kmers occurring this often (-n) */
+    int prescreen;          /* if > 0, restrict to this many schemes */
+    int pipeline;           /* if > 0, kmerise on this many threads */
+} khc_options;
+
+/* khc_hit - one line of query output */
+
+typedef struct khc_hit
+{
+    const char *seqid;      /* template sequence ID */
+    uint32_t len;           /* number of kmers in the template */
+    uint32_t hits;          /* number of those hit by the query */
+    double phit;            /* percentage hits / len */
+    double depth;           /* mean depth (when min_depth > 0) */
+} khc_hit;
+
+/* khc_result - opaque handle to the hits of a query */
+
+typedef struct khc_result khc_result;
+
+
+/* Open the template database in file path (FASTA, binary, or partitioned,
+ * see khc -w and --partition); ksize and max_vars are required for FASTA,
+ * and may be 0 otherwise; max_gb bounds memory as with khc -m, or 0 for the
+ * default. */
+khc_db* khc_db_open(const char *path, int max_gb, int ksize, int max_vars);
+
+/* Attach to the database published in shared memory segment shm_name, see
+ * khc --shm.  Returns NULL with an error if there is no such segment. */
+khc_db* khc_db_attach(const char *shm_name);
+
+void khc_db_close(khc_db *db);
+
+/* Set opts to the defaults */
+void khc_options_init(khc_options *opts);
+
+/* Query db with the len bytes at data, which may be (gzipped) FASTA, FASTQ,
+ * or plain DNA; opts may be NULL for the defaults. */
+khc_result* khc_query_buffer(const khc_db *db, const char *data, size_t len, const khc_options *opts);
+
+/* Query db with the contents of the file at path. */
+khc_result* khc_query_file(const khc_db *db, const char *path, const khc_options *opts);
+
+size_t khc_result_size(const khc_result *res);
+
+/* Hit i, valid until res is freed */
+const khc_hit* khc_result_hit(const khc_result *res, size_t i);
+
+void khc_result_free(khc_result *res);
+
+/* Message for the last error in this thread, or "" */
+const char* khc_last_error(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* libkhc_h_INCLUDED */
+       /* vim: sts=4:sw=4:ai:si:et */
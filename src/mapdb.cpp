@@ -47,7 +47,7 @@ map_kmer_db::add_kloc(kmer_t kmer, kloc_t loc)
         kloc_vecs_[p->second].push_back(loc);
 }
 
-const std::vector<kloc_t>&
+kloc_range
 map_kmer_db::get_klocs(kmer_t kmer) const
 {
     std::map<kmer_t,kcnt_t>::const_iterator p = vec_ptrs_.find(kmer);
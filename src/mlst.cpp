@@ -0,0 +1,275 @@
+/* mlst.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mlst.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+
+#include "utils.h"
+
+namespace khc {
+
+static const char TAB = '\t';
+
+
+// split - split s on character c
+//
+static std::vector<std::string>
+split(const std::string& s, char c)
+{
+    std::vector<std::string> ret;
+    std::string::size_type p = 0, q;
+
+    while ((q = s.find(c, p)) != std::string::npos)
+    {
+        ret.push_back(s.substr(p, q - p));
+        p = q + 1;
+    }
+
+    ret.push_back(s.substr(p));
+
+    return ret;
+}
+
+// printed_value - the value of x as khc prints it (6 significant digits);
+//                 kcst compares coverages as printed, so we do the same
+//
+static double
+printed_value(double x)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%g", x);
+    return std::strtod(buf, 0);
+}
+
+
+// is_true - whether the ST column value s counts as present, which it does
+//           when non-empty and not numerically zero (as in awk)
+//
+static bool
+is_true(const std::string& s)
+{
+    const char *p = s.c_str();
+    char *end;
+    double v = std::strtod(p, &end);
+
+    return end != p && !*end ? v != 0.0 : !s.empty();
+}
+
+
+mlst_typer::mlst_typer(const std::string& db_dir)
+{
+    read_config(db_dir + "/kcst.cfg");
+    read_profiles(db_dir + "/kcst.tsv");
+}
+
+void
+mlst_typer::read_config(const std::string& fname)
+{
+    std::ifstream is(fname);
+
+    if (!is)
+        raise_error("failed to open MLST config file: %s", fname.c_str());
+
+    std::string line;
+
+    while (std::getline(is, line))
+    {
+        if (line.empty() || line[0] == '#')
+            continue;
+
+        std::vector<std::string> cols = split(line, TAB);
+
+        if (cols.size() < 3)
+            raise_error("%s: invalid line, expected SCHEME<tab>NAME<tab>LOCI: %s", fname.c_str(), line.c_str());
+
+        scheme_index_[cols[0]] = schemes_.size();
+        schemes_.push_back({ cols[0], cols[1], split(cols[2], ',') });
+    }
+}
+
+void
+mlst_typer::read_profiles(const std::string& fname)
+{
+    std::ifstream is(fname);
+
+    if (!is)
+        raise_error("failed to open MLST profile table: %s", fname.c_str());
+
+    std::string line;
+
+    while (std::getline(is, line))
+    {
+        std::string::size_type p = line.find(TAB);
+
+        if (p == std::string::npos)
+            continue;
+
+        auto s = scheme_index_.find(line.substr(0, p));
+
+        if (s == scheme_index_.end())
+            continue;
+
+        // key is the scheme and the alleles for its loci, value the ST
+
+        std::string::size_type q = line.find(TAB, p + 1);
+        std::string st = line.substr(p + 1, q == std::string::npos ? q : q - p - 1);
+        std::string key = s->first;
+
+        for (std::size_t i = 0; i != schemes_[s->second].loci.size(); ++i)
+        {
+            p = q == std::string::npos ? q : q + 1;
+            q = p == std::string::npos ? p : line.find(TAB, p);
+            key += TAB;
+            key += p == std::string::npos ? "" : line.substr(p, q == std::string::npos ? q : q - p);
+        }
+
+        st_index_[key] = st;
+    }
+}
+
+
+void
+mlst_typer::type(const query_result& res, const std::string& query_id, std::ostream& os, char sep) const
+{
+    // best[scheme][locus] has the highest coverage and the alleles having it
+
+    struct locus_best {
+        double cov = -1.0;
+        std::vector<std::string> alleles;
+    };
+
+    std::vector<std::vector<locus_best> > best(schemes_.size());
+
+    for (const seq_hits& h : res)
+    {
+        // split SCHEME:LOCUS:ALLELE, where ALLELE is numeric
+
+        std::string::size_type p2 = h.seqid.rfind(':');
+
+        if (p2 == std::string::npos || p2 == 0 || p2 + 1 == h.seqid.length() ||
+                h.seqid.find_first_not_of("0123456789", p2 + 1) != std::string::npos)
+            continue;
+
+        std::string::size_type p1 = h.seqid.rfind(':', p2 - 1);
+
+        if (p1 == std::string::npos)
+            continue;
+
+        auto s = scheme_index_.find(h.seqid.substr(0, p1));
+
+        if (s == scheme_index_.end())
+            continue;
+
+        const std::vector<std::string>& loci = schemes_[s->second].loci;
+        auto l = std::find(loci.begin(), loci.end(), h.seqid.substr(p1 + 1, p2 - p1 - 1));
+
+        if (l == loci.end())
+            continue;
+
+        std::vector<locus_best>& bests = best[s->second];
+        bests.resize(loci.size());
+        locus_best& b = bests[l - loci.begin()];
+
+        double cov = printed_value(h.phit);
+        std::string allele = h.seqid.substr(p2 + 1) + (cov < 100.0 ? "*" : "");
+
+        if (cov > b.cov)
+        {
+            b.cov = cov;
+            b.alleles.clear();
+        }
+
+        if (cov == b.cov)
+            b.alleles.push_back(allele);
+    }
+
+    // for every scheme with alleles at all loci, output all combinations
+
+    for (std::size_t i = 0; i != schemes_.size(); ++i)
+    {
+        const scheme& sch = schemes_[i];
+        std::vector<locus_best>& bests = best[i];
+
+        if (bests.empty() || std::any_of(bests.begin(), bests.end(), [](const locus_best& b) { return b.alleles.empty(); }))
+            continue;
+
+        for (locus_best& b : bests)
+            std::sort(b.alleles.begin(), b.alleles.end(), [](const std::string& x, const std::string& y) {
+                return x.length() != y.length() ? x.length() < y.length() : x < y; });
+
+        std::string dashed_loci;
+        for (std::size_t l = 0; l != sch.loci.size(); ++l)
+            dashed_loci += (l ? std::string(1, sep) : "") + sch.loci[l];
+
+        std::vector<std::size_t> pick(bests.size(), 0);
+
+        for (bool more = true; more; )
+        {
+            std::string key = sch.id, profile, dashed_profile, stars;
+
+            for (std::size_t l = 0; l != bests.size(); ++l)
+            {
+                const std::string& a = bests[l].alleles[pick[l]];
+                bool star = a.back() == '*';
+
+                key += TAB;
+                key += star ? a.substr(0, a.length() - 1) : a;
+                profile += (l ? std::string(1, TAB) : "") + a;
+                dashed_profile += (l ? std::string(1, sep) : "") + a;
+
+                if (star)
+                    stars += '*';
+            }
+
+            auto st = st_index_.find(key);
+            bool found = st != st_index_.end() && is_true(st->second);
+
+            os << query_id << TAB << sch.name << TAB
+               << (found ? "ST" + st->second : std::string("NF")) << stars << TAB
+               << dashed_profile << TAB << dashed_loci << TAB << profile << '\n';
+
+            // advance to the next combination: odometer with the last locus
+            // turning fastest
+
+            more = false;
+
+            for (std::size_t l = bests.size(); l-- && !more; )
+                if (++pick[l] == bests[l].alleles.size())
+                    pick[l] = 0;
+                else
+                    more = true;
+        }
+    }
+}
+
+
+std::string
+mlst_typer::query_id(const std::string& fname)
+{
+    std::string base = fname.substr(fname.rfind('/') + 1);
+    return base.substr(0, base.find('.'));
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
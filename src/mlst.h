@@ -0,0 +1,80 @@
+/* mlst.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef mlst_h_INCLUDED
+#define mlst_h_INCLUDED
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "templatedb.h"
+
+namespace khc {
+
+// This header defines class mlst_typer, which turns a query_result against
+// a kcst database into MLST profiles and sequence types (STs).
+
+// A kcst database directory has, next to kcst.db, the scheme configuration
+// kcst.cfg, with lines 'SCHEME<tab>NAME<tab>LOCUS,LOCUS,...', and the profile
+// table kcst.tsv, with lines 'SCHEME<tab>ST<tab>ALLELE<tab>ALLELE...', where
+// the alleles are in the order of the loci in the configuration.  Template
+// sequence IDs in kcst.db have the form 'SCHEME:LOCUS:ALLELE'.
+
+// For each locus, the typer picks the allele(s) with the highest coverage.
+// Alleles covered less than 100% get a '*'.  When all loci of a scheme have
+// an allele, it outputs a line for each combination of tied alleles
+//
+//    QUERY_ID  NAME  ST  PROFILE  LOCI  ALLELE  ALLELE  ...
+//
+// where ST is 'ST' followed by the sequence type, or 'NF' if the profile is
+// not in the table, followed by a '*' for each inexact allele.  PROFILE and
+// LOCI are the alleles respectively loci joined by a separator character.
+
+class mlst_typer
+{
+    private:
+        struct scheme {
+            std::string id;
+            std::string name;
+            std::vector<std::string> loci;
+        };
+
+        std::vector<scheme> schemes_;
+        std::unordered_map<std::string,std::size_t> scheme_index_;
+        std::unordered_map<std::string,std::string> st_index_;  // 'SCHEME<tab>ALLELE...' -> ST
+
+        void read_config(const std::string& fname);
+        void read_profiles(const std::string& fname);
+
+    public:
+        // read kcst.cfg and kcst.tsv from directory db_dir
+        mlst_typer(const std::string& db_dir);
+
+        // write the typing of res for query_id to os, separating profiles by sep
+        void type(const query_result& res, const std::string& query_id, std::ostream& os, char sep = '-') const;
+
+        // the query ID that kcst derives from a file name: its base name up
+        // to the first '.'
+        static std::string query_id(const std::string& fname);
+};
+
+
+} // namespace khc
+
+#endif // mlst_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
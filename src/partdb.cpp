@@ -0,0 +1,472 @@
+/* partdb.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kmerdb.h"
+#include "trace.h"
+#include "utils.h"
+
+namespace khc {
+
+static std::string STR_MAGIC = "~kmerdb~";
+static std::string STR_VERSION = "v1";
+static std::string STR_KSIZE_LABEL = "ksize";
+
+static const char PART_MAGIC[8] = "~khcprt";
+static const std::uint32_t PART_VERSION = 1;
+
+// sections start on cache line boundaries, partition images on page
+// boundaries, so that each can be mapped and advised on its own
+
+static const std::size_t SECTION_ALIGN = 64;
+static const std::size_t PARTITION_ALIGN = 4096;
+
+
+// The file header.  All offsets are in bytes from the start of the file.
+// Everything up to the first partition image is read when the file is opened.
+
+struct partitioned_kmer_db::header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t kmer_bytes;
+    std::int32_t ksize;
+    std::int32_t max_vars;
+    std::uint64_t nseq;
+    std::uint64_t nparts;
+    std::uint64_t nsketch;
+    std::uint64_t size;
+    std::uint64_t off_parts;    // nparts+1 offsets of the partition images
+    std::uint64_t off_sketch;   // nsketch pairs (kmer, partition) of uint64
+    std::uint64_t off_lens;
+    std::uint64_t off_str_offs; // nparts+nseq offsets into the strings
+    std::uint64_t off_strings;  // partition names, then seq IDs, NUL-terminated
+};
+
+
+static std::size_t
+align(std::size_t n, std::size_t a)
+{
+    return (n + a - 1) / a * a;
+}
+
+// fits - whether count items of elem_size bytes at offset off fit in size
+//        bytes, without overflowing
+//
+static bool
+fits(std::uint64_t off, std::uint64_t count, std::uint64_t elem_size, std::uint64_t size)
+{
+    return off <= size && count <= (size - off) / elem_size;
+}
+
+// read_at - read n bytes at offset off of fd into buf, or raise an error
+//
+static void
+read_at(int fd, void *buf, std::size_t n, std::uint64_t off, const std::string& path)
+{
+    char *p = static_cast<char*>(buf);
+
+    while (n)
+    {
+        ssize_t r = ::pread(fd, p, n, off);
+
+        if (r < 0 && errno == EINTR)
+            continue;
+
+        if (r <= 0)
+            raise_error("failed to read partitioned database %s: %s",
+                    path.c_str(), r < 0 ? std::strerror(errno) : "unexpected end of file");
+
+        p += r;
+        n -= r;
+        off += r;
+    }
+}
+
+
+partitioned_kmer_db::partitioned_kmer_db(int ksize)
+    : fd_(-1), base_(0), size_(0), ksize_(ksize), max_vars_(0)
+{
+}
+
+partitioned_kmer_db::partitioned_kmer_db(partitioned_kmer_db&& o)
+    : path_(std::move(o.path_)), fd_(o.fd_), base_(o.base_), size_(o.size_),
+      ksize_(o.ksize_), max_vars_(o.max_vars_), ids_(std::move(o.ids_)), lens_(std::move(o.lens_)),
+      names_(std::move(o.names_)), part_offs_(std::move(o.part_offs_)), sketch_(std::move(o.sketch_)),
+      parts_(std::move(o.parts_)), bufs_(std::move(o.bufs_)), loaded_(std::move(o.loaded_))
+{
+    o.fd_ = -1;
+    o.base_ = 0;
+}
+
+partitioned_kmer_db::~partitioned_kmer_db()
+{
+    release();
+}
+
+void
+partitioned_kmer_db::release()
+{
+    parts_.clear();
+    bufs_.clear();
+
+    if (base_)
+        ::munmap(base_, size_);
+
+    if (fd_ >= 0)
+        ::close(fd_);
+
+    base_ = 0;
+    fd_ = -1;
+}
+
+
+bool
+partitioned_kmer_db::open(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+        return false;
+
+    header h;
+
+    if (::pread(fd, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h)) || std::memcmp(h.magic, PART_MAGIC, sizeof(PART_MAGIC)))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    release();
+    path_ = path;
+    fd_ = fd;
+
+    struct stat st;
+
+    if (h.version != PART_VERSION || h.kmer_bytes != sizeof(kmer_t) ||
+            ::fstat(fd, &st) < 0 || h.size > static_cast<std::uint64_t>(st.st_size))
+        raise_error("not a valid partitioned database (or of an incompatible version): %s", path.c_str());
+
+    // read everything before the first partition image, and unpack it,
+    // checking that each section lies within what was read
+
+    if (h.nparts >= h.size || !fits(h.off_parts, h.nparts + 1, sizeof(std::uint64_t), h.size) ||
+            h.off_parts % sizeof(std::uint64_t))
+        raise_error("corrupt partitioned database %s: partition offsets out of bounds", path.c_str());
+
+    std::vector<std::uint64_t> offs(h.nparts + 1);
+    read_at(fd, offs.data(), offs.size() * sizeof(std::uint64_t), h.off_parts, path);
+
+    for (std::uint64_t i = 0; i != h.nparts; ++i)
+        if (offs[i] > offs[i+1])
+            raise_error("corrupt partitioned database %s: partition offsets out of order", path.c_str());
+
+    if (offs[0] < h.off_parts + offs.size() * sizeof(std::uint64_t) || offs[h.nparts] > h.size)
+        raise_error("corrupt partitioned database %s: partitions out of bounds", path.c_str());
+
+    std::vector<char> meta(offs[0]);
+    read_at(fd, meta.data(), meta.size(), 0, path);
+
+    if (!fits(h.off_sketch, h.nsketch, 2 * sizeof(std::uint64_t), meta.size()) || h.off_sketch % sizeof(std::uint64_t))
+        raise_error("corrupt partitioned database %s: sketch out of bounds", path.c_str());
+
+    if (!fits(h.off_lens, h.nseq, sizeof(kcnt_t), meta.size()) || h.off_lens % sizeof(kcnt_t))
+        raise_error("corrupt partitioned database %s: sequence lengths out of bounds", path.c_str());
+
+    if (!fits(h.off_str_offs, h.nparts + h.nseq, sizeof(std::uint64_t), meta.size()) ||
+            h.off_str_offs % sizeof(std::uint64_t) || h.off_strings > meta.size())
+        raise_error("corrupt partitioned database %s: names out of bounds", path.c_str());
+
+    const std::uint64_t *sketch = reinterpret_cast<const std::uint64_t*>(meta.data() + h.off_sketch);
+    const kcnt_t *lens = reinterpret_cast<const kcnt_t*>(meta.data() + h.off_lens);
+    const std::uint64_t *str_offs = reinterpret_cast<const std::uint64_t*>(meta.data() + h.off_str_offs);
+    const char *strings = meta.data() + h.off_strings;
+    std::size_t n_strings = meta.size() - h.off_strings;
+
+    // each name must end in a NUL within the strings
+
+    for (std::uint64_t i = 0; i != h.nparts + h.nseq; ++i)
+        if (str_offs[i] >= n_strings || !std::memchr(strings + str_offs[i], 0, n_strings - str_offs[i]))
+            raise_error("corrupt partitioned database %s: name %lu out of bounds",
+                    path.c_str(), static_cast<unsigned long>(i));
+
+    ksize_ = h.ksize;
+    max_vars_ = h.max_vars;
+    part_offs_.swap(offs);
+
+    names_.clear();
+    for (std::uint64_t i = 0; i != h.nparts; ++i)
+        names_.push_back(strings + str_offs[i]);
+
+    ids_.clear();
+    for (std::uint64_t i = 0; i != h.nseq; ++i)
+        ids_.push_back(strings + str_offs[h.nparts + i]);
+
+    lens_.assign(lens, lens + h.nseq);
+
+    sketch_.clear();
+    sketch_.reserve(h.nsketch);
+    for (std::uint64_t i = 0; i != h.nsketch; ++i)
+        sketch_.push_back(std::make_pair(static_cast<kmer_t>(sketch[2*i]), static_cast<std::uint32_t>(sketch[2*i+1])));
+
+    // map the file; nothing is read until a partition is used
+
+    size_ = h.size;
+    void *base = ::mmap(0, size_, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (base != MAP_FAILED)
+    {
+        base_ = static_cast<char*>(base);
+        ::close(fd_);
+        fd_ = -1;
+    }
+    else
+        verbose_emit("cannot map %s (%s), reading partitions instead", path.c_str(), std::strerror(errno));
+
+    parts_.reserve(h.nparts);
+    for (std::uint64_t i = 0; i != h.nparts; ++i)
+        parts_.emplace_back(ksize_);
+
+    bufs_.resize(h.nparts);
+    loaded_.reset(new std::once_flag[h.nparts]);
+
+    verbose_emit("opened partitioned database %s: %lu partitions, %lu sequences",
+            path.c_str(), static_cast<unsigned long>(h.nparts), static_cast<unsigned long>(h.nseq));
+
+    return true;
+}
+
+
+const shared_kmer_db&
+partitioned_kmer_db::partition(std::size_t part) const
+{
+    std::call_once(loaded_[part], [this, part]() { load(part); });
+    return parts_[part];
+}
+
+void
+partitioned_kmer_db::load(std::size_t part) const
+{
+    trace_span span("load partition", "partition", part);
+
+    std::uint64_t off = part_offs_[part];
+    std::size_t size = part_offs_[part + 1] - off;
+    const char *image;
+
+    if (base_)
+    {
+        image = base_ + off;
+        ::madvise(base_ + off, size, MADV_WILLNEED);
+    }
+    else
+    {
+        bufs_[part].reset(new char[size]);
+        read_at(fd_, bufs_[part].get(), size, off, path_);
+        image = bufs_[part].get();
+    }
+
+    if (!parts_[part].view(image, size))
+        raise_error("invalid partition %s in %s", names_[part].c_str(), path_.c_str());
+
+    verbose_emit("loaded partition %s (%luK)", names_[part].c_str(), static_cast<unsigned long>(size >> 10));
+}
+
+
+void
+partitioned_kmer_db::create(const std::string& path, int max_vars,
+        const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens,
+        const std::vector<std::string>& names, const std::vector<std::uint64_t>& nkmers,
+        const std::vector<std::uint64_t>& nlocs, const sketch_t& sketch)
+{
+    std::size_t nparts = names.size();
+
+    header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, PART_MAGIC, sizeof(PART_MAGIC));
+    h.version = PART_VERSION;
+    h.kmer_bytes = sizeof(kmer_t);
+    h.ksize = ksize_;
+    h.max_vars = max_vars;
+    h.nseq = ids.size();
+    h.nparts = nparts;
+    h.nsketch = sketch.size();
+
+    std::size_t n_strings = 0;
+    for (const std::string& s : names)
+        n_strings += s.length() + 1;
+    for (const std::string& s : ids)
+        n_strings += s.length() + 1;
+
+    std::size_t off = align(sizeof(header), SECTION_ALIGN);
+    h.off_parts = off;
+    off = align(off + (nparts + 1) * sizeof(std::uint64_t), SECTION_ALIGN);
+    h.off_sketch = off;
+    off = align(off + 2 * sketch.size() * sizeof(std::uint64_t), SECTION_ALIGN);
+    h.off_lens = off;
+    off = align(off + ids.size() * sizeof(kcnt_t), SECTION_ALIGN);
+    h.off_str_offs = off;
+    off = align(off + (nparts + ids.size()) * sizeof(std::uint64_t), SECTION_ALIGN);
+    h.off_strings = off;
+    off = align(off + n_strings, PARTITION_ALIGN);
+
+    std::vector<std::uint64_t> offs;
+
+    for (std::size_t p = 0; p != nparts; ++p)
+    {
+        offs.push_back(off);
+        off = align(off + shared_kmer_db::image_size(ksize_, nkmers[p], nlocs[p],
+                    std::vector<std::string>(), names[p]), PARTITION_ALIGN);
+    }
+
+    offs.push_back(off);
+    h.size = off;
+
+    // create the file at its full size and fill it through a mapping
+
+    release();
+    path_ = path;
+
+    int fd = ::open(path.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+
+    if (fd < 0)
+        raise_error("failed to create partitioned database %s: %s", path.c_str(), std::strerror(errno));
+
+    if (::ftruncate(fd, h.size) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        raise_error("failed to size partitioned database %s to %luM: %s",
+                path.c_str(), static_cast<unsigned long>(h.size >> 20), std::strerror(err));
+    }
+
+    void *base = ::mmap(0, h.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (base == MAP_FAILED)
+        raise_error("failed to map partitioned database %s: %s", path.c_str(), std::strerror(errno));
+
+    verbose_emit("writing partitioned database %s: %lu partitions (%luM)",
+            path.c_str(), static_cast<unsigned long>(nparts), static_cast<unsigned long>(h.size >> 20));
+
+    base_ = static_cast<char*>(base);
+    size_ = h.size;
+
+    std::memcpy(base_, &h, sizeof(h));
+    std::memcpy(base_ + h.off_parts, offs.data(), offs.size() * sizeof(std::uint64_t));
+
+    std::uint64_t *sk = reinterpret_cast<std::uint64_t*>(base_ + h.off_sketch);
+    for (const auto& e : sketch)
+    {
+        *sk++ = e.first;
+        *sk++ = e.second;
+    }
+
+    std::copy(lens.begin(), lens.end(), reinterpret_cast<kcnt_t*>(base_ + h.off_lens));
+
+    std::uint64_t *str_offs = reinterpret_cast<std::uint64_t*>(base_ + h.off_str_offs);
+    char *strings = base_ + h.off_strings;
+    off = 0;
+
+    for (const std::vector<std::string>* v : { &names, &ids })
+        for (const std::string& s : *v)
+        {
+            *str_offs++ = off;
+            std::memcpy(strings + off, s.c_str(), s.length() + 1);
+            off += s.length() + 1;
+        }
+
+    parts_.reserve(nparts);
+
+    for (std::size_t p = 0; p != nparts; ++p)
+    {
+        parts_.emplace_back(ksize_);
+        parts_[p].name_ = path + ":" + names[p];
+        parts_[p].create_at(base_ + offs[p], nkmers[p], nlocs[p], max_vars,
+                std::vector<std::string>(), std::vector<kcnt_t>(), names[p]);
+    }
+}
+
+void
+partitioned_kmer_db::seal()
+{
+    for (shared_kmer_db& part : parts_)
+        part.seal();
+
+    if (::msync(base_, size_, MS_SYNC) < 0)
+        raise_error("failed to write partitioned database %s: %s", path_.c_str(), std::strerror(errno));
+}
+
+
+void
+partitioned_kmer_db::add_kloc(kmer_t, kloc_t)
+{
+    raise_error("cannot add to partitioned kmer db: it is read-only");
+}
+
+std::istream&
+partitioned_kmer_db::read(std::istream& is)
+{
+    raise_error("cannot read partitioned kmer db from a stream: open its file instead");
+    return is;
+}
+
+// write - writes in the same format as vector_kmer_db and map_kmer_db, with
+//         kmer i pointing at vector i+1, and vector 0 the empty vector
+
+std::ostream&
+partitioned_kmer_db::write(std::ostream& os) const
+{
+    static char W = ' ';
+
+    std::uint64_t nkmers = 0;
+    for_each([&](kmer_t, kloc_range) { ++nkmers; });
+
+    os << STR_MAGIC << W << STR_VERSION << W << STR_KSIZE_LABEL << W << ksize_ << std::endl;
+    os << nkmers + 1 << std::endl;
+    os << 0 << W << std::endl;
+
+    for_each([&](kmer_t, kloc_range r) {
+        os << r.size() << W;
+        os.write(reinterpret_cast<const char*>(r.begin()), r.size() * sizeof(kloc_t));
+        os << std::endl;
+    });
+
+    char buf[sizeof(kmer_t) + sizeof(kcnt_t)];
+    kmer_t* pkmer = reinterpret_cast<kmer_t*>(buf);
+    kcnt_t* pkcnt = reinterpret_cast<kcnt_t*>(buf + sizeof(kmer_t));
+    kcnt_t i = 0;
+
+    for_each([&](kmer_t kmer, kloc_range) {
+        *pkmer = kmer;
+        *pkcnt = ++i;
+        os.write(buf, sizeof(buf));
+    });
+
+    return os;
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
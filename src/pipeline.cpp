@@ -0,0 +1,304 @@
+/* pipeline.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+
+#include "pipeline.h"
+#include "trace.h"
+#include "utils.h"
+
+namespace khc {
+
+static const int SPIN_TRIES = 64;
+static const int YIELD_TRIES = 1024;
+static const std::chrono::microseconds SLEEP_TIME(50);
+
+// wait_until - wait until ready() returns true, or stop is set, adding the
+//              time waited to waited; returns ready()
+//
+template <typename F>
+static bool
+wait_until(F ready, const std::atomic<bool>& stop, double& waited)
+{
+    if (ready())
+        return true;
+
+    double t0 = wall_time();
+
+    for (int n = 0; !stop.load(std::memory_order_relaxed); ++n)
+    {
+        if (ready())
+        {
+            waited += wall_time() - t0;
+            return true;
+        }
+
+        if (n < SPIN_TRIES)
+            continue;
+        else if (n < SPIN_TRIES + YIELD_TRIES)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(SLEEP_TIME);
+    }
+
+    waited += wall_time() - t0;
+    return false;
+}
+
+// push, pop - blocking versions of spsc_ring::try_push and try_pop, which
+//             return false when the pipeline stops, and pop also when the
+//             ring is closed and empty
+//
+template <typename T>
+static bool
+push(spsc_ring<T>& ring, T& v, const std::atomic<bool>& stop, double& waited)
+{
+    return wait_until([&]() { return ring.try_push(v); }, stop, waited);
+}
+
+template <typename T>
+static bool
+pop(spsc_ring<T>& ring, T& v, const std::atomic<bool>& stop, double& waited)
+{
+    bool popped = false;
+
+    // closed must be read before trying, or we might miss the final push
+
+    wait_until([&]() { bool closed = ring.is_closed(); return (popped = ring.try_pop(v)) || closed; }, stop, waited);
+
+    return popped;
+}
+
+
+kmer_pipeline::kmer_pipeline(source_t source, int ksize, bool skip_degens, int min_qual, int n_threads)
+    : source_(source), ksize_(ksize), skip_degens_(skip_degens), min_qual_(min_qual),
+      stop_(false), n_batches_(0), start_(wall_time()), start_cpu_(thread_cpu_time()), finished_(false)
+{
+    parse_.name = "parse";
+    parse_.threads = 1;
+    lookup_.name = "lookup";
+    lookup_.threads = 1;
+
+    for (int i = 0; i < n_threads || i == 0; ++i)
+        lanes_.push_back(std::unique_ptr<lane>(new lane));
+
+    threads_.push_back(std::thread([this]() {
+        tracer::name_thread("parse");
+
+        try
+        {
+            run_parse();
+        }
+        catch (...)
+        {
+            fail();
+        }
+
+        parse_.cpu = thread_cpu_time();
+
+        for (auto& l : lanes_)
+            l->in.close();
+    }));
+
+    for (auto& l : lanes_)
+    {
+        lane *pl = l.get();
+
+        threads_.push_back(std::thread([this, pl]() {
+            tracer::name_thread("kmerise");
+
+            try
+            {
+                run_kmerise(*pl);
+            }
+            catch (...)
+            {
+                fail();
+            }
+
+            pl->cpu = thread_cpu_time();
+            pl->out.close();
+        }));
+    }
+}
+
+kmer_pipeline::~kmer_pipeline()
+{
+    stop();
+}
+
+void
+kmer_pipeline::fail()
+{
+    std::lock_guard<std::mutex> lock(error_mutex_);
+
+    if (!error_)
+        error_ = std::current_exception();
+
+    stop_ = true;
+}
+
+void
+kmer_pipeline::stop()
+{
+    stop_ = true;
+
+    for (std::thread& t : threads_)
+        if (t.joinable())
+            t.join();
+}
+
+void
+kmer_pipeline::run_parse()
+{
+    sequence_span seq;
+    std::size_t n = 0;
+    bool more = true;
+
+    while (more && !stop_)
+    {
+        lane &l = *lanes_[n % lanes_.size()];
+        batch_ptr b;
+
+        if (!l.free.try_pop(b))
+            b.reset(new batch);
+
+        double t0 = wall_time();
+
+        b->data.clear();
+        b->qual.clear();
+        b->seq_ends.clear();
+        b->partial.clear();
+
+        while (b->data.size() < BATCH_BASES && (more = source_(seq)))
+        {
+            b->data.append(seq.data, seq.data_len);
+
+            if (seq.qual)
+                b->qual.append(seq.qual, seq.data_len);
+
+            b->seq_ends.push_back(b->data.size());
+            b->partial.push_back(seq.partial);
+        }
+
+        double t1 = wall_time();
+        parse_.busy += t1 - t0;
+
+        if (tracer::enabled())
+            tracer::record("parse", t0, t1, "bases", b->data.size());
+
+        if (b->seq_ends.empty() || !push(l.in, b, stop_, parse_.blocked))
+            break;
+
+        ++n;
+    }
+}
+
+void
+kmer_pipeline::run_kmerise(lane& l)
+{
+    kmeriser k(ksize_, skip_degens_, min_qual_);
+    batch_ptr b;
+
+    while (pop(l.in, b, stop_, l.starved))
+    {
+        double t0 = wall_time();
+
+        const char *data = b->data.data();
+        const char *qual = b->qual.empty() ? 0 : b->qual.data();
+        std::size_t beg = 0;
+
+        b->kmers.clear();
+        b->kmer_ends.clear();
+
+        for (std::size_t end : b->seq_ends)
+        {
+            k.set(data + beg, data + end, qual ? qual + beg : 0);
+
+            while (k.next())
+                b->kmers.push_back(k.knum());
+
+            b->kmer_ends.push_back(b->kmers.size());
+            beg = end;
+        }
+
+        double t1 = wall_time();
+        l.busy += t1 - t0;
+
+        if (tracer::enabled())
+            tracer::record("kmerise", t0, t1, "kmers", b->kmers.size());
+
+        if (!push(l.out, b, stop_, l.blocked))
+            break;
+    }
+}
+
+const kmer_pipeline::batch*
+kmer_pipeline::next()
+{
+    if (current_)
+    {
+        lanes_[(n_batches_ - 1) % lanes_.size()]->free.try_push(current_);
+        current_.reset();
+    }
+
+    if (pop(lanes_[n_batches_ % lanes_.size()]->out, current_, stop_, lookup_.starved))
+        ++n_batches_;
+    else
+        current_.reset();
+
+    return current_.get();
+}
+
+void
+kmer_pipeline::finish()
+{
+    if (!finished_)
+    {
+        finished_ = true;
+        lookup_.busy = wall_time() - start_ - lookup_.starved;
+        lookup_.cpu = thread_cpu_time() - start_cpu_;
+        stop();
+    }
+
+    if (error_)
+        std::rethrow_exception(error_);
+}
+
+std::vector<stage_stats>
+kmer_pipeline::stats() const
+{
+    stage_stats kmerise;
+    kmerise.name = "kmerise";
+    kmerise.threads = lanes_.size();
+
+    for (const auto& l : lanes_)
+    {
+        kmerise.busy += l->busy;
+        kmerise.starved += l->starved;
+        kmerise.blocked += l->blocked;
+        kmerise.cpu += l->cpu;
+    }
+
+    return { parse_, kmerise, lookup_ };
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,200 @@
+/* pipeline.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef pipeline_h_INCLUDED
+#define pipeline_h_INCLUDED
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "kmerise.h"
+#include "seqreader.h"
+
+namespace khc {
+
+// This header defines class kmer_pipeline, which runs the reading, parsing
+// and kmerising of a query on threads of their own, so that they overlap with
+// the lookups on the calling thread, and the spsc_ring queues between them.
+
+
+// spsc_ring - bounded lock-free queue between one producer and one consumer
+//
+// The producer calls try_push() and finally close(), the consumer try_pop().
+// Neither blocks; waiting on a full or empty ring is up to the caller.  The
+// head and tail are kept on separate cache lines, so that the two threads do
+// not contend for one.
+//
+template <typename T>
+class spsc_ring
+{
+    private:
+        std::vector<T> slots_;
+        char pad0_[64];
+        std::atomic<std::size_t> head_;     // next slot to pop
+        char pad1_[64];
+        std::atomic<std::size_t> tail_;     // next slot to push
+        char pad2_[64];
+        std::atomic<bool> closed_;
+
+    public:
+        explicit spsc_ring(std::size_t capacity)
+            : slots_(capacity), head_(0), tail_(0), closed_(false) { }
+
+        // move v into the ring and return true, or return false if it is full
+        bool try_push(T& v) {
+            std::size_t t = tail_.load(std::memory_order_relaxed);
+            if (t - head_.load(std::memory_order_acquire) == slots_.size())
+                return false;
+            slots_[t % slots_.size()] = std::move(v);
+            tail_.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        // move the oldest element into v and return true, or return false if
+        // the ring is empty
+        bool try_pop(T& v) {
+            std::size_t h = head_.load(std::memory_order_relaxed);
+            if (h == tail_.load(std::memory_order_acquire))
+                return false;
+            v = std::move(slots_[h % slots_.size()]);
+            head_.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        // producer: nothing more will be pushed
+        void close() { closed_.store(true, std::memory_order_release); }
+        bool is_closed() const { return closed_.load(std::memory_order_acquire); }
+};
+
+
+// stage_stats - where the threads of a pipeline stage spent their time
+//
+// Times are in seconds, summed over the threads of the stage.  A stage that
+// is mostly busy limits the throughput; one that mostly waits for input is
+// starved by the stage before it, one that waits for output is held back by
+// the stage after it.
+//
+struct stage_stats
+{
+    std::string name;
+    int threads = 0;
+    double busy = 0.0;      // working
+    double starved = 0.0;   // waiting for input
+    double blocked = 0.0;   // waiting for room in the output
+    double cpu = 0.0;       // CPU time used, waiting included
+
+    // the fraction of the stage's time that t is
+    double share(double t) const {
+        double total = busy + starved + blocked;
+        return total > 0.0 ? t / total : 0.0;
+    }
+
+    double utilisation() const { return share(busy); }
+};
+
+
+// kmer_pipeline - reads, parses and kmerises a query in stages
+//
+// The 'parse' stage is one thread that calls source until it returns false,
+// and packs the sequences into batches.  The 'kmerise' stage has n_threads
+// threads, each in its own lane, which the batches visit in turn.  Every lane
+// has an spsc_ring from the parse thread and one to the consumer, who calls
+// next() to get the batches in input order, so the results are as if the
+// query were processed serially.  Batches go back to the parse thread on a
+// third ring per lane, so their memory is reused.
+//
+// The rings are bounded, so a stage that runs ahead waits until the next
+// stage has caught up.  Waits spin briefly, then yield, then sleep.  The
+// consumer is the third stage, 'lookup'; the time it spends outside next()
+// counts as busy.
+//
+// Errors raised in the stages end the pipeline, and are rethrown by finish().
+// Destroying the pipeline before the end stops it.
+//
+class kmer_pipeline
+{
+    public:
+        typedef std::function<bool(sequence_span&)> source_t;
+
+        // batch - consecutive query sequences and their kmers
+        struct batch {
+            std::string data;                     // the sequences back to back
+            std::string qual;                     // their phred scores, or empty
+            std::vector<std::size_t> seq_ends;    // end of each sequence in data
+            std::vector<char> partial;            // whether it is a partial chunk
+            std::vector<knum_t> kmers;            // the kmers of the sequences
+            std::vector<std::size_t> kmer_ends;   // end of each sequence's kmers
+        };
+
+        static const std::size_t BATCH_BASES = 1 << 18;
+
+    private:
+        typedef std::unique_ptr<batch> batch_ptr;
+
+        struct lane {
+            spsc_ring<batch_ptr> in, out, free;
+            double busy = 0.0, starved = 0.0, blocked = 0.0, cpu = 0.0;
+            lane() : in(2), out(2), free(4) { }
+        };
+
+        source_t source_;
+        int ksize_;
+        bool skip_degens_;
+        int min_qual_;
+
+        std::vector<std::unique_ptr<lane> > lanes_;
+        std::vector<std::thread> threads_;
+        std::atomic<bool> stop_;
+        std::exception_ptr error_;
+        std::mutex error_mutex_;
+
+        stage_stats parse_, lookup_;
+        batch_ptr current_;
+        std::size_t n_batches_;             // batches handed out by next()
+        double start_;
+        double start_cpu_;
+        bool finished_;
+
+        void run_parse();
+        void run_kmerise(lane&);
+        void fail();
+        void stop();
+
+    public:
+        kmer_pipeline(source_t source, int ksize, bool skip_degens, int min_qual, int n_threads);
+        ~kmer_pipeline();
+
+        // the next batch, or null at the end; valid until the next call
+        const batch* next();
+
+        // stop and join the stages, and rethrow the first error they raised
+        void finish();
+
+        // the time spent per stage; complete after finish()
+        std::vector<stage_stats> stats() const;
+};
+
+
+} // namespace khc
+
+#endif // pipeline_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
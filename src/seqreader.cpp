@@ -16,73 +16,306 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <string>
+#include <algorithm>
 #include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "seqreader.h"
 #include "utils.h"
 
-#ifndef NO_ZLIB
-#include <boost/iostreams/filter/gzip.hpp>
-#endif
-
 namespace khc {
 
 
 
-sequence_reader::sequence_reader(std::istream &is, mode_t mode)
-#ifdef NO_ZLIB
-    : is_(is), lineno_(0), mode_(mode)
+// membuf - read-only streambuf over a buffer in memory, without copying it
+//
+class membuf : public std::streambuf
 {
-    if (is.peek() == 0x1f)
-        raise_error("no decompression support");
-#else
-    : lineno_(0), mode_(mode)
+    public:
+        membuf(const char *data, std::size_t len) {
+            char *p = const_cast<char*>(data);
+            setg(p, p, p + len);
+        }
+};
+
+
+sequence_reader::sequence_reader(std::istream &is, mode_t mode, std::size_t block_size)
+    : is_(&is), mem_(0), map_len_(0), in_len_(0), in_read_(0), buf_(block_size ? block_size : 1), pos_(0), end_(0), keep_(0), scan_(0),
+      eof_(false), line_off_(0), line_len_(0), line_cont_(false), in_piece_(false), lineno_(0), mode_(mode),
+      started_(false), chunk_(0), overlap_(0), cont_(false)
 {
-    if (is.peek() == 0x1f)
+    open_input();
+}
+
+sequence_reader::sequence_reader(const char *data, std::size_t len, mode_t mode)
+    : is_(0), mem_(data), map_len_(0), in_len_(0), in_read_(0), pos_(0), end_(len), keep_(0), scan_(0),
+      eof_(true), line_off_(0), line_len_(0), line_cont_(false), in_piece_(false), lineno_(0), mode_(mode),
+      started_(false), chunk_(0), overlap_(0), cont_(false)
+{
+    // compressed data is read through a stream, as that is what it inflates
+
+    if (len && data[0] == 0x1f)
     {
-        verbose_emit("detected compressed input");
-        is_.push(boost::iostreams::gzip_decompressor());
+        own_buf_.reset(new membuf(data, len));
+        own_is_.reset(new std::istream(own_buf_.get()));
+        is_ = own_is_.get();
+        mem_ = 0;
+        in_len_ = len;
+        buf_.resize(BLOCK_SIZE);
+        end_ = 0;
+        eof_ = false;
+    }
+
+    open_input();
+}
+
+sequence_reader::sequence_reader(const std::string& fname, mode_t mode, std::size_t block_size)
+    : is_(0), mem_(0), map_len_(0), in_len_(0), in_read_(0), pos_(0), end_(0), keep_(0), scan_(0),
+      eof_(false), line_off_(0), line_len_(0), line_cont_(false), in_piece_(false), lineno_(0), mode_(mode),
+      started_(false), chunk_(0), overlap_(0), cont_(false)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+
+    if (fd == -1)
+        raise_error("failed to open file: %s: %s", fname.c_str(), std::strerror(errno));
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    unsigned char first = 0;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    if (regular && st.st_size > 0 && pread(fd, &first, 1, 0) == 1 && first != 0x1f)
+        p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (p != MAP_FAILED)
+    {
+        verbose_emit("mapped query file into memory");
+        madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+        mem_ = static_cast<const char*>(p);
+        map_len_ = end_ = st.st_size;
+        eof_ = true;
+    }
+    else
+    {
+        own_is_.reset(new std::ifstream(fname.c_str(), std::ios_base::in|std::ios_base::binary));
+
+        if (!*own_is_)
+            raise_error("failed to open file: %s", fname.c_str());
+
+        is_ = own_is_.get();
+        in_len_ = regular ? st.st_size : 0;
+        buf_.resize(block_size ? block_size : 1);
     }
 
-    is_.push(is);
+    open_input();
+}
+
+sequence_reader::~sequence_reader()
+{
+#ifndef NO_ZLIB
+    gz_.reset();
 #endif
 
-    if (next_line())
+    if (map_len_)
+        munmap(const_cast<char*>(mem_), map_len_);
+}
+
+void
+sequence_reader::open_input()
+{
+    if (is_ && is_->peek() == 0x1f)
+    {
+#ifdef NO_ZLIB
+        raise_error("no decompression support");
+#else
+        verbose_emit("detected compressed input");
+        gz_.reset(new gzip_inflater(*is_));
+#endif
+    }
+}
+
+// start - read the first line and detect or check the mode; this is left to
+//         the first next(), so that set_chunking() can still apply to it
+//
+void
+sequence_reader::start()
+{
+    started_ = true;
+
+    if (next_line(chunk_))
     {
         if (mode_ == detect)
-            switch (line_[0]) {
+            switch (line()[0]) {
                 case '>': mode_ = fasta; break;
                 case '@': mode_ = fastq; break;
                 default:  mode_ = bare; break;
             }
-        else if (mode == fasta && line_[0] != '>')
+        else if (mode_ == fasta && line()[0] != '>')
             raise_error("line %d: invalid FASTA, expected '>'", lineno_);
-        else if (mode == fastq && line_[0] != '@')
+        else if (mode_ == fastq && line()[0] != '@')
             raise_error("line %d: invalid FASTQ, expected '@'", lineno_);
     }
 }
 
+void
+sequence_reader::set_chunking(std::size_t overlap, std::size_t chunk_size)
+{
+    overlap_ = overlap;
+    chunk_ = std::max(chunk_size, overlap + 1);
+}
+
 bool
-sequence_reader::next_line()
+sequence_reader::input_progress(std::size_t& pos, std::size_t& len) const
 {
-    line_.clear();
+    if (mem_)
+    {
+        pos = pos_;
+        len = end_;
+        return true;
+    }
 
-    while (std::getline(is_, line_))
+    // the stream may be in use by the inflater, so we count what was read
+    // off it rather than ask it
+
+    if (!in_len_)
+        return false;
+
+#ifndef NO_ZLIB
+    pos = gz_ ? gz_->bytes_in() : in_read_;
+#else
+    pos = in_read_;
+#endif
+    len = in_len_;
+
+    return true;
+}
+
+// fill - read the next block from the stream into the buffer, first moving
+//        the data from keep_ onward to its start, or growing the buffer when
+//        at most half of it would be free; returns false at end of stream
+//
+bool
+sequence_reader::fill()
+{
+    if (eof_)
+        return false;
+
+    if (keep_ != 0)
     {
-        ++lineno_;
+        std::memmove(buf_.data(), buf_.data() + keep_, end_ - keep_);
+        pos_ -= keep_;
+        end_ -= keep_;
+        scan_ -= keep_;
+        line_off_ -= keep_;
+        keep_ = 0;
+    }
 
-        if (!line_.empty())
-            return true;
+    if (buf_.size() - end_ <= buf_.size() / 2)
+        buf_.resize(2 * buf_.size());
+
+    std::size_t n;
+#ifndef NO_ZLIB
+    if (gz_)
+        n = gz_->read(buf_.data() + end_, buf_.size() - end_);
+    else
+#endif
+    {
+        is_->read(buf_.data() + end_, buf_.size() - end_);
+        n = is_->gcount();
+        in_read_ += n;
     }
 
-    return false;
+    end_ += n;
+    eof_ = n == 0;
+
+    return !eof_;
 }
 
+// next_line - make the next non-empty line the current line, or return false
+//             at end of input; a final line need not end in a newline
+//
+// When max_len is set, a line longer than that is returned in pieces of
+// max_len, the last of which may be shorter.  Header lines ('>' or '@') are
+// always returned whole.  Line_cont_ tells if the current line continues the
+// piece before it.
+//
 bool
-sequence_reader::next(sequence &seq)
+sequence_reader::next_line(std::size_t max_len)
+{
+    for (;;)
+    {
+        const char *nl = static_cast<const char*>(std::memchr(buf() + scan_, '\n', end_ - scan_));
+
+        if (max_len && pos_ != end_ && (in_piece_ || (buf()[pos_] != '>' && buf()[pos_] != '@')))
+        {
+            std::size_t eol = nl ? nl - buf() : end_;
+
+            if (eol - pos_ > max_len)
+            {
+                line_off_ = pos_;
+                line_len_ = max_len;
+                pos_ += max_len;
+                scan_ = eol;
+
+                if (!in_piece_)
+                    ++lineno_;
+
+                line_cont_ = in_piece_;
+                in_piece_ = true;
+                return true;
+            }
+        }
+
+        if (!nl)
+        {
+            scan_ = end_;
+
+            if (fill())
+                continue;
+
+            if (pos_ == end_)
+            {
+                line_off_ = pos_;
+                line_len_ = 0;
+                line_cont_ = in_piece_ = false;
+                return false;
+            }
+
+            nl = buf() + end_;
+        }
+
+        line_off_ = pos_;
+        line_len_ = nl - (buf() + pos_);
+        pos_ = scan_ = std::min(line_off_ + line_len_ + 1, end_);
+
+        if (!in_piece_)
+            ++lineno_;
+
+        line_cont_ = in_piece_;
+        in_piece_ = false;
+
+        if (line_len_)
+            return true;
+    }
+}
+
+bool
+sequence_reader::next(sequence_span &seq)
 {
-    if (line_.empty())
+    if (!started_)
+        start();
+
+    if (!line_len_)
         return false;
 
     switch (mode_) {
@@ -95,69 +328,205 @@ sequence_reader::next(sequence &seq)
     return true;
 }
 
-void
-sequence_reader::read_bare(sequence &seq)
+bool
+sequence_reader::next(sequence &seq)
 {
     static const std::string ANONYMOUS("(anonymous)");
 
-    seq.id = ANONYMOUS;
-    seq.header.clear();
-    seq.data = line_;
+    sequence_span s;
 
-    while (next_line()) {
-
-        std::string::size_type pos = 0;
-        while ((pos = line_.find(' ', pos)) != std::string::npos)
-            line_.erase(pos, 1);
+    if (!next(s))
+        return false;
 
-        seq.data.append(line_);
+    if (s.header)
+    {
+        seq.header.assign(s.header, s.header_len);
+        seq.id.assign(s.header + 1, s.id_len);
+    }
+    else
+    {
+        seq.header.clear();
+        seq.id = ANONYMOUS;
     }
+
+    seq.data.assign(s.data, s.data_len);
+
+    if (s.qual)
+        seq.qual.assign(s.qual, s.data_len);
+    else
+        seq.qual.clear();
+
+    seq.partial = s.partial;
+
+    return true;
 }
 
-void
-sequence_reader::read_fasta(sequence &seq)
+// id_length - length of the ID in header line h of length n: the part after
+//             the initial '>' or '@' up to the first whitespace
+//
+static std::size_t
+id_length(const char *h, std::size_t n)
 {
-    seq.header = line_;
+    const char *p = h + 1, *e = h + n;
 
-    std::string::const_iterator p = line_.begin() + 1;
-    while (p != line_.end() && !std::isspace(*p))
+    while (p != e && !std::isspace(*p))
         ++p;
-    seq.id = std::string(line_, 1, p - line_.begin() - 1);
 
-    seq.data.clear();
+    return p - h - 1;
+}
 
-    while (next_line())
-    {
-        if (line_[0] == '>')
+// The read_* functions keep the current record in the buffer from keep_, and
+// store offsets relative to keep_, which stay valid when fill moves the data.
+
+// When chunking, a chunk ends once it has chunk_ chars, and cont_ says that
+// the lookahead line continues the sequence.  The next chunk then starts with
+// the last overlap_ chars of this one, which are kept in scratch_.  Keep_
+// moves along with the chunks, so the buffer holds only the current one.
+
+void
+sequence_reader::read_bare(sequence_span &seq)
+{
+    keep_ = line_off_;
+
+    if (cont_)
+        scratch_.erase(0, scratch_.size() - overlap_);
+    else
+        scratch_.clear();
+
+    cont_ = false;
+
+    do {
+        const char *p = line(), *e = p + line_len_;
+
+        while (p != e)
+        {
+            const char *q = static_cast<const char*>(std::memchr(p, ' ', e - p));
+
+            if (!q)
+                q = e;
+
+            scratch_.append(p, q);
+            p = q == e ? e : q + 1;
+        }
+
+        if (chunk_ && scratch_.length() >= chunk_)
+        {
+            cont_ = next_line(chunk_);
             break;
+        }
+    } while (next_line(chunk_));
+
+    seq.header = 0;
+    seq.header_len = seq.id_len = 0;
+    seq.data = scratch_.data();
+    seq.data_len = scratch_.length();
+    seq.qual = 0;
+    seq.partial = cont_;
+}
 
-        seq.data.append(line_);
+void
+sequence_reader::read_fasta(sequence_span &seq)
+{
+    keep_ = line_off_;
+
+    bool first = !cont_;
+    std::size_t hdr_len = 0;
+    std::size_t data_off = 0, data_len = 0;
+    int n_lines = 0;
+    bool have = true;
+
+    if (first)
+    {
+        hdr_len = line_len_;
+        have = next_line(chunk_);
     }
+    else
+    {
+        scratch_.erase(0, scratch_.size() - overlap_);
+        n_lines = 2;    // collate onto the overlap
+    }
+
+    cont_ = false;
+
+    while (have && (line_cont_ || line()[0] != '>'))
+    {
+        if (n_lines++ == 0)
+        {
+            data_off = line_off_ - keep_;
+            data_len = line_len_;
+        }
+        else
+        {
+            if (n_lines == 2)
+                scratch_.assign(buf() + keep_ + data_off, data_len);
+
+            scratch_.append(line(), line_len_);
+        }
+
+        have = next_line(chunk_);
+
+        if (chunk_ && (n_lines > 1 ? scratch_.length() : data_len) >= chunk_)
+        {
+            cont_ = have && (line_cont_ || line()[0] != '>');
+            break;
+        }
+    }
+
+    const char *base = buf() + keep_;
+
+    if (first && cont_)
+        hdr_.assign(base, hdr_len);
+
+    seq.header = first ? base : hdr_.data();
+    seq.header_len = first ? hdr_len : hdr_.length();
+    seq.id_len = id_length(seq.header, seq.header_len);
+    seq.data = n_lines > 1 ? scratch_.data() : base + data_off;
+    seq.data_len = n_lines > 1 ? scratch_.length() : data_len;
+    seq.qual = 0;
+    seq.partial = cont_;
+
+    // a chunk used in place leaves its overlap for the next in scratch_
+
+    if (cont_ && n_lines == 1)
+        scratch_.assign(seq.data + data_len - overlap_, overlap_);
 }
 
 void
-sequence_reader::read_fastq(sequence &seq)
+sequence_reader::read_fastq(sequence_span &seq)
 {
-    seq.header = line_;
+    keep_ = line_off_;
 
-    std::string::const_iterator p = line_.begin() + 1;
-    while (p != line_.end() && !std::isspace(*p))
-        ++p;
-    seq.id = std::string(line_, 1, p - line_.begin() - 1);
+    std::size_t hdr_len = line_len_;
 
-    if (!next_line()) 
+    if (!next_line())
         raise_error("line %d: invalid fastq, expected base sequence", lineno_);
 
-    seq.data = line_;
+    std::size_t data_off = line_off_ - keep_;
+    std::size_t data_len = line_len_;
 
-    if (!next_line() || line_[0] != '+')
+    if (!next_line() || line()[0] != '+')
         raise_error("line %d: invalid fastq, line should start with '+'", lineno_);
 
     if (!next_line())
         raise_error("line %d: invalid fastq, line with phred scores expected", lineno_);
 
-    if (next_line() && line_[0] != '@')
+    if (line_len_ != data_len)
+        raise_error("line %d: invalid fastq, phred scores and sequence differ in length", lineno_);
+
+    std::size_t qual_off = line_off_ - keep_;
+
+    if (next_line() && line()[0] != '@')
         raise_error("line %d: invalid fastq, header line should start with '@'", lineno_);
+
+    const char *base = buf() + keep_;
+
+    seq.header = base;
+    seq.header_len = hdr_len;
+    seq.id_len = id_length(base, hdr_len);
+    seq.data = base + data_off;
+    seq.data_len = data_len;
+    seq.qual = base + qual_off;
+    seq.partial = false;
 }
 
 
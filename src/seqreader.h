@@ -18,14 +18,15 @@
 #ifndef seqreader_h_INCLUDED
 #define seqreader_h_INCLUDED
 
+#include <atomic>
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
-#ifndef NO_ZLIB
-#  include <boost/iostreams/filtering_stream.hpp>
-#endif
-
 namespace khc {
 
 
@@ -35,9 +36,112 @@ struct sequence {
     std::string header;  // full header of the sequence, including '>' or '@'
     std::string id;      // whatever is between '>' or '@' and the first space
     std::string data;    // the sequence data, collated into a single line
+    std::string qual;    // the phred scores (FASTQ only, else empty)
+    bool partial = false; // more of the sequence follows (when chunking)
 };
 
 
+// sequence_span - View on a single sequence, without copies
+//
+// The pointers point into the buffer of the sequence_reader that returned it,
+// and are valid until its next call to next().  The ID is the id_len chars
+// at header + 1.  For bare data, header is null.  Qual is null unless the
+// input is FASTQ, else it has data_len chars.  Partial is set when the span
+// is a chunk and more chunks of the sequence follow.
+//
+struct sequence_span {
+    const char *header = 0;
+    std::size_t header_len = 0;
+    std::size_t id_len = 0;
+    const char *data = 0;
+    std::size_t data_len = 0;
+    const char *qual = 0;
+    bool partial = false;
+
+    sequence_span() { }
+    sequence_span(const sequence& s)
+        : header(s.header.empty() ? 0 : s.header.data()), header_len(s.header.length()), id_len(s.id.length()),
+          data(s.data.data()), data_len(s.data.length()), qual(s.qual.empty() ? 0 : s.qual.data()),
+          partial(s.partial) { }
+};
+
+
+#ifndef NO_ZLIB
+
+// gzip_inflater - decompresses a gzip stream on background threads
+//
+// The inflater reads the stream and inflates it into a ring of buffers, from
+// which read() hands out the data in order.  The ring is bounded, so the
+// inflater runs at most a ring's length ahead of the reader.
+//
+// When the stream is BGZF (as written by bgzip and samtools), which is a
+// series of gzip members with their compressed size in an extra field, one
+// thread cuts the stream into batches of whole blocks, and n_threads workers
+// inflate the batches in parallel.  Any other gzip stream, including ones
+// with multiple members, is inflated by a single thread, which then still
+// runs in parallel with the parsing of its output.
+//
+// Errors on the background threads are raised as khc::error by read().  The
+// stream must stay valid, and must not be used by anyone else, for the
+// lifetime of the inflater.
+//
+class gzip_inflater {
+
+    public:
+        static const std::size_t BLOCK_SIZE = 1 << 20;
+
+    private:
+        struct slot {
+            std::vector<char> in;     // compressed BGZF blocks
+            std::vector<char> out;    // inflated data
+            bool ready = false;
+        };
+
+        std::istream &is_;
+        std::vector<slot> ring_;
+        std::vector<char> in_;        // stream data not yet consumed
+        std::size_t in_pos_;
+        std::atomic<std::size_t> n_in_;   // bytes read off the stream
+
+        std::size_t n_queued_;        // slots filled by the producer
+        std::size_t n_claimed_;       // slots taken up by the workers
+        std::size_t n_read_;          // slots fully read
+        std::size_t out_pos_;         // position in slot n_read_
+        bool eof_;                    // producer is done, n_queued_ is final
+        bool stop_;
+        std::string error_;
+
+        std::mutex mutex_;
+        std::condition_variable cond_;
+        std::vector<std::thread> threads_;
+
+        std::size_t fill_input(std::size_t min);
+        bool wait_free_slot();
+        void queue_slot();
+        void fail(const char *what);
+
+        void run_bgzf();
+        void run_gzip();
+        void run_worker();
+
+    public:
+        gzip_inflater(std::istream&, int n_threads = 0);
+        ~gzip_inflater();
+
+        // copy up to n bytes of inflated data to buf, return 0 at end
+        std::size_t read(char *buf, std::size_t n);
+
+        // the number of compressed bytes read off the stream so far
+        std::size_t bytes_in() const { return n_in_.load(std::memory_order_relaxed); }
+
+        // the number of bytes at p that make up a BGZF block, or 0 if p does
+        // not start a BGZF block header, or len is too short to tell
+        static std::size_t bgzf_block_size(const char *p, std::size_t len);
+};
+
+#endif // NO_ZLIB
+
+
 // sequence_reader - reads sequences off a stream
 //
 // This reader parses an input stream of FASTA, FASTQ, or bare sequence data,
@@ -50,7 +154,8 @@ struct sequence {
 // For FASTA and FASTQ the reader validates the structure of the input.  For
 // each sequence it returns the full header, the sequence ID (the part of the
 // header between the initial '>' or '@' and the first whitespace), and the
-// collated sequence content.
+// collated sequence content.  For FASTQ it also returns the quality scores,
+// which must have the same length as the sequence.
 //
 // For bare data, all data is returned in the first call to next().  The
 // sequence header is empty, and the ID is set to '(anonymous)'.
@@ -58,30 +163,105 @@ struct sequence {
 // The reader does not validate the content of the sequences.  It passes
 // through all characters, except for whitespace which it strips in bare mode.
 //
+// Gzipped input is detected by its first byte, and decompressed by a
+// gzip_inflater.
+//
+// Input that is in memory as a whole, such as a buffer or a mapped regular
+// file, is used in place, so sequences on a single line are never copied.
+//
+// After set_chunking(), FASTA and bare sequences longer than chunk_size are
+// returned in chunks, each starting with the last overlap chars of the one
+// before, and all but the last marked partial.  Lines longer than chunk_size
+// are read in pieces, so memory use does not grow with sequence or line
+// length.  With overlap k-1, the kmers of the chunks are exactly the kmers of
+// the whole sequence.  FASTQ records are always returned whole.
+//
+// The reader reads the stream in blocks, and finds lines with memchr.  The
+// next(sequence_span&) variant returns the sequence as pointers into the
+// block when its data is on one line, as in FASTQ and most read files, and
+// otherwise collates the data in a scratch buffer.  Lines may be longer than
+// block_size; the buffer grows to hold them.
+//
 class sequence_reader {
 
     public:
         enum mode_t { detect, bare, fasta, fastq };
 
+        static const std::size_t BLOCK_SIZE = 1 << 20;
+        static const std::size_t CHUNK_SIZE = 1 << 18;
+
     private:
+        std::istream *is_;
+        std::unique_ptr<std::streambuf> own_buf_;
+        std::unique_ptr<std::istream> own_is_;
 #ifndef NO_ZLIB
-        boost::iostreams::filtering_istream is_;
-#else
-        std::istream &is_;
+        std::unique_ptr<gzip_inflater> gz_;
 #endif
-        std::string line_;
+        const char *mem_;        // the whole input, when it is in memory
+        std::size_t map_len_;    // length of mem_ when we mapped it
+        std::size_t in_len_;     // size of the input stream, 0 if unknown
+        std::size_t in_read_;    // bytes that fill() read off the stream
+        std::vector<char> buf_;
+        std::size_t pos_;        // next unscanned char in buf()
+        std::size_t end_;        // end of the data in buf()
+        std::size_t keep_;       // start of the data that must stay in buf()
+        std::size_t scan_;       // where to continue looking for a newline
+        bool eof_;
+
+        std::size_t line_off_;   // the current line, which between records
+        std::size_t line_len_;   // is the lookahead; zero length at end
+        bool line_cont_;         // the current line continues the previous piece
+        bool in_piece_;          // the current line is a piece, its rest follows
         int lineno_;
         mode_t mode_;
+        bool started_;
+
+        std::size_t chunk_;      // chunk size, or 0 for whole sequences
+        std::size_t overlap_;
+        bool cont_;              // the next chunk continues a sequence
+        std::string hdr_;        // the header of the continued sequence
+
+        std::string scratch_;
+
+        void open_input();
+        void start();
+        bool fill();
+        const char* buf() const { return mem_ ? mem_ : buf_.data(); }
+        const char* line() const { return buf() + line_off_; }
+
+        sequence_reader(const sequence_reader&) = delete;
+        sequence_reader& operator=(const sequence_reader&) = delete;
 
     public:
-        sequence_reader(std::istream&, mode_t = detect);
+        // read from stream is, which must stay valid while reading
+        sequence_reader(std::istream& is, mode_t = detect, std::size_t block_size = BLOCK_SIZE);
+
+        // read the len bytes at data, which must stay valid while reading
+        sequence_reader(const char *data, std::size_t len, mode_t = detect);
+
+        // read file fname, mapping it into memory when it is a regular,
+        // uncompressed file, else reading it as a stream
+        sequence_reader(const std::string& fname, mode_t = detect, std::size_t block_size = BLOCK_SIZE);
+
+        ~sequence_reader();
+
         bool next(sequence&);
+        bool next(sequence_span&);
+
+        // from now on, return long sequences in chunks of chunk_size that
+        // overlap by overlap chars, see above; must be called before next()
+        void set_chunking(std::size_t overlap, std::size_t chunk_size = CHUNK_SIZE);
+
+        // set pos to how far the input has been read, and len to its total
+        // size, or return false if the input does not tell; for compressed
+        // input, both count compressed bytes
+        bool input_progress(std::size_t& pos, std::size_t& len) const;
 
     protected:
-        bool next_line();
-        void read_bare(sequence&);
-        void read_fasta(sequence&);
-        void read_fastq(sequence&);
+        bool next_line(std::size_t max_len = 0);
+        void read_bare(sequence_span&);
+        void read_fasta(sequence_span&);
+        void read_fastq(sequence_span&);
 };
 
 
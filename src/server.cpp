@@ -0,0 +1,490 @@
+/* server.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "server.h"
+
+#include <condition_variable>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <streambuf>
+#include <thread>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+namespace khc {
+
+static const std::string QUERY_TAG("QUERY");
+static const std::string OK_TAG("OK");
+static const std::string ERROR_TAG("ERROR");
+
+static const int POLL_TIMEOUT_MS = 1000;
+static const int MAX_PIPELINE_THREADS = 256;
+
+
+// fd_streambuf - minimal input streambuf reading from a file descriptor
+//
+class fd_streambuf : public std::streambuf
+{
+    private:
+        int fd_;
+        char buf_[1<<16];
+
+    protected:
+        virtual int_type underflow() {
+            ssize_t n;
+            while ((n = ::read(fd_, buf_, sizeof(buf_))) < 0 && errno == EINTR)
+                ;
+            if (n <= 0)
+                return traits_type::eof();
+            setg(buf_, buf_, buf_ + n);
+            return traits_type::to_int_type(*gptr());
+        }
+
+    public:
+        fd_streambuf(int fd) : fd_(fd) { }
+};
+
+
+// write_all - write all of [data,data+len) to fd, false if that failed
+//
+static bool
+write_all(int fd, const char *data, std::size_t len)
+{
+    while (len)
+    {
+        ssize_t n = ::send(fd, data, len, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        data += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+
+// make_address - fill sockaddr_un for path, or raise an error
+//
+static void
+make_address(const std::string& path, sockaddr_un& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (path.length() >= sizeof(addr.sun_path))
+        raise_error("socket path too long: %s", path.c_str());
+
+    std::strcpy(addr.sun_path, path.c_str());
+}
+
+
+// format_request - the request line for a query on path with opts
+//
+static std::string
+format_request(const query_options& opts, const std::string& path)
+{
+    std::ostringstream os;
+
+    os << std::setprecision(17) << QUERY_TAG <<
+        " cov=" << opts.min_cov_pct <<
+        " skip=" << opts.skip_degens <<
+        " dedup=" << opts.dedup_kmers <<
+        " converge=" << opts.converge_batches <<
+        " depth=" << opts.min_depth <<
+        " qual=" << opts.min_qual <<
+        " solid=" << opts.min_kmer_count <<
+        " prescreen=" << opts.prescreen <<
+        " pipeline=" << opts.pipeline <<
+        '\t' << path << '\n';
+
+    return os.str();
+}
+
+
+// bounded - return value v of option word, or raise an error if it is not
+//           within the bounds of the khc option, where 0 turns an option off
+//
+static double
+bounded(const std::string& word, double v, double lo, double hi, bool integral = true)
+{
+    if (!(v >= lo && v <= hi) || (integral && v != static_cast<int>(v)))
+        raise_error("invalid request: bad option: %s", word.c_str());
+
+    return v;
+}
+
+
+// parse_request - parse request line into opts and path, or raise an error
+//
+static void
+parse_request(const std::string& line, query_options& opts, std::string& path)
+{
+    std::string::size_type tab = line.find('\t');
+
+    if (tab == std::string::npos || tab + 1 == line.length())
+        raise_error("invalid request: no path");
+
+    path = line.substr(tab + 1);
+
+    std::istringstream is(line.substr(0, tab));
+    std::string word;
+
+    if (!(is >> word) || word != QUERY_TAG)
+        raise_error("invalid request: expected %s", QUERY_TAG.c_str());
+
+    while (is >> word)
+    {
+        std::string::size_type eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        const char *val = eq == std::string::npos ? "" : word.c_str() + eq + 1;
+        char *end;
+
+        double v = std::strtod(val, &end);
+
+        if (!*val || *end)
+            raise_error("invalid request: bad option: %s", word.c_str());
+
+        if (key == "cov")
+            opts.min_cov_pct = bounded(word, v, 0, 100, false);
+        else if (key == "skip")
+            opts.skip_degens = bounded(word, v, 0, 1) != 0;
+        else if (key == "dedup")
+            opts.dedup_kmers = bounded(word, v, 0, 1) != 0;
+        else if (key == "converge")
+            opts.converge_batches = bounded(word, v, 0, INT_MAX);
+        else if (key == "depth")
+            opts.min_depth = bounded(word, v, 0, 65535);
+        else if (key == "qual")
+            opts.min_qual = bounded(word, v, 0, 93);
+        else if (key == "solid")
+            opts.min_kmer_count = bounded(word, v, 1, 255);
+        else if (key == "prescreen")
+            opts.prescreen = bounded(word, v, 0, INT_MAX);
+        else if (key == "pipeline")
+            opts.pipeline = bounded(word, v, 0, MAX_PIPELINE_THREADS);
+        else
+            raise_error("invalid request: unknown option: %s", key.c_str());
+    }
+
+    if (opts.converge_batches && opts.dedup_kmers && opts.min_depth)
+        raise_error("invalid request: converge cannot be combined with both dedup and depth");
+}
+
+
+// The run loop stops when SIGINT or SIGTERM is received.  These are blocked in
+// the client threads, so they are delivered to the thread running the loop,
+// which polls with a timeout so as to notice the signal even if it arrives
+// just before it starts waiting.
+
+static volatile std::sig_atomic_t stop_signal = 0;
+
+extern "C" void
+on_stop_signal(int sig)
+{
+    stop_signal = sig;
+}
+
+
+query_server::query_server(const template_db& db, const std::string& socket_path, int max_clients)
+    : db_(db), path_(socket_path), max_clients_(max_clients), fd_(-1)
+{
+    sockaddr_un addr;
+    make_address(path_, addr);
+
+    if ((fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        raise_error("failed to create socket: %s", std::strerror(errno));
+
+    // a socket file that no server answers on was left by one that died, so
+    // remove it and bind again
+
+    int ret = ::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+
+    if (ret < 0 && errno == EADDRINUSE && !server_listening(path_))
+    {
+        verbose_emit("removing stale socket: %s", path_.c_str());
+        ::unlink(path_.c_str());
+        ret = ::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    }
+
+    if (ret < 0)
+    {
+        int err = errno;
+        ::close(fd_);
+        fd_ = -1;
+
+        if (err == EADDRINUSE)
+            raise_error("a server is already listening on socket %s", path_.c_str());
+
+        raise_error("failed to bind socket %s: %s", path_.c_str(), std::strerror(err));
+    }
+
+    if (::listen(fd_, SOMAXCONN) < 0)
+        raise_error("failed to listen on socket %s: %s", path_.c_str(), std::strerror(errno));
+}
+
+
+query_server::~query_server()
+{
+    if (fd_ != -1)
+    {
+        ::close(fd_);
+        ::unlink(path_.c_str());
+    }
+}
+
+
+void
+query_server::run()
+{
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_stop_signal;   // note: no SA_RESTART, so poll() is interrupted
+    ::sigaction(SIGINT, &sa, 0);
+    ::sigaction(SIGTERM, &sa, 0);
+
+    sigset_t stop_set;
+    sigemptyset(&stop_set);
+    sigaddset(&stop_set, SIGINT);
+    sigaddset(&stop_set, SIGTERM);
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    int n_active = 0;
+
+    verbose_emit("serving queries on socket: %s", path_.c_str());
+
+    while (!stop_signal)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]() { return n_active < max_clients_; });
+        }
+
+        pollfd pfd = { fd_, POLLIN, 0 };
+
+        if (::poll(&pfd, 1, POLL_TIMEOUT_MS) <= 0)
+            continue;
+
+        int fd = ::accept(fd_, 0, 0);
+
+        if (fd < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+                raise_error("failed to accept connection: %s", std::strerror(errno));
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++n_active;
+        }
+
+        pthread_sigmask(SIG_BLOCK, &stop_set, 0);
+
+        std::thread([&, fd]() {
+            serve(fd);
+            std::lock_guard<std::mutex> lock(mutex);
+            --n_active;
+            cond.notify_all();
+        }).detach();
+
+        pthread_sigmask(SIG_UNBLOCK, &stop_set, 0);
+    }
+
+    verbose_emit("received signal %d, waiting for %d clients", static_cast<int>(stop_signal), n_active);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [&]() { return n_active == 0; });
+}
+
+
+void
+query_server::serve(int fd) const
+{
+    fd_streambuf buf(fd);
+    std::istream is(&buf);
+    std::ostringstream os;
+
+    std::string line, path;
+    query_options opts;
+
+    try
+    {
+        // a connection closed without a request is a probe, see server_listening
+
+        if (!std::getline(is, line))
+        {
+            ::close(fd);
+            return;
+        }
+
+        parse_request(line, opts, path);
+
+        verbose_emit("query: %s", path.c_str());
+
+        query_result res = path == "-" ? db_.query(is, opts) : db_.query(path, opts);
+
+        os << OK_TAG << '\n' << std::setprecision(17);
+
+        for (const seq_hits& h : res)
+            os << h.seqid << ' ' << h.len << ' ' << h.hits << ' ' << h.phit << ' ' << h.depth << '\n';
+    }
+    catch (const std::exception& e)
+    {
+        verbose_emit("query failed: %s", e.what());
+
+        os.str("");
+        os << ERROR_TAG << ' ' << e.what() << '\n';
+    }
+
+    os << '\n';
+
+    std::string resp = os.str();
+    write_all(fd, resp.data(), resp.length());
+
+    // drain what the client may still be sending (when the query stopped
+    // early), so that closing does not reset the connection on the client
+
+    ::shutdown(fd, SHUT_WR);
+    is.ignore(std::numeric_limits<std::streamsize>::max());
+    ::close(fd);
+}
+
+
+bool
+server_listening(const std::string& socket_path)
+{
+    sockaddr_un addr;
+    make_address(socket_path, addr);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        raise_error("failed to create socket: %s", std::strerror(errno));
+
+    bool ok = ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+    ::close(fd);
+
+    return ok;
+}
+
+
+query_result
+remote_query(const std::string& socket_path, const std::string& fname, const query_options& opts)
+{
+    std::string path = fname.empty() ? "-" : fname;
+
+    if (path != "-")
+    {
+        char *abs_path = ::realpath(path.c_str(), 0);
+
+        if (!abs_path)
+            raise_error("cannot resolve path of query file: %s", path.c_str());
+
+        path = abs_path;
+        std::free(abs_path);
+    }
+
+    sockaddr_un addr;
+    make_address(socket_path, addr);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd < 0)
+        raise_error("failed to create socket: %s", std::strerror(errno));
+
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        raise_error("failed to connect to server on %s: %s", socket_path.c_str(), std::strerror(err));
+    }
+
+    std::string req = format_request(opts, path);
+    bool sent = write_all(fd, req.data(), req.length());
+
+    // stream stdin; when the server stops reading early, a write fails, and
+    // we go on to read its response
+
+    if (sent && path == "-")
+    {
+        char data[1<<16];
+        ssize_t n;
+
+        while ((n = ::read(0, data, sizeof(data))) != 0)
+            if (n < 0 ? errno != EINTR : !write_all(fd, data, n))
+                break;
+    }
+
+    ::shutdown(fd, SHUT_WR);
+
+    fd_streambuf buf(fd);
+    std::istream is(&buf);
+    std::string line;
+
+    if (!std::getline(is, line))
+    {
+        ::close(fd);
+        raise_error("no response from server on %s", socket_path.c_str());
+    }
+
+    query_result res;
+
+    if (line == OK_TAG)
+    {
+        while (std::getline(is, line) && !line.empty())
+        {
+            std::istringstream ls(line);
+            seq_hits h;
+
+            if (!(ls >> h.seqid >> h.len >> h.hits >> h.phit >> h.depth))
+                break;
+
+            res.push_back(h);
+        }
+    }
+
+    ::close(fd);
+
+    if (line.compare(0, ERROR_TAG.length(), ERROR_TAG) == 0)
+        raise_error("%s", line.length() > ERROR_TAG.length() ? line.c_str() + ERROR_TAG.length() + 1 : "server error");
+    else if (!line.empty())
+        raise_error("invalid response from server: %s", line.c_str());
+
+    return res;
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,83 @@
+/* server.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef server_h_INCLUDED
+#define server_h_INCLUDED
+
+#include <string>
+#include "templatedb.h"
+
+namespace khc {
+
+// This header defines the query server, which keeps a template_db resident
+// in memory and answers queries over a Unix domain socket, and the function
+// for clients to send it a query.
+
+// The protocol is line based.  Each connection carries one query.  The client
+// sends a request line
+//
+//      QUERY [KEY=VALUE ...]<tab>PATH
+//
+// where the KEY=VALUE pairs set the query_options (see format_request), and
+// PATH is either a file that the server can read, or '-', in which case the
+// query data follows the request line up to the end of the stream.  The server
+// responds with either a line 'OK' followed by one line per seq_hits, or with
+// a line 'ERROR MESSAGE'.  In both cases the response ends with an empty line.
+
+
+// query_server - answers queries against db on a Unix domain socket
+//
+// Constructor binds to socket_path, on which no server must be listening; a
+// socket file left there by a server that died is replaced.  Method run()
+// serves up to max_clients concurrent connections, until the process receives
+// SIGINT or SIGTERM.  The destructor closes and removes the socket.
+//
+class query_server
+{
+    private:
+        const template_db& db_;
+        std::string path_;
+        int max_clients_;
+        int fd_;
+
+        void serve(int fd) const;
+
+    public:
+        query_server(const template_db& db, const std::string& socket_path, int max_clients);
+        ~query_server();
+
+        void run();
+};
+
+
+// server_listening - whether a server answers on socket_path
+//
+bool server_listening(const std::string& socket_path);
+
+
+// remote_query - run a query on the server listening on socket_path
+//
+// Sends the absolute path of fname to the server, or when fname is "-" or
+// empty, streams the data from stdin.  Returns the result or raises an error.
+//
+query_result remote_query(const std::string& socket_path, const std::string& fname, const query_options&);
+
+
+} // namespace khc
+
+#endif // server_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,586 @@
+/* shareddb.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kmerdb.h"
+#include "utils.h"
+
+namespace khc {
+
+static std::string STR_MAGIC = "~kmerdb~";
+static std::string STR_VERSION = "v1";
+static std::string STR_KSIZE_LABEL = "ksize";
+
+static const char SHM_MAGIC[8] = "~khcshm";
+static const std::uint32_t SHM_VERSION = 1;
+
+// sections start on cache line boundaries, the segment size is a multiple
+// of the (2MB) huge page size, as hugetlbfs requires
+
+static const std::size_t SECTION_ALIGN = 64;
+static const std::size_t SEGMENT_ALIGN = 2 << 20;
+
+// the interval at which attach polls a segment that is being published
+
+static const useconds_t POLL_USECS = 100000;
+
+
+// The segment header.  Field 'ready' is set (last) when publishing is done.
+// All offsets are in bytes from the start of the segment.
+
+struct shared_kmer_db::header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t ready;
+    std::uint32_t kmer_bytes;
+    std::int32_t ksize;
+    std::int32_t max_vars;
+    std::int32_t index_bits;
+    std::uint64_t nseq;
+    std::uint64_t nkmers;
+    std::uint64_t nlocs;
+    std::uint64_t size;
+    std::uint64_t off_index;
+    std::uint64_t off_kmers;
+    std::uint64_t off_offs;
+    std::uint64_t off_klocs;
+    std::uint64_t off_lens;
+    std::uint64_t off_id_offs;
+    std::uint64_t off_strings;  // source, then the seq IDs, NUL-terminated
+};
+
+
+static std::size_t
+align(std::size_t n, std::size_t a)
+{
+    return (n + a - 1) / a * a;
+}
+
+// open_segment - shm_open name, or open it as a file if it has a '/'
+//
+static int
+open_segment(const std::string& name, int flags, mode_t mode = 0)
+{
+    if (name.find('/') == std::string::npos)
+        return ::shm_open(("/" + name).c_str(), flags, mode);
+    else
+        return ::open(name.c_str(), flags, mode);
+}
+
+
+shared_kmer_db::shared_kmer_db(int ksize)
+    : base_(0), size_(0), owner_(false), hdr_(0), index_(0), kmers_(0), offs_(0), klocs_(0),
+      lens_(0), ids_(0), ksize_(ksize), shift_(0), nkmers_(0)
+{
+}
+
+shared_kmer_db::shared_kmer_db(shared_kmer_db&& o)
+    : name_(o.name_), base_(o.base_), size_(o.size_), owner_(o.owner_), hdr_(o.hdr_), index_(o.index_),
+      kmers_(o.kmers_), offs_(o.offs_), klocs_(o.klocs_), lens_(o.lens_), ids_(o.ids_),
+      ksize_(o.ksize_), shift_(o.shift_), nkmers_(o.nkmers_)
+{
+    o.base_ = 0;
+    o.owner_ = false;
+}
+
+shared_kmer_db::~shared_kmer_db()
+{
+    if (owner_)
+        ::munmap(base_, size_);
+}
+
+
+void
+shared_kmer_db::set_pointers()
+{
+    char *base = static_cast<char*>(base_);
+
+    hdr_ = reinterpret_cast<const header*>(base);
+    index_ = reinterpret_cast<std::uint64_t*>(base + hdr_->off_index);
+    kmers_ = reinterpret_cast<kmer_t*>(base + hdr_->off_kmers);
+    offs_ = reinterpret_cast<std::uint64_t*>(base + hdr_->off_offs);
+    klocs_ = reinterpret_cast<kloc_t*>(base + hdr_->off_klocs);
+    lens_ = reinterpret_cast<kcnt_t*>(base + hdr_->off_lens);
+    ids_ = base + hdr_->off_strings;
+
+    ksize_ = hdr_->ksize;
+    shift_ = 2*ksize_ - 1 - hdr_->index_bits;
+}
+
+bool
+shared_kmer_db::is_valid(const header *hdr, std::size_t size)
+{
+    return size >= sizeof(header) && !std::memcmp(hdr->magic, SHM_MAGIC, sizeof(SHM_MAGIC)) &&
+        hdr->version == SHM_VERSION && hdr->kmer_bytes == sizeof(kmer_t) && hdr->size <= size;
+}
+
+
+// segment_state - the state of a segment: absent, being published (incomplete),
+//                 left incomplete for over timeout seconds (stale), or ready
+//
+enum class segment_state { absent, incomplete, stale, ready };
+
+static segment_state
+probe_segment(const std::string& name, double timeout)
+{
+    int fd = open_segment(name, O_RDONLY);
+
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return segment_state::absent;
+        raise_error("failed to open shared memory segment %s: %s", name.c_str(), std::strerror(errno));
+    }
+
+    struct stat st;
+    shared_kmer_db::header h;
+    std::memset(&h, 0, sizeof(h));
+
+    ssize_t n = ::fstat(fd, &st) < 0 ? -1 : ::pread(fd, &h, sizeof(h), 0);
+    int err = errno;
+    ::close(fd);
+
+    if (n < 0)
+        raise_error("failed to read shared memory segment %s: %s", name.c_str(), std::strerror(err));
+
+    if (n == sizeof(h) && h.ready)
+        return segment_state::ready;
+
+    // before the publisher writes the header, the segment holds zeros
+
+    static const char ZEROS[sizeof(SHM_MAGIC)] = { 0 };
+
+    if (n == sizeof(h) && std::memcmp(h.magic, SHM_MAGIC, sizeof(SHM_MAGIC)) &&
+            std::memcmp(h.magic, ZEROS, sizeof(ZEROS)))
+        raise_error("not a valid khc shared memory segment: %s", name.c_str());
+
+    // the change time is when the publisher created and sized the segment
+
+    timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    double age = (now.tv_sec - st.st_ctim.tv_sec) + (now.tv_nsec - st.st_ctim.tv_nsec) / 1e9;
+
+    return age > timeout ? segment_state::stale : segment_state::incomplete;
+}
+
+
+bool
+shared_kmer_db::attach(const std::string& name, double timeout)
+{
+    segment_state state = probe_segment(name, timeout);
+
+    if (state == segment_state::incomplete)
+    {
+        verbose_emit("waiting for shared memory segment %s to be published", name.c_str());
+
+        while ((state = probe_segment(name, timeout)) == segment_state::incomplete)
+            ::usleep(POLL_USECS);
+    }
+
+    if (state == segment_state::stale)
+        verbose_emit("shared memory segment %s is stale: its publisher did not complete it", name.c_str());
+
+    if (state != segment_state::ready)
+        return false;
+
+    int fd = open_segment(name, O_RDONLY);
+
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+            return false;
+        raise_error("failed to open shared memory segment %s: %s", name.c_str(), std::strerror(errno));
+    }
+
+    struct stat st;
+
+    if (::fstat(fd, &st) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        raise_error("failed to open shared memory segment %s: %s", name.c_str(), std::strerror(err));
+    }
+
+    void *base = ::mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (base == MAP_FAILED)
+        raise_error("failed to map shared memory segment %s: %s", name.c_str(), std::strerror(errno));
+
+    const header *hdr = static_cast<const header*>(base);
+
+    if (!is_valid(hdr, st.st_size))
+    {
+        ::munmap(base, st.st_size);
+        raise_error("not a valid khc shared memory segment: %s", name.c_str());
+    }
+
+    // a segment replaced between the probe and the open can be incomplete
+
+    if (!__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE))
+    {
+        ::munmap(base, st.st_size);
+        return false;
+    }
+
+    if (owner_)
+        ::munmap(base_, size_);
+
+    name_ = name;
+    base_ = base;
+    size_ = st.st_size;
+    owner_ = true;
+    set_pointers();
+    nkmers_ = hdr_->nkmers;
+
+    verbose_emit("attached to shared memory segment %s (%luM)", name.c_str(), static_cast<unsigned long>(size_ >> 20));
+
+    return true;
+}
+
+bool
+shared_kmer_db::view(const void *image, std::size_t size)
+{
+    const header *hdr = static_cast<const header*>(image);
+
+    if (!is_valid(hdr, size) || !__atomic_load_n(&hdr->ready, __ATOMIC_ACQUIRE))
+        return false;
+
+    if (owner_)
+        ::munmap(base_, size_);
+
+    base_ = const_cast<void*>(image);
+    size_ = size;
+    owner_ = false;
+    set_pointers();
+    nkmers_ = hdr_->nkmers;
+
+    return true;
+}
+
+
+// layout - set up header h for an image of nkmers kmers with nlocs klocs,
+//          and return the image size
+//
+std::size_t
+shared_kmer_db::layout(header& h, int ksize, std::uint64_t nkmers, std::uint64_t nlocs, int max_vars,
+        const std::vector<std::string>& ids, const std::string& source)
+{
+    int kbits = 2*ksize - 1;
+    int index_bits = 0;
+
+    while (index_bits < kbits && (static_cast<std::uint64_t>(2) << index_bits) <= nkmers / 2)
+        ++index_bits;
+
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, SHM_MAGIC, sizeof(SHM_MAGIC));
+    h.version = SHM_VERSION;
+    h.kmer_bytes = sizeof(kmer_t);
+    h.ksize = ksize;
+    h.max_vars = max_vars;
+    h.index_bits = index_bits;
+    h.nseq = ids.size();
+    h.nkmers = nkmers;
+    h.nlocs = nlocs;
+
+    std::size_t n_strings = source.length() + 1;
+    for (const std::string& id : ids)
+        n_strings += id.length() + 1;
+
+    std::size_t off = align(sizeof(header), SECTION_ALIGN);
+    h.off_index = off;
+    off = align(off + ((static_cast<std::size_t>(1) << index_bits) + 1) * sizeof(std::uint64_t), SECTION_ALIGN);
+    h.off_kmers = off;
+    off = align(off + nkmers * sizeof(kmer_t), SECTION_ALIGN);
+    h.off_offs = off;
+    off = align(off + (nkmers + 1) * sizeof(std::uint64_t), SECTION_ALIGN);
+    h.off_klocs = off;
+    off = align(off + nlocs * sizeof(kloc_t), SECTION_ALIGN);
+    h.off_lens = off;
+    off = align(off + ids.size() * sizeof(kcnt_t), SECTION_ALIGN);
+    h.off_id_offs = off;
+    off = align(off + ids.size() * sizeof(std::uint64_t), SECTION_ALIGN);
+    h.off_strings = off;
+    h.size = off + n_strings;
+
+    return h.size;
+}
+
+std::size_t
+shared_kmer_db::image_size(int ksize, std::uint64_t nkmers, std::uint64_t nlocs,
+        const std::vector<std::string>& ids, const std::string& source)
+{
+    header h;
+    return layout(h, ksize, nkmers, nlocs, 0, ids, source);
+}
+
+// create_at - start an image at image, which must have image_size bytes,
+//             to be filled by append and completed by seal; it is not owned
+//
+void
+shared_kmer_db::create_at(void *image, std::uint64_t nkmers, std::uint64_t nlocs, int max_vars,
+        const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens, const std::string& source)
+{
+    header h;
+    layout(h, ksize_, nkmers, nlocs, max_vars, ids, source);
+
+    if (owner_)
+        ::munmap(base_, size_);
+
+    base_ = image;
+    size_ = h.size;
+    owner_ = false;
+
+    std::memcpy(base_, &h, sizeof(h));
+    set_pointers();
+
+    char *strings = static_cast<char*>(base_) + h.off_strings;
+    std::uint64_t *id_offs = reinterpret_cast<std::uint64_t*>(static_cast<char*>(base_) + h.off_id_offs);
+
+    std::memcpy(strings, source.c_str(), source.length() + 1);
+    std::size_t off = source.length() + 1;
+
+    for (std::size_t i = 0; i != ids.size(); ++i)
+    {
+        lens_[i] = lens[i];
+        id_offs[i] = off;
+        std::memcpy(strings + off, ids[i].c_str(), ids[i].length() + 1);
+        off += ids[i].length() + 1;
+    }
+
+    nkmers_ = 0;
+    offs_[0] = 0;
+}
+
+bool
+shared_kmer_db::create(const std::string& name, std::uint64_t nkmers, std::uint64_t nlocs, int max_vars,
+        const std::vector<std::string>& ids, const std::vector<kcnt_t>& lens, const std::string& source,
+        double timeout)
+{
+    std::size_t size = align(image_size(ksize_, nkmers, nlocs, ids, source), SEGMENT_ALIGN);
+
+    int fd = open_segment(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+
+    // replace a segment left incomplete by a publisher that died
+
+    if (fd < 0 && errno == EEXIST)
+    {
+        segment_state state = probe_segment(name, timeout);
+
+        if (state == segment_state::ready || state == segment_state::incomplete)
+            return false;
+
+        if (state == segment_state::stale)
+        {
+            verbose_emit("replacing stale shared memory segment %s", name.c_str());
+            remove(name);
+        }
+
+        fd = open_segment(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+    }
+
+    if (fd < 0)
+    {
+        if (errno == EEXIST)
+            return false;
+        raise_error("failed to create shared memory segment %s: %s", name.c_str(), std::strerror(errno));
+    }
+
+    if (::ftruncate(fd, size) < 0)
+    {
+        int err = errno;
+        ::close(fd);
+        remove(name);
+        raise_error("failed to size shared memory segment %s to %luM: %s",
+                name.c_str(), static_cast<unsigned long>(size >> 20), std::strerror(err));
+    }
+
+    void *base = ::mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (base == MAP_FAILED)
+    {
+        int err = errno;
+        remove(name);
+        raise_error("failed to map shared memory segment %s: %s", name.c_str(), std::strerror(err));
+    }
+
+#ifdef MADV_HUGEPAGE
+    ::madvise(base, size, MADV_HUGEPAGE);   // a hint, may not be supported
+#endif
+
+    verbose_emit("publishing database in shared memory segment %s (%luM)",
+            name.c_str(), static_cast<unsigned long>(size >> 20));
+
+    create_at(base, nkmers, nlocs, max_vars, ids, lens, source);
+
+    name_ = name;
+    size_ = size;
+    owner_ = true;
+
+    return true;
+}
+
+void
+shared_kmer_db::append(kmer_t kmer, kloc_range locs)
+{
+    kmers_[nkmers_] = kmer;
+    std::copy(locs.begin(), locs.end(), klocs_ + offs_[nkmers_]);
+    offs_[nkmers_ + 1] = offs_[nkmers_] + locs.size();
+    ++nkmers_;
+}
+
+void
+shared_kmer_db::seal()
+{
+    if (nkmers_ != hdr_->nkmers || offs_[nkmers_] != hdr_->nlocs)
+        raise_error("inconsistent kmer count while writing %s", name_.c_str());
+
+    // bucket b holds the kmers whose high bits equal b: index_[b] is the
+    // position of the first, index_[b+1] one past the last
+
+    std::uint64_t nbuckets = static_cast<std::uint64_t>(1) << hdr_->index_bits;
+    std::uint64_t i = 0;
+
+    for (std::uint64_t b = 0; b <= nbuckets; ++b)
+    {
+        while (i != nkmers_ && (kmers_[i] >> shift_) < b)
+            ++i;
+        index_[b] = i;
+    }
+
+    header *h = static_cast<header*>(base_);
+    __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+}
+
+
+bool
+shared_kmer_db::remove(const std::string& name)
+{
+    int ret = name.find('/') == std::string::npos
+        ? ::shm_unlink(("/" + name).c_str())
+        : ::unlink(name.c_str());
+
+    if (ret < 0 && errno != ENOENT)
+        raise_error("failed to remove shared memory segment %s: %s", name.c_str(), std::strerror(errno));
+
+    return ret == 0;
+}
+
+
+int
+shared_kmer_db::max_vars() const
+{
+    return hdr_->max_vars;
+}
+
+std::uint32_t
+shared_kmer_db::nseq() const
+{
+    return hdr_->nseq;
+}
+
+const char*
+shared_kmer_db::seq_id(std::uint32_t i) const
+{
+    const std::uint64_t *id_offs = reinterpret_cast<const std::uint64_t*>(static_cast<const char*>(base_) + hdr_->off_id_offs);
+    return ids_ + id_offs[i];
+}
+
+std::string
+shared_kmer_db::source() const
+{
+    return std::string(ids_);
+}
+
+
+void
+shared_kmer_db::add_kloc(kmer_t, kloc_t)
+{
+    raise_error("cannot add to shared kmer db: it is read-only");
+}
+
+kloc_range
+shared_kmer_db::get_klocs(kmer_t kmer) const
+{
+    std::uint64_t b = kmer >> shift_;
+
+    const kmer_t *lo = kmers_ + index_[b];
+    const kmer_t *hi = kmers_ + index_[b+1];
+    const kmer_t *p = std::lower_bound(lo, hi, kmer);
+
+    if (p == hi || *p != kmer)
+        return kloc_range(klocs_, klocs_);
+
+    std::uint64_t i = p - kmers_;
+
+    return kloc_range(klocs_ + offs_[i], klocs_ + offs_[i+1]);
+}
+
+std::istream&
+shared_kmer_db::read(std::istream& is)
+{
+    raise_error("cannot read shared kmer db from file: attach to a segment instead");
+    return is;
+}
+
+// write - writes in the same format as vector_kmer_db and map_kmer_db, with
+//         kmer i pointing at vector i+1, and vector 0 the empty vector
+
+std::ostream&
+shared_kmer_db::write(std::ostream& os) const
+{
+    static char W = ' ';
+    os << STR_MAGIC << W << STR_VERSION << W << STR_KSIZE_LABEL << W << ksize_ << std::endl;
+    os << nkmers_ + 1 << std::endl;
+    os << 0 << W << std::endl;
+
+    for (std::uint64_t i = 0; i != nkmers_; ++i)
+    {
+        os << offs_[i+1] - offs_[i] << W;
+        os.write(reinterpret_cast<const char*>(klocs_ + offs_[i]), (offs_[i+1] - offs_[i]) * sizeof(kloc_t));
+        os << std::endl;
+    }
+
+    char buf[sizeof(kmer_t) + sizeof(kcnt_t)];
+    kmer_t* pkmer = reinterpret_cast<kmer_t*>(buf);
+    kcnt_t* pkcnt = reinterpret_cast<kcnt_t*>(buf + sizeof(kmer_t));
+
+    for (std::uint64_t i = 0; i != nkmers_; ++i)
+    {
+        *pkmer = kmers_[i];
+        *pkcnt = static_cast<kcnt_t>(i + 1);
+        os.write(buf, sizeof(buf));
+    }
+
+    return os;
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
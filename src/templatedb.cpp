@@ -18,18 +18,41 @@
 
 #include "templatedb.h"
 
+#include <algorithm>
 #include <fstream>
+#include <map>
 
+#include "kmercount.h"
 #include "kmerise.h"
+#include "pipeline.h"
+#include "trace.h"
 #include "utils.h"
 
 namespace khc {
 
 static const std::string MAGIC("~khc~");
+static const std::string VERSION("v2");
 static const std::string NSEQ_LABEL("nseq");
 static const std::string NBASES_LABEL("nbases");
 static const std::string KSIZE_LABEL("ksize");
 static const std::string MAXVARS_LABEL("maxvars");
+static const std::string SKETCH_LABEL("sketch");
+
+// number of query kmers between checks for convergence of the result
+static const std::uint64_t CONVERGE_BATCH_KMERS = 1 << 20;
+
+// number of query kmers the prescreen reads to pick the candidate schemes,
+// the fraction of the top scheme's hits a candidate must have, and the bits
+// of kmer hash that must be zero for a kmer to be in the sketch (1 in 16)
+static const std::uint64_t PRESCREEN_KMERS = 1 << 21;
+static const double PRESCREEN_MIN_FRACTION = 0.1;
+static const int SKETCH_SAMPLE_BITS = 4;
+
+static inline bool
+in_sketch_sample(kmer_t kmer)
+{
+    return (static_cast<std::uint64_t>(kmer) * 0x9E3779B97F4A7C15ULL) >> (64 - SKETCH_SAMPLE_BITS) == 0;
+}
 
 
 std::unique_ptr<template_db>
@@ -47,6 +70,19 @@ template_db::create_db(int ksize, int max_vars, int max_gb)
                 " either reduce kmer size, or recompile with a larger kmer_t",
                 ksize, max_ksize, kbits, max_kbits);
 
+    if (use_vector_db(ksize, max_gb))
+        ret = new template_db_impl<vector_kmer_db>(ksize, max_vars);
+    else
+        ret = new template_db_impl<map_kmer_db>(ksize, max_vars);
+ 
+    return std::unique_ptr<template_db>(ret);
+}
+
+bool
+template_db::use_vector_db(int ksize, int max_gb)
+{
+    int kbits = 2*ksize - 1;
+
         // Note std::vector<kcnt_t> is the element type of the large k-mer lookup vector.
         // It has 24-byte size, so at k-size 15 we are dealing with 24 * 2^29 = 12GB.
         // We could reduce memory consumption by introducing an indirection.
@@ -74,7 +110,7 @@ template_db::create_db(int ksize, int max_vars, int max_gb)
                 static_cast<unsigned long>(vec_mb >> 10),
                 static_cast<unsigned long>(max_mb >> 10));
 
-        ret = new template_db_impl<map_kmer_db>(ksize, max_vars);
+        return false;
     }
     else
     {
@@ -82,10 +118,40 @@ template_db::create_db(int ksize, int max_vars, int max_gb)
                 static_cast<unsigned long>(vec_mb >> 10),
                 static_cast<unsigned long>(max_mb >> 10));
 
-        ret = new template_db_impl<vector_kmer_db>(ksize, max_vars);
+        return true;
     }
- 
-    return std::unique_ptr<template_db>(ret);
+}
+
+// read_header - read the header line of a binary template file, and return
+//               whether a sketch section follows its sequences; files that
+//               have one carry VERSION after MAGIC, which khc versions that
+//               do not know the section reject as an invalid header
+
+static bool
+read_header(std::istream& is, nseq_t& nseq, kloc_t& nbases, int& ksize, int& max_vars)
+{
+    std::string magic, label, nbases_label, ksize_label, maxvars_label, dummy;
+    bool sketched = false;
+
+    is >> magic >> label;
+
+    if (magic == MAGIC && !label.empty() && label[0] == 'v')
+    {
+        if (label != VERSION)
+            raise_error("unsupported binary template file format: version %s", label.c_str());
+
+        sketched = true;
+        is >> label;
+    }
+
+    is >> nseq >> nbases_label >> nbases >> ksize_label >> ksize >> maxvars_label >> max_vars;
+    getline(is, dummy); // consume newline
+
+    if (!is || magic != MAGIC || label != NSEQ_LABEL || nbases_label != NBASES_LABEL || ksize_label != KSIZE_LABEL || maxvars_label != MAXVARS_LABEL)
+        raise_error("not a valid binary template file: expected header '%s [%s] %s [0-9]+ %s [0-9]+ %s [0-9]+ %s [0-9]+'",
+                MAGIC.c_str(), VERSION.c_str(), NSEQ_LABEL.c_str(), NBASES_LABEL.c_str(), KSIZE_LABEL.c_str(), MAXVARS_LABEL.c_str());
+
+    return sketched;
 }
 
 std::unique_ptr<template_db>
@@ -97,18 +163,12 @@ template_db::read(std::istream& is, int max_gb, int ksize, int max_vars)
     {
         verbose_emit("reading binary template database");
 
-        std::string magic, nseq_label, nbases_label, ksize_label, maxvars_label, dummy;
         nseq_t nseq;
         kloc_t nbases;
         int db_ksize;
         int db_max_vars;
 
-        is >> magic >> nseq_label >> nseq >> nbases_label >> nbases >> ksize_label >> db_ksize >> maxvars_label >> db_max_vars;
-        getline(is, dummy); // consume newline
-
-        if (magic != MAGIC || nseq_label != NSEQ_LABEL || nbases_label != NBASES_LABEL || ksize_label != KSIZE_LABEL || maxvars_label != MAXVARS_LABEL)
-            raise_error("not a valid binary template file: expected header '%s %s [0-9]+ %s [0-9]+ %s [0-9]+ %s [0-9]+'",
-                    MAGIC.c_str(), NSEQ_LABEL.c_str(), NBASES_LABEL.c_str(), KSIZE_LABEL.c_str(), MAXVARS_LABEL.c_str());
+        bool stored = read_header(is, nseq, nbases, db_ksize, db_max_vars);
 
         if (ksize != 0 && ksize != db_ksize)
             raise_error("specified ksize %d mismatches binary template file ksize: %d",
@@ -119,7 +179,24 @@ template_db::read(std::istream& is, int max_gb, int ksize, int max_vars)
                     max_vars, db_max_vars);
 
         ret = create_db(db_ksize, db_max_vars, max_gb);
-        ret->read_binary(is, nseq);
+        ret->read_seqs(is, nseq);
+
+        // files without a sketch have fewer than two schemes, or were
+        // written before it was stored, and have it built below
+
+        if (stored)
+            std::call_once(ret->sketch_set_, [&]() { ret->read_sketch(is); });
+
+        if (nseq != 0)
+            ret->read_kmer_db(is);
+
+        ret->set_offsets();
+        ret->set_loci();
+        ret->set_schemes();
+
+        for (const auto& e : ret->sketch())
+            if (e.second >= ret->scheme_ids_.size())
+                raise_error("invalid scheme in sketch section of binary template file");
     }
     else
     {
@@ -133,121 +210,556 @@ template_db::read(std::istream& is, int max_gb, int ksize, int max_vars)
 
         ret = create_db(ksize, max_vars, max_gb);
         ret->read_fasta(is);
+        ret->set_offsets();
+        ret->set_loci();
+        ret->set_schemes();
+        ret->sketch();
     }
 
     return ret;
 }
 
+std::unique_ptr<template_db>
+template_db::attach(const std::string& shm_name, const std::string& source)
+{
+    std::unique_ptr<template_db> ret;
+
+    shared_kmer_db kmer_db(0);
 
-std::ostream&
-template_db::write(std::ostream& os) const
+    if (!kmer_db.attach(shm_name))
+        return ret;
+
+    if (!source.empty() && kmer_db.source() != source)
+        raise_error("shared memory segment %s was published from a different database: %s",
+                shm_name.c_str(), kmer_db.source().c_str());
+
+    std::vector<std::string> ids;
+    std::vector<kcnt_t> lens;
+
+    ids.reserve(kmer_db.nseq());
+    lens.reserve(kmer_db.nseq());
+
+    for (std::uint32_t i = 0; i != kmer_db.nseq(); ++i)
+    {
+        ids.push_back(kmer_db.seq_id(i));
+        lens.push_back(kmer_db.seq_len(i));
+    }
+
+    int max_vars = kmer_db.max_vars();
+
+    ret.reset(new template_db_impl<shared_kmer_db>(std::move(kmer_db), max_vars));
+    ret->seq_ids_.swap(ids);
+    ret->seq_lens_.swap(lens);
+    ret->set_offsets();
+    ret->set_loci();
+    ret->set_schemes();
+
+    return ret;
+}
+
+std::unique_ptr<template_db>
+template_db::open(const std::string& fname, int max_gb, int ksize, int max_vars)
 {
-    static const char W = ' ';
+    partitioned_kmer_db parts(0);
 
-    kloc_t nbases = 0;
-    for (auto n : seq_lens_)
-        nbases += n;
+    if (!parts.open(fname))
+    {
+        std::ifstream is(fname, std::ios_base::in|std::ios_base::binary);
 
-    os << MAGIC << W << 
-        NSEQ_LABEL << W << seq_ids_.size() << W << 
-        NBASES_LABEL << W << nbases << W << 
-        KSIZE_LABEL << W << ksize() << W <<
-        MAXVARS_LABEL << W << max_vars() << std::endl;
+        if (!is)
+            raise_error("failed to open template file: %s", fname.c_str());
 
-    for (nseq_t i = 0; i != seq_ids_.size(); ++i)
-        os << seq_ids_[i] << W << seq_lens_[i] /* << seq_hdrs_[i] */ << std::endl;
+        return read(is, max_gb, ksize, max_vars);
+    }
 
-    write_kmer_db(os);
+    if (ksize != 0 && ksize != parts.ksize())
+        raise_error("specified ksize %d mismatches partitioned template file ksize: %d",
+                ksize, parts.ksize());
 
-    return os;
+    if (max_vars != 0 && max_vars != parts.max_vars())
+        raise_error("specified max variants %d mismatches value in partitioned template file: %d",
+                max_vars, parts.max_vars());
+
+    std::vector<std::string> ids(parts.seq_ids());
+    std::vector<kcnt_t> lens(parts.seq_lens());
+    std::vector<std::string> names;
+
+    for (std::size_t i = 0; i != parts.nparts(); ++i)
+        names.push_back(parts.part_name(i));
+
+    int db_max_vars = parts.max_vars();
+
+    std::unique_ptr<template_db> ret(new template_db_impl<partitioned_kmer_db>(std::move(parts), db_max_vars));
+    ret->seq_ids_.swap(ids);
+    ret->seq_lens_.swap(lens);
+    ret->set_offsets();
+    ret->set_loci();
+    ret->set_schemes();
+
+    if (ret->scheme_ids_ != names)
+        raise_error("partitions in %s do not match the schemes of its sequences", fname.c_str());
+
+    ret->sketch();
+
+    return ret;
 }
 
+// peek - reads the headers that open() would read, then sizes the sequences
+//        on a db without kmers; the kmer locations of a binary db are taken
+//        to be its kmer positions, which undercounts degenerate sequences
 
 bool
-template_db::write(const std::string& filename) const
+template_db::peek(const std::string& fname, db_stats& st, int max_gb, int ksize, int max_vars)
 {
-    std::ofstream os(filename.c_str(), std::ios_base::out|std::ios_base::binary);
+    st = db_stats();
 
-    if (!os)
-        return false;
+    std::vector<std::string> ids;
+    std::vector<kcnt_t> lens;
 
-    write(os);
+    partitioned_kmer_db parts(0);
 
-    return (bool)os;
+    if (parts.open(fname))
+    {
+        st.backend_name = "partitioned";
+        st.ksize = parts.ksize();
+        st.max_vars = parts.max_vars();
+        st.n_sketch = parts.sketch().size();
+
+        for (std::size_t p = 0; p != parts.nparts(); ++p)
+            st.part_bytes.push_back(parts.part_size(p));
+
+        ids = parts.seq_ids();
+        lens = parts.seq_lens();
+    }
+    else
+    {
+        std::ifstream is(fname, std::ios_base::in|std::ios_base::binary);
+
+        if (!is)
+            raise_error("failed to open template file: %s", fname.c_str());
+
+        if (is.peek() != '~')
+        {
+            if (ksize == 0)
+                raise_error("ksize must be specified");
+
+            st.backend_name = use_vector_db(ksize, max_gb) ? "vector" : "map";
+            st.ksize = ksize;
+            st.max_vars = max_vars;
+
+            return false;
+        }
+
+        nseq_t nseq;
+        kloc_t nbases;
+
+        bool sketched = read_header(is, nseq, nbases, st.ksize, st.max_vars);
+
+        std::string seq_id, dummy;
+        npos_t seq_len = 0;
+
+        while (nseq-- && is)
+        {
+            is >> seq_id >> seq_len;
+            getline(is, dummy);
+
+            ids.push_back(seq_id);
+            lens.push_back(seq_len);
+        }
+
+        if (sketched)
+        {
+            std::string sketch_label;
+            is >> sketch_label >> st.n_sketch;
+            is.ignore(1 + 2 * st.n_sketch * sizeof(std::uint64_t) + 1);
+        }
+
+        // the kmer db header is followed by the number of kloc vectors,
+        // which is one more than the number of kmers
+
+        std::string kmerdb_magic, version, kmerdb_ksize_label;
+        int kmerdb_ksize;
+        std::uint64_t nvecs = 0;
+
+        if (!ids.empty())
+            is >> kmerdb_magic >> version >> kmerdb_ksize_label >> kmerdb_ksize >> nvecs;
+
+        if (!is)
+            raise_error("failed to read header of binary template file: %s", fname.c_str());
+
+        st.backend_name = use_vector_db(st.ksize, max_gb) ? "vector" : "map";
+        st.n_kmers = nvecs ? nvecs - 1 : 0;
+        st.n_klocs = nbases;
+    }
+
+    template_db_impl<map_kmer_db> db(st.ksize, st.max_vars);
+    db.seq_ids_.swap(ids);
+    db.seq_lens_.swap(lens);
+    db.set_offsets();
+    db.set_loci();
+    db.set_schemes();
+
+    db.get_seq_stats(st);
+    estimate_memory(st);
+
+    return true;
 }
 
-template<typename kmer_db_t>
-query_result
-template_db_impl<kmer_db_t>::query(const std::string& filename, double min_cov_pct, bool skip_degens) const
+
+void
+template_db::set_offsets()
+{
+    seq_offs_.clear();
+    seq_offs_.reserve(seq_lens_.size() + 1);
+
+    std::size_t off = 0;
+    seq_offs_.push_back(off);
+
+    for (auto n : seq_lens_)
+        seq_offs_.push_back(off += (static_cast<std::size_t>(n) + 63) >> 6);
+}
+
+
+// The locus of a sequence is the part of its ID up to the last ':' (kcst
+// databases have IDs 'scheme:locus:allele'), or failing that, up to the last
+// '_' (as in 'adk_12').  IDs having neither are each their own locus.
+
+void
+template_db::set_loci()
+{
+    std::map<std::string,nseq_t> loci;
+
+    seq_loci_.clear();
+    seq_loci_.reserve(seq_ids_.size());
+
+    for (const std::string& id : seq_ids_)
+    {
+        std::string::size_type p = id.rfind(':');
+
+        if (p == std::string::npos)
+            p = id.rfind('_');
+
+        std::string locus = p == std::string::npos ? id : id.substr(0, p);
+
+        seq_loci_.push_back(loci.insert(std::make_pair(locus, loci.size())).first->second);
+    }
+}
+
+
+// The scheme of a sequence is the part of its ID up to the first ':' (as in
+// 'scheme:locus:allele'), or empty for IDs without ':'.  The prescreen only
+// applies when there are at least two schemes.
+
+void
+template_db::set_schemes()
 {
-    std::istream* is = &std::cin;
-    std::ifstream qry_file;
+    std::map<std::string,nseq_t> schemes;
+
+    seq_schemes_.clear();
+    seq_schemes_.reserve(seq_ids_.size());
+    scheme_ids_.clear();
 
-    if (!filename.empty() && filename != "-")
+    for (const std::string& id : seq_ids_)
     {
-        qry_file.open(filename.c_str(), std::ios_base::in|std::ios_base::binary);
+        std::string::size_type p = id.find(':');
+        std::string scheme = p == std::string::npos ? std::string() : id.substr(0, p);
+
+        auto ins = schemes.insert(std::make_pair(scheme, schemes.size()));
+
+        if (ins.second)
+            scheme_ids_.push_back(scheme);
+
+        seq_schemes_.push_back(ins.first->second);
+    }
+}
+
+const template_db::scheme_sketch&
+template_db::sketch() const
+{
+    std::call_once(sketch_set_, [this]() {
+        if (scheme_ids_.size() < 2)
+            return;
+
+        build_sketch(sketch_);
+
+        verbose_emit("prescreen sketch has %lu kmers over %lu schemes",
+                static_cast<unsigned long>(sketch_.size()), static_cast<unsigned long>(scheme_ids_.size()));
+    });
+
+    return sketch_;
+}
+
+// The sketch section of the binary file, which it has when its header carries
+// VERSION, is a line with its label and size, followed by that many pairs of
+// kmer and scheme, each a uint64, and a newline.
+
+void
+template_db::read_sketch(std::istream& is)
+{
+    std::string label;
+    std::uint64_t n = 0;
+
+    is >> label >> n;
+    is.get(); // newline
+
+    if (!is || label != SKETCH_LABEL)
+        raise_error("failed to read sketch section from binary template file");
+
+    std::vector<std::uint64_t> buf(2 * n);
+    is.read(reinterpret_cast<char*>(buf.data()), buf.size() * sizeof(std::uint64_t));
+    is.get(); // newline
+
+    if (!is)
+        raise_error("failed to read sketch section from binary template file");
+
+    sketch_.clear();
+    sketch_.reserve(n);
+
+    for (std::uint64_t i = 0; i != n; ++i)
+        sketch_.push_back(std::make_pair(static_cast<kmer_t>(buf[2*i]), static_cast<nseq_t>(buf[2*i+1])));
+}
 
-        if (!qry_file)
-            raise_error("failed to open query file: %s", filename.c_str());
+void
+template_db::write_sketch(std::ostream& os) const
+{
+    std::vector<std::uint64_t> buf;
+    buf.reserve(2 * sketch_.size());
 
-        is = &qry_file;
+    for (const auto& e : sketch_)
+    {
+        buf.push_back(e.first);
+        buf.push_back(e.second);
     }
 
-    // set up collector vectors
+    os << SKETCH_LABEL << ' ' << sketch_.size() << std::endl;
+    os.write(reinterpret_cast<const char*>(buf.data()), buf.size() * sizeof(std::uint64_t));
+    os << std::endl;
+}
+
 
-    std::vector<std::vector<char> > targets;
-    targets.reserve(seq_lens_.size());
+// The prescreen reads the first PRESCREEN_KMERS kmers of the query, keeping
+// the sequences in buffered for collect to replay, and counts for each scheme
+// how many of them are in its part of the sketch.  The allowed schemes are the
+// top max_schemes having at least PRESCREEN_MIN_FRACTION of the top count.
+// If nothing hits the sketch, all schemes are allowed.
 
-    for (const auto& len : seq_lens_)
-        targets.push_back(std::vector<char>(len, '\0'));
+void
+template_db::prescreen(sequence_reader& reader, const query_options& opts,
+        std::vector<sequence>& buffered, std::vector<char>& allowed) const
+{
+    nseq_t n_schemes = scheme_ids_.size();
+
+    allowed.assign(n_schemes, 1);
 
-    // collect the targets hits by the query
+    if (n_schemes < 2 || static_cast<nseq_t>(opts.prescreen) >= n_schemes)
+        return;
 
-    sequence_reader qry_reader(*is);
-    kmeriser k(kmer_db_.ksize(), skip_degens);
-    sequence seq;
+    const scheme_sketch& sk = sketch();
 
-    while (qry_reader.next(seq))
+    kmeriser k(ksize(), opts.skip_degens, opts.min_qual);
+    std::vector<std::uint64_t> counts(n_schemes, 0);
+    std::uint64_t n_kmers = 0;
+    sequence_span seq;
+
+    while (n_kmers < PRESCREEN_KMERS && reader.next(seq))
     {
-        k.set(seq.data.c_str(), seq.data.c_str() + seq.data.length());
+        k.set(seq.data, seq.data + seq.data_len, seq.qual);
 
         while (k.next())
         {
-            for (const kloc_t& loc : kmer_db_.get_klocs(k.knum()))
+            kmer_t kmer = k.knum();
+            ++n_kmers;
+
+            if (in_sketch_sample(kmer))
             {
-                nseq_t sid = loc >> 32;
-                npos_t pos = loc & 0xFFFFFFFF;
+                auto p = std::lower_bound(sk.begin(), sk.end(), std::make_pair(kmer, nseq_t(0)));
 
-                targets[sid][pos] = '\1';
+                if (p != sk.end() && p->first == kmer)
+                    ++counts[p->second];
             }
         }
+
+        buffered.push_back(sequence());
+        buffered.back().data.assign(seq.data, seq.data_len);
+        if (seq.qual)
+            buffered.back().qual.assign(seq.qual, seq.data_len);
+        buffered.back().partial = seq.partial;
+    }
+
+    std::vector<nseq_t> ranked(n_schemes);
+    for (nseq_t i = 0; i != n_schemes; ++i)
+        ranked[i] = i;
+
+    std::stable_sort(ranked.begin(), ranked.end(), [&](nseq_t a, nseq_t b) { return counts[a] > counts[b]; });
+
+    std::uint64_t top = counts[ranked[0]];
+
+    if (top == 0)
+    {
+        verbose_emit("prescreen: no sketch hits in %lu kmers, not restricting schemes",
+                static_cast<unsigned long>(n_kmers));
+        return;
+    }
+
+    allowed.assign(n_schemes, 0);
+
+    std::string candidates;
+
+    for (int i = 0; i != opts.prescreen && counts[ranked[i]] >= top * PRESCREEN_MIN_FRACTION; ++i)
+    {
+        allowed[ranked[i]] = 1;
+        candidates += " " + scheme_ids_[ranked[i]] + "(" + std::to_string(counts[ranked[i]]) + ")";
+    }
+
+    verbose_emit("prescreen: %lu kmers, candidate schemes:%s",
+            static_cast<unsigned long>(n_kmers), candidates.c_str());
+}
+
+
+// The tally is the inner loop of the result computation.  Where the compiler
+// supports it, we build a variant using the hardware popcount instruction,
+// selected at load time when the CPU has it.
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target_clones("popcnt","default")))
+#endif
+npos_t
+hit_accumulator::count(nseq_t sid) const
+{
+    npos_t n = 0;
+
+    const std::uint64_t *p = words_.data() + offsets_[sid];
+    const std::uint64_t *pend = words_.data() + offsets_[sid+1];
+
+    while (p != pend)
+        n += __builtin_popcountll(*p++);
+
+    return n;
+}
+
+void
+hit_accumulator::reset()
+{
+    for (nseq_t sid : touched_)
+    {
+        std::fill(words_.begin() + offsets_[sid], words_.begin() + offsets_[sid+1], 0);
+        is_touched_[sid] = 0;
+    }
+
+    touched_.clear();
+}
+
+
+npos_t
+depth_accumulator::count(nseq_t sid) const
+{
+    npos_t n = 0;
+
+    const depth_t *p = depths_.data() + (offsets_[sid] << 6);
+    const depth_t *pend = depths_.data() + (offsets_[sid+1] << 6);
+
+    while (p != pend)
+        n += *p++ >= min_depth_;
+
+    return n;
+}
+
+double
+depth_accumulator::depth(nseq_t sid) const
+{
+    std::uint64_t n = 0;
+
+    const depth_t *p = depths_.data() + (offsets_[sid] << 6);
+    const depth_t *pend = depths_.data() + (offsets_[sid+1] << 6);
+
+    while (p != pend)
+        n += *p++;
+
+    return n;
+}
+
+void
+depth_accumulator::reset()
+{
+    for (nseq_t sid : touched_)
+    {
+        std::fill(depths_.begin() + (offsets_[sid] << 6), depths_.begin() + (offsets_[sid+1] << 6), 0);
+        is_touched_[sid] = 0;
     }
 
-    if (is != &std::cin)
-        qry_file.close();
+    touched_.clear();
+}
 
-    // produce the result
 
+template <typename acc_t>
+query_result
+template_db::tally(const acc_t& acc, double min_cov_pct) const
+{
+    trace_span span("tally");
     query_result res;
 
-    for (size_t i = 0; i != targets.size(); ++i)
+    // unless zero coverage is asked for, only the touched templates qualify
+
+    std::vector<nseq_t> sids;
+
+    if (min_cov_pct > 0.0)
     {
-        npos_t hits = 0;
-        npos_t len = seq_lens_[i];
+        sids = acc.touched();
+        std::sort(sids.begin(), sids.end());
+    }
+    else
+    {
+        sids.resize(seq_lens_.size());
+        for (nseq_t i = 0; i != sids.size(); ++i)
+            sids[i] = i;
+    }
 
-        for (const char& c : targets[i]) if (c) ++hits;
+    for (nseq_t i : sids)
+    {
+        npos_t hits = acc.count(i);
+        npos_t len = seq_lens_[i];
 
         double phit = 100.0 * (double)hits / (double)len;
         if (min_cov_pct <= phit)
-            res.push_back({seq_ids_[i], len, hits, phit});
+            res.push_back({seq_ids_[i], len, hits, phit, acc.depth(i) / (double)len});
     }
 
     return res;
 }
 
-template<typename kmer_db_t>
-std::istream& 
-template_db_impl<kmer_db_t>::read_binary(std::istream& is, nseq_t nseq)
+// Collect in tops the best hit template for each locus whose best hit is
+// covered at least min_cov_pct, as pairs <sid,hits> ordered by sid.
+
+template <typename acc_t>
+void
+template_db::get_top_hits(const acc_t& acc, double min_cov_pct, top_hits& tops) const
+{
+    std::map<nseq_t,std::pair<nseq_t,npos_t> > best;
+
+    for (nseq_t sid : acc.touched())
+    {
+        npos_t hits = acc.count(sid);
+
+        if (min_cov_pct <= 100.0 * (double)hits / (double)seq_lens_[sid])
+        {
+            auto p = best.insert(std::make_pair(seq_loci_[sid], std::make_pair(sid, hits))).first;
+
+            if (hits > p->second.second || (hits == p->second.second && sid < p->second.first))
+                p->second = std::make_pair(sid, hits);
+        }
+    }
+
+    tops.clear();
+
+    for (const auto& e : best)
+        tops.push_back(e.second);
+
+    std::sort(tops.begin(), tops.end());
+}
+
+
+void
+template_db::read_seqs(std::istream& is, nseq_t nseq)
 {
     seq_ids_.reserve(nseq);
     seq_lens_.reserve(nseq);
@@ -267,12 +779,756 @@ template_db_impl<kmer_db_t>::read_binary(std::istream& is, nseq_t nseq)
 
     if (!is)
         raise_error("failed to read sequence section from binary template file");
+}
 
-    if (seq_ids_.size() != 0)
-        kmer_db_.read(is);
 
-    return is;
-}
+std::ostream&
+template_db::write(std::ostream& os) const
+{
+    static const char W = ' ';
+
+    kloc_t nbases = 0;
+    for (auto n : seq_lens_)
+        nbases += n;
+
+    const scheme_sketch& sk = sketch();
+
+    os << MAGIC << W;
+
+    if (!sk.empty())
+        os << VERSION << W;
+
+    os << NSEQ_LABEL << W << seq_ids_.size() << W << 
+        NBASES_LABEL << W << nbases << W << 
+        KSIZE_LABEL << W << ksize() << W <<
+        MAXVARS_LABEL << W << max_vars() << std::endl;
+
+    for (nseq_t i = 0; i != seq_ids_.size(); ++i)
+        os << seq_ids_[i] << W << seq_lens_[i] /* << seq_hdrs_[i] */ << std::endl;
+
+    if (!sk.empty())
+        write_sketch(os);
+
+    write_kmer_db(os);
+
+    return os;
+}
+
+
+bool
+template_db::write(const std::string& filename) const
+{
+    std::ofstream os(filename.c_str(), std::ios_base::out|std::ios_base::binary);
+
+    if (!os)
+        return false;
+
+    write(os);
+
+    return (bool)os;
+}
+
+query_result
+template_db::query(const std::string& filename, const query_options& opts) const
+{
+    if (filename.empty() || filename == "-")
+        return query(std::cin, opts);
+
+    sequence_reader reader(filename);
+
+    return query(reader, opts);
+}
+
+query_result
+template_db::query(std::istream& is, const query_options& opts) const
+{
+    sequence_reader reader(is);
+
+    return query(reader, opts);
+}
+
+query_result
+template_db::query(const char *data, std::size_t len, const query_options& opts) const
+{
+    sequence_reader reader(data, len);
+
+    return query(reader, opts);
+}
+
+// clock_now - the wall and CPU time of the calling thread, for query_stats
+
+static phase_times
+clock_now()
+{
+    phase_times t;
+    t.wall = wall_time();
+    t.cpu = thread_cpu_time();
+    return t;
+}
+
+// add_since - add the time passed since t0 to t
+
+static void
+add_since(phase_times& t, const phase_times& t0)
+{
+    phase_times now = clock_now();
+    t.wall += now.wall - t0.wall;
+    t.cpu += now.cpu - t0.cpu;
+}
+
+template<typename kmer_db_t>
+query_result
+template_db_impl<kmer_db_t>::query(sequence_reader& reader, const query_options& opts) const
+{
+    query_stats *stats = opts.stats;
+    phase_times t0, t1;
+    trace_span span("query");
+
+    if (stats)
+    {
+        *stats = query_stats();
+        t0 = clock_now();
+    }
+
+    // collect the hits in a clean accumulator of the requested kind
+
+    query_result res;
+
+    if (opts.min_depth == 0)
+    {
+        std::unique_ptr<hit_accumulator> acc = hit_pool_.acquire(seq_offs_);
+
+        collect(reader, opts, *acc);
+        if (stats) t1 = clock_now();
+        res = tally(*acc, opts.min_cov_pct);
+
+        hit_pool_.release(std::move(acc));
+    }
+    else
+    {
+        std::unique_ptr<depth_accumulator> acc = depth_pool_.acquire(seq_offs_);
+        acc->set_min_depth(opts.min_depth);
+
+        collect(reader, opts, *acc);
+        if (stats) t1 = clock_now();
+        res = tally(*acc, opts.min_cov_pct);
+
+        depth_pool_.release(std::move(acc));
+    }
+
+    if (stats)
+    {
+        add_since(stats->tally, t1);
+        add_since(stats->total, t0);
+    }
+
+    return res;
+}
+
+// make_sketch - collect the sketch of db, as described in templatedb.h; a
+//               partitioned db has it stored
+
+template<typename kmer_db_t>
+static void
+make_sketch(const kmer_db_t& db, const std::vector<nseq_t>& seq_schemes, std::vector<std::pair<kmer_t,nseq_t> >& sk)
+{
+    sk.clear();
+
+    db.for_each([&](kmer_t kmer, kloc_range locs) {
+        if (locs.empty() || !in_sketch_sample(kmer))
+            return;
+
+        nseq_t scheme = seq_schemes[locs[0] >> 32];
+
+        for (const kloc_t& loc : locs)
+            if (seq_schemes[loc >> 32] != scheme)
+                return;
+
+        sk.push_back(std::make_pair(kmer, scheme));
+    });
+}
+
+static void
+make_sketch(const partitioned_kmer_db& db, const std::vector<nseq_t>&, std::vector<std::pair<kmer_t,nseq_t> >& sk)
+{
+    sk = db.sketch();
+}
+
+template<typename kmer_db_t>
+void
+template_db_impl<kmer_db_t>::build_sketch(scheme_sketch& sk) const
+{
+    make_sketch(kmer_db_, seq_schemes_, sk);
+}
+
+
+// get_stats - see db_stats in templatedb.h; the sizes of the sequences are
+//             known up front, the kmers are counted by the implementation
+
+void
+template_db::get_stats(db_stats& st) const
+{
+    st = db_stats();
+
+    st.backend_name = backend_name();
+    st.ksize = ksize();
+    st.max_vars = max_vars();
+
+    get_seq_stats(st);
+    count_kmers(st);
+    estimate_memory(st);
+}
+
+void
+template_db::get_seq_stats(db_stats& st) const
+{
+    st.n_seqs = seq_ids_.size();
+    st.n_loci = seq_loci_.empty() ? 0 : *std::max_element(seq_loci_.begin(), seq_loci_.end()) + 1;
+    st.n_schemes = scheme_ids_.size();
+    st.n_acc_words = seq_offs_.back();
+
+    for (nseq_t i = 0; i != seq_ids_.size(); ++i)
+    {
+        st.n_id_bytes += seq_ids_[i].length() + 1;
+        st.n_positions += seq_lens_[i];
+    }
+}
+
+// backend_name - the name of each kmer db backend
+
+static const char* backend_name(const vector_kmer_db&) { return "vector"; }
+static const char* backend_name(const map_kmer_db&) { return "map"; }
+static const char* backend_name(const shared_kmer_db&) { return "shared"; }
+static const char* backend_name(const partitioned_kmer_db&) { return "partitioned"; }
+
+template<typename kmer_db_t>
+const char*
+template_db_impl<kmer_db_t>::backend_name() const
+{
+    return khc::backend_name(kmer_db_);
+}
+
+template<typename kmer_db_t>
+void
+template_db_impl<kmer_db_t>::count_kmers(db_stats& st) const
+{
+    // the klocs of a kmer are counted per sequence and per scheme; seen has
+    // the number of the kmer that last counted a sequence or scheme
+
+    std::vector<std::uint64_t> seq_klocs(seq_ids_.size(), 0);
+    std::vector<std::uint64_t> seq_seen(seq_ids_.size(), 0);
+    std::vector<std::uint64_t> scheme_seen(scheme_ids_.size(), 0);
+
+    st.scheme_kmers.assign(scheme_ids_.size(), 0);
+    st.scheme_klocs.assign(scheme_ids_.size(), 0);
+
+    auto more_shared = [](const db_stats::shared_kmer& a, const db_stats::shared_kmer& b) {
+        return a.n_seqs > b.n_seqs || (a.n_seqs == b.n_seqs && a.n_klocs > b.n_klocs);
+    };
+
+    kmer_db_.for_each([&](kmer_t kmer, kloc_range locs) {
+        std::uint64_t id = ++st.n_kmers;
+        st.n_klocs += locs.size();
+
+        std::size_t bucket = 0;
+        while ((static_cast<std::size_t>(2) << bucket) <= locs.size())
+            ++bucket;
+
+        if (st.kloc_hist.size() <= bucket)
+            st.kloc_hist.resize(bucket + 1, 0);
+
+        ++st.kloc_hist[bucket];
+
+        db_stats::shared_kmer sk = { kmer, 0, locs.size() };
+        std::size_t n_schemes = 0;
+
+        for (const kloc_t& loc : locs)
+        {
+            nseq_t sid = loc >> 32;
+            nseq_t scheme = seq_schemes_[sid];
+
+            ++seq_klocs[sid];
+            ++st.scheme_klocs[scheme];
+
+            if (seq_seen[sid] != id)
+            {
+                seq_seen[sid] = id;
+                ++sk.n_seqs;
+            }
+
+            if (scheme_seen[scheme] != id)
+            {
+                scheme_seen[scheme] = id;
+                ++st.scheme_kmers[scheme];
+                ++n_schemes;
+            }
+        }
+
+        if (n_schemes == 1 && scheme_ids_.size() > 1 && in_sketch_sample(kmer))
+            ++st.n_sketch;
+
+        if (st.most_shared.size() < db_stats::MAX_LIST || more_shared(sk, st.most_shared.back()))
+        {
+            st.most_shared.insert(std::upper_bound(st.most_shared.begin(), st.most_shared.end(), sk, more_shared), sk);
+
+            if (st.most_shared.size() > db_stats::MAX_LIST)
+                st.most_shared.pop_back();
+        }
+    });
+
+    for (nseq_t i = 0; i != seq_ids_.size(); ++i)
+        if (seq_klocs[i] > seq_lens_[i])
+        {
+            ++st.n_blown;
+            st.blowups.push_back(db_stats::blowup { seq_ids_[i], seq_lens_[i], seq_klocs[i] });
+        }
+
+    auto ratio = [](const db_stats::blowup& b) { return static_cast<double>(b.n_klocs) / b.n_positions; };
+
+    std::stable_sort(st.blowups.begin(), st.blowups.end(),
+            [&](const db_stats::blowup& a, const db_stats::blowup& b) { return ratio(a) > ratio(b); });
+
+    if (st.blowups.size() > db_stats::MAX_LIST)
+        st.blowups.resize(db_stats::MAX_LIST);
+}
+
+std::uint64_t
+db_stats::backend::total() const
+{
+    std::uint64_t n = 0;
+
+    for (const auto& p : parts)
+        n += p.second;
+
+    return n;
+}
+
+// estimate_memory - the vector and map dbs hold a vector of klocs per kmer,
+//                   plus an empty one; read from a binary file, these have
+//                   no spare capacity; the shared and partitioned dbs hold
+//                   the images that shared_kmer_db lays out; all hold the
+//                   sequence IDs and their per-sequence vectors
+
+void
+estimate_memory(db_stats& st)
+{
+    // a map node has three pointers and a colour, the key and value, and
+    // the allocator's overhead
+    static const std::uint64_t MAP_NODE_BYTES = 4 * sizeof(void*) + sizeof(std::pair<const kmer_t,kcnt_t>) + 16;
+
+    std::uint64_t kbits = 2 * st.ksize - 1;
+    std::uint64_t kloc_vecs = (st.n_kmers + 1) * sizeof(std::vector<kloc_t>);
+    std::uint64_t klocs = st.n_klocs * sizeof(kloc_t);
+    std::uint64_t seqs = st.n_id_bytes + st.n_seqs *
+        (sizeof(std::string) + sizeof(kcnt_t) + sizeof(std::size_t) + 2 * sizeof(nseq_t));
+
+    std::uint64_t image_seqs = st.n_id_bytes + st.n_seqs * (sizeof(kcnt_t) + sizeof(std::uint64_t));
+
+    st.backends.clear();
+
+    // a peeked partitioned db has the sizes of its partitions, but not the
+    // kmers that the other backends would hold
+
+    if (st.part_bytes.empty())
+    {
+        st.backends.push_back(db_stats::backend { "vector", {
+            { "kmer index", (static_cast<std::uint64_t>(1) << kbits) * sizeof(kcnt_t) },
+            { "kloc vectors", kloc_vecs }, { "klocs", klocs }, { "sequences", seqs } } });
+
+        st.backends.push_back(db_stats::backend { "map", {
+            { "kmer map", st.n_kmers * MAP_NODE_BYTES },
+            { "kloc vectors", kloc_vecs }, { "klocs", klocs }, { "sequences", seqs } } });
+
+        std::uint64_t image = shared_kmer_db::image_size(st.ksize, st.n_kmers, st.n_klocs, std::vector<std::string>(), "");
+        std::uint64_t kmers = st.n_kmers * sizeof(kmer_t);
+        std::uint64_t offs = (st.n_kmers + 1) * sizeof(std::uint64_t);
+
+        st.backends.push_back(db_stats::backend { "shared", {
+            { "kmer index", image - kmers - offs - klocs }, { "kmers", kmers },
+            { "kloc offsets", offs }, { "klocs", klocs }, { "sequences", seqs + image_seqs } } });
+    }
+
+    // a partitioned db loads only the partitions a query needs
+
+    std::vector<std::uint64_t> part_bytes(st.part_bytes);
+
+    for (std::size_t p = 0; p != st.scheme_kmers.size() && st.part_bytes.empty(); ++p)
+        part_bytes.push_back(shared_kmer_db::image_size(st.ksize, st.scheme_kmers[p], st.scheme_klocs[p],
+                std::vector<std::string>(), ""));
+
+    if (!part_bytes.empty())
+    {
+        std::uint64_t parts = 0, max_part = 0;
+
+        for (std::uint64_t n : part_bytes)
+        {
+            parts += n;
+            max_part = std::max(max_part, n);
+        }
+
+        std::uint64_t sketch = st.n_sketch * 2 * sizeof(std::uint64_t);
+
+        st.backends.push_back(db_stats::backend { "partitioned", {
+            { "partitions", parts }, { "sketch", sketch }, { "sequences", seqs + image_seqs } } });
+
+        st.backends.push_back(db_stats::backend { "partitioned, one scheme", {
+            { "largest partition", max_part }, { "sketch", sketch }, { "sequences", seqs + image_seqs } } });
+    }
+}
+
+
+// kloc_source - looks up the klocs of a kmer for collect: in the kmer db,
+//               or in a partitioned db, in each partition of an allowed
+//               scheme, so that only those get loaded; for_klocs returns
+//               the number of klocs it visited
+
+template<typename kmer_db_t>
+class kloc_source
+{
+    private:
+        const kmer_db_t& db_;
+
+    public:
+        kloc_source(const kmer_db_t& db, const std::vector<char>&) : db_(db) { }
+
+        template<typename F> std::size_t for_klocs(kmer_t kmer, F f) const {
+            kloc_range locs = db_.get_klocs(kmer);
+            for (const kloc_t& loc : locs)
+                f(loc);
+            return locs.size();
+        }
+};
+
+template<>
+class kloc_source<partitioned_kmer_db>
+{
+    private:
+        std::vector<const shared_kmer_db*> parts_;
+
+    public:
+        kloc_source(const partitioned_kmer_db& db, const std::vector<char>& allowed) {
+            for (std::size_t p = 0; p != db.nparts(); ++p)
+                if (allowed.empty() || allowed[p])
+                    parts_.push_back(&db.partition(p));
+        }
+
+        template<typename F> std::size_t for_klocs(kmer_t kmer, F f) const {
+            std::size_t n = 0;
+            for (const shared_kmer_db *part : parts_)
+            {
+                kloc_range locs = part->get_klocs(kmer);
+                for (const kloc_t& loc : locs)
+                    f(loc);
+                n += locs.size();
+            }
+            return n;
+        }
+};
+
+template<typename kmer_db_t>
+template<typename acc_t>
+void
+template_db_impl<kmer_db_t>::collect(sequence_reader& qry_reader, const query_options& opts, acc_t& targets) const
+{
+    // Long query sequences are read in chunks overlapping by k-1 bases, which
+    // together have exactly the kmers of the whole sequence.
+
+    qry_reader.set_chunking(kmer_db_.ksize() - 1);
+
+    // With a prescreen, hits are restricted to the candidate schemes, and the
+    // sequences it read are replayed before reading on.
+
+    std::vector<sequence> buffered;
+    std::vector<char> allowed;
+
+    query_stats *stats = opts.stats;
+
+    if (opts.prescreen > 0)
+    {
+        phase_times t0 = stats ? clock_now() : phase_times();
+        trace_span span("prescreen");
+        prescreen(qry_reader, opts, buffered, allowed);
+        if (stats) add_since(stats->prescreen, t0);
+    }
+
+    bool restricted = std::find(allowed.begin(), allowed.end(), 0) != allowed.end();
+    std::size_t n_replayed = 0;
+
+    auto next_seq = [&](sequence_span& seq) {
+        if (n_replayed == buffered.size())
+            return qry_reader.next(seq);
+        seq = sequence_span(buffered[n_replayed++]);
+        return true;
+    };
+
+    kloc_source<kmer_db_t> source(kmer_db_, allowed);
+
+    // the lookup counters are kept always, as they cost next to nothing; the
+    // longest kloc lists are kept in stats->longest, without duplicates
+
+    std::uint64_t n_hits = 0, n_misses = 0, n_klocs = 0;
+    std::uint64_t min_longest = stats ? 0 : ~0ULL;
+
+    auto note_longest = [&](kmer_t kmer, std::uint64_t n) {
+        std::vector<std::pair<kmer_t,std::uint64_t> >& lst = stats->longest;
+
+        for (const std::pair<kmer_t,std::uint64_t>& e : lst)
+            if (e.first == kmer)
+                return;
+
+        auto p = lst.begin();
+        while (p != lst.end() && p->second >= n)
+            ++p;
+
+        lst.insert(p, std::make_pair(kmer, n));
+
+        if (lst.size() > query_stats::MAX_LONGEST)
+            lst.pop_back();
+
+        if (lst.size() == query_stats::MAX_LONGEST)
+            min_longest = lst.back().second;
+    };
+
+    auto scatter = [&](kmer_t kmer, std::uint32_t n) {
+        std::size_t n_locs = source.for_klocs(kmer, [&](kloc_t loc) {
+            nseq_t sid = loc >> 32;
+            npos_t pos = loc & 0xFFFFFFFF;
+
+            if (!restricted || allowed[seq_schemes_[sid]])
+                targets.hit(sid, pos, n);
+        });
+
+        if (!n_locs)
+            ++n_misses;
+        else
+        {
+            ++n_hits;
+            n_klocs += n_locs;
+
+            if (n_locs > min_longest)
+                note_longest(kmer, n_locs);
+        }
+    };
+
+    // When counting depth, deduplicated kmers must be looked up after reading,
+    // weighted by their multiplicity; otherwise we look them up on first sight.
+    // With min_kmer_count, kmers are looked up only when 'solid': exactly when
+    // deduplicating, else approximately, using the fixed size sketch.
+
+    bool deferred = opts.dedup_kmers && opts.min_depth != 0;
+    bool sketched = !opts.dedup_kmers && opts.min_kmer_count > 1;
+    kmer_counter::count_t min_count = opts.min_kmer_count;
+
+    kmer_counter counts(opts.dedup_kmers ? 16 : 1);
+    kmer_sketch sketch(sketched ? 22 : 1, sketched ? 4 : 1);
+
+    std::uint64_t n_seqs = 0;
+    std::uint64_t n_kmers = 0;
+    std::uint64_t n_places = 0;     // kmer positions, skipped or not
+    std::uint64_t next_check = opts.converge_batches && !deferred ? CONVERGE_BATCH_KMERS : ~0ULL;
+
+    top_hits tops, prev_tops;
+    int n_stable = 0;
+
+    auto add_kmer = [&](kmer_t kmer) {
+        ++n_kmers;
+
+        if (opts.dedup_kmers)
+        {
+            if (counts.add(kmer) == min_count && !deferred)
+                scatter(kmer, 1);
+        }
+        else if (sketched)
+        {
+            // the estimate rises by one with each add until it saturates, so
+            // kmer turns solid when it reaches min_count, unless that is the
+            // saturated count, which it may have reached before
+            bool was_solid = min_count == kmer_sketch::max_count && sketch.count(kmer) == min_count;
+            kmer_sketch::count_t n = sketch.add(kmer);
+
+            // at the moment kmer turns solid, its earlier occurrences count too
+            if (n >= min_count)
+                scatter(kmer, n == min_count && !was_solid ? n : 1);
+        }
+        else
+            scatter(kmer, 1);
+    };
+
+    // after every sequence, and every batch of kmers, check if the top hit
+    // per locus has changed; returns true when it has converged; a partial
+    // chunk does not end its sequence
+
+    auto end_of_seq = [&](bool partial) {
+        if (partial)
+            return false;
+
+        ++n_seqs;
+
+        if (n_kmers < next_check)
+            return false;
+
+        next_check = n_kmers + CONVERGE_BATCH_KMERS;
+
+        get_top_hits(targets, opts.min_cov_pct, tops);
+
+        if (tops.empty() || tops != prev_tops)
+            n_stable = 0;
+        else if (++n_stable == opts.converge_batches)
+            return true;
+
+        tops.swap(prev_tops);
+        return false;
+    };
+
+    std::size_t ksize = kmer_db_.ksize();
+
+    auto count_places = [&](std::size_t len) {
+        if (len >= ksize)
+            n_places += len - ksize + 1;
+    };
+
+    // the phases of the loop; tick adds the time since the last tick to a
+    // phase, and reads the clock only when stats were asked for
+
+    phase_times loop_start = stats ? clock_now() : phase_times();
+    double parse = 0.0, kmerise = 0.0, lookup = 0.0, last = loop_start.wall;
+
+    auto tick = [&](double& phase) {
+        if (stats)
+        {
+            double now = wall_time();
+            phase += now - last;
+            last = now;
+        }
+    };
+
+    bool converged = false;
+
+    if (opts.pipeline > 0)
+    {
+        kmer_pipeline pipe(next_seq, ksize, opts.skip_degens, opts.min_qual, opts.pipeline);
+        const kmer_pipeline::batch *b;
+
+        while (!converged && (b = pipe.next()))
+        {
+            trace_span span("lookup", "kmers", b->kmers.size());
+
+            for (std::size_t i = 0, j = 0; i != b->kmer_ends.size() && !converged; ++i)
+            {
+                count_places(b->seq_ends[i] - (i ? b->seq_ends[i-1] : 0));
+
+                for (; j != b->kmer_ends[i]; ++j)
+                    add_kmer(b->kmers[j]);
+
+                converged = end_of_seq(b->partial[i]);
+            }
+        }
+
+        pipe.finish();
+
+        for (const stage_stats& st : pipe.stats())
+        {
+            verbose_emit("pipeline stage %s (%d thread%s): %.0f%% busy, %.0f%% waiting for input, %.0f%% for output",
+                    st.name.c_str(), st.threads, st.threads == 1 ? "" : "s", 100.0 * st.utilisation(),
+                    100.0 * st.share(st.starved), 100.0 * st.share(st.blocked));
+
+            if (stats)
+            {
+                phase_times& ph = st.name == "parse" ? stats->parse : st.name == "kmerise" ? stats->kmerise : stats->lookup;
+                ph.wall = st.busy;
+                ph.cpu = st.cpu;
+            }
+        }
+    }
+    else
+    {
+        kmeriser k(ksize, opts.skip_degens, opts.min_qual);
+        sequence_span seq;
+        std::vector<knum_t> kmers;
+
+        // the kmers are kmerised before they are looked up, so that the two
+        // can be timed apart; the trace has a single span for the loop
+
+        trace_span span("collect", "kmers");
+
+        while (!converged && next_seq(seq))
+        {
+            tick(parse);
+
+            count_places(seq.data_len);
+            k.set(seq.data, seq.data + seq.data_len, seq.qual);
+
+            kmers.clear();
+            while (k.next())
+                kmers.push_back(k.knum());
+
+            tick(kmerise);
+
+            for (knum_t kmer : kmers)
+                add_kmer(kmer);
+
+            converged = end_of_seq(seq.partial);
+
+            tick(lookup);
+        }
+
+        span.set_arg(n_kmers);
+    }
+
+    if (converged)
+    {
+        verbose_emit("result converged after %lu sequences (%lu kmers)",
+                static_cast<unsigned long>(n_seqs), static_cast<unsigned long>(n_kmers));
+
+        std::size_t pos, len;
+
+        if (qry_reader.input_progress(pos, len))
+            verbose_emit("consumed %lu of %lu input bytes (%.1f%%)",
+                    static_cast<unsigned long>(pos), static_cast<unsigned long>(len), 100.0 * pos / len);
+    }
+
+    if (opts.dedup_kmers)
+        verbose_emit("looked up %lu distinct out of %lu query kmers",
+                static_cast<unsigned long>(counts.size()), static_cast<unsigned long>(n_kmers));
+
+    // the serial loop's CPU time is split over its phases by wall time
+
+    if (stats && opts.pipeline <= 0)
+    {
+        phase_times loop;
+        add_since(loop, loop_start);
+
+        double cpu_per_wall = loop.wall > 0.0 ? loop.cpu / loop.wall : 0.0;
+        stats->parse = phase_times { parse, parse * cpu_per_wall };
+        stats->kmerise = phase_times { kmerise, kmerise * cpu_per_wall };
+        stats->lookup = phase_times { lookup, lookup * cpu_per_wall };
+    }
+
+    if (deferred)
+    {
+        phase_times t0 = stats ? clock_now() : phase_times();
+        trace_span span("lookup", "kmers", counts.size());
+
+        counts.for_each([&](knum_t kmer, kmer_counter::count_t n) {
+            if (n >= min_count)
+                scatter(kmer, n);
+        });
+
+        if (stats) add_since(stats->lookup, t0);
+    }
+
+    if (stats)
+    {
+
+        stats->n_seqs = n_seqs;
+        stats->n_kmers = n_kmers;
+        stats->n_skipped = n_places > n_kmers ? n_places - n_kmers : 0;
+        stats->n_hits = n_hits;
+        stats->n_misses = n_misses;
+        stats->n_klocs = n_klocs;
+    }
+}
+
 
 template<typename kmer_db_t>
 std::istream&
@@ -281,16 +1537,16 @@ template_db_impl<kmer_db_t>::read_fasta(std::istream& is)
     sequence_reader reader(is, sequence_reader::fasta);
     kmerator k(kmer_db_.ksize(), max_vars_);
 
-    sequence seq;
+    sequence_span seq;
     nseq_t seq_cnt = 0;
     int ksize = kmer_db_.ksize();
 
     while (reader.next(seq))
     {
-        seq_ids_.push_back(seq.id);
-        seq_lens_.push_back(seq.data.length() - ksize + 1);
+        seq_ids_.push_back(std::string(seq.header + 1, seq.id_len));
+        seq_lens_.push_back(seq.data_len - ksize + 1);
 
-        k.set(seq.data.c_str(), seq.data.c_str() + seq.data.length());
+        k.set(seq.data, seq.data + seq.data_len);
 
         kloc_t loc = seq_cnt++;
         loc = (loc << 32) - 1;
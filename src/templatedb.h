@@ -18,8 +18,10 @@
 #ifndef templatedb_h_INCLUDED
 #define templatedb_h_INCLUDED
 
+#include <cstdint>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include "seqreader.h"
 #include "kmerdb.h"
@@ -57,43 +59,345 @@ struct seq_hits
     npos_t len;         // number of kmers in sequence (bases - ksize + 1)
     npos_t hits;        // number of kmers hit in sequence
     double phit;        // percentage hits / len
+    double depth;       // mean depth of the hits over len (when counting depth)
 };
 
 typedef std::vector<seq_hits> query_result;
 
 
+// query_stats - timings and counters of a query, see query_options::stats
+//
+// Times are wall and CPU seconds per phase.  Parse, kmerise and lookup take
+// turns on the querying thread, unless they run in a pipeline; their CPU time
+// is then measured together, and split in proportion to their wall times.
+// Total's CPU time is that of the querying thread only.  Kmers skipped are
+// those with degenerate bases, or with -q low quality ones.
+// Longest has the kmers with the longest kloc lists looked up, longest first.
+//
+struct phase_times
+{
+    double wall = 0.0;
+    double cpu = 0.0;
+};
+
+struct query_stats
+{
+    static const std::size_t MAX_LONGEST = 8;
+
+    phase_times prescreen, parse, kmerise, lookup, tally, total;
+    std::uint64_t n_seqs = 0;       // query sequences read
+    std::uint64_t n_kmers = 0;      // query kmers processed
+    std::uint64_t n_skipped = 0;    // query kmers skipped
+    std::uint64_t n_hits = 0;       // lookups that found klocs
+    std::uint64_t n_misses = 0;     // lookups that found none
+    std::uint64_t n_klocs = 0;      // klocs visited by the lookups
+    std::vector<std::pair<kmer_t,std::uint64_t> > longest;
+};
+
+// query_options - the parameters for template_db::query()
+//
+struct query_options
+{
+    double min_cov_pct = 1.0;   // report templates covered at least this much
+    bool skip_degens = false;   // skip query kmers with degenerate bases
+    bool dedup_kmers = false;   // count query kmers, look up distinct ones once
+    int converge_batches = 0;   // stop reading when result stable this long
+    int min_depth = 0;          // if > 0, count depth, hits need this depth
+    int min_qual = 0;           // skip FASTQ kmers with a base below this phred
+    int min_kmer_count = 1;     // look up only kmers occurring this many times
+    int prescreen = 0;          // if > 0, first narrow down to this many schemes
+    int pipeline = 0;           // if > 0, kmerise on this many threads, see kmer_pipeline
+    query_stats *stats = 0;     // if set, receives the query_stats of the query
+};
+
+
+// hit_accumulator - records which template positions were hit by a query
+//
+// Holds one bit per kmer position of every template, in one flat vector of
+// 64-bit words.  Each template starts on a word boundary, at the offset given
+// by the prefix sum of the template lengths (in words), which template_db
+// computes once when it is read.  Counting the hits on a template is then a
+// matter of popcounting its words.
+//
+// The accumulator is meant to be reused across queries.  It keeps the list
+// of templates touched since the last reset(), so that both reset() and the
+// tally can visit just those, making the cost per query proportional to the
+// number of templates hit rather than to the size of the database.
+//
+class hit_accumulator
+{
+    private:
+        const std::vector<std::size_t>& offsets_;
+        std::vector<std::uint64_t> words_;
+        std::vector<char> is_touched_;
+        std::vector<nseq_t> touched_;
+
+    public:
+        hit_accumulator(const std::vector<std::size_t>& offsets)
+            : offsets_(offsets), words_(offsets.back(), 0), is_touched_(offsets.size() - 1, 0) { }
+
+        void hit(nseq_t sid, npos_t pos, std::uint32_t = 1) {
+            if (!is_touched_[sid]) {
+                is_touched_[sid] = 1;
+                touched_.push_back(sid);
+            }
+            words_[offsets_[sid] + (pos >> 6)] |= static_cast<std::uint64_t>(1) << (pos & 63);
+        }
+
+        npos_t count(nseq_t sid) const;
+        double depth(nseq_t sid) const { return count(sid); }
+        const std::vector<nseq_t>& touched() const { return touched_; }
+        void reset();
+};
+
+
+// depth_accumulator - counts how many times template positions were hit
+//
+// Alternative to hit_accumulator for when depth matters.  It has the same
+// interface and layout, except that it holds a saturating 16-bit counter for
+// each position, rather than a bit.  Only positions hit at least min_depth
+// times count as hits.  The sum of the counts gives the mean depth.
+//
+class depth_accumulator
+{
+    public:
+        typedef std::uint16_t depth_t;
+
+    private:
+        const std::vector<std::size_t>& offsets_;  // in words, so times 64
+        std::vector<depth_t> depths_;
+        std::vector<char> is_touched_;
+        std::vector<nseq_t> touched_;
+        depth_t min_depth_;
+
+    public:
+        depth_accumulator(const std::vector<std::size_t>& offsets)
+            : offsets_(offsets), depths_(offsets.back() << 6, 0), is_touched_(offsets.size() - 1, 0), min_depth_(1) { }
+
+        void hit(nseq_t sid, npos_t pos, std::uint32_t n = 1) {
+            if (!is_touched_[sid]) {
+                is_touched_[sid] = 1;
+                touched_.push_back(sid);
+            }
+            depth_t& d = depths_[(offsets_[sid] << 6) + pos];
+            d = n < static_cast<depth_t>(~d) ? d + n : static_cast<depth_t>(~0);
+        }
+
+        void set_min_depth(int d) { min_depth_ = d; }
+        npos_t count(nseq_t sid) const;
+        double depth(nseq_t sid) const;
+        const std::vector<nseq_t>& touched() const { return touched_; }
+        void reset();
+};
+
+
+// accumulator_pool - recycles accumulators across (concurrent) queries
+//
+template <typename acc_t>
+class accumulator_pool
+{
+    private:
+        std::vector<std::unique_ptr<acc_t> > pool_;
+        std::mutex mutex_;
+
+    public:
+        std::unique_ptr<acc_t> acquire(const std::vector<std::size_t>& offsets) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pool_.empty())
+                return std::unique_ptr<acc_t>(new acc_t(offsets));
+            std::unique_ptr<acc_t> acc = std::move(pool_.back());
+            pool_.pop_back();
+            return acc;
+        }
+
+        void release(std::unique_ptr<acc_t> acc) {
+            acc->reset();
+            std::lock_guard<std::mutex> lock(mutex_);
+            pool_.push_back(std::move(acc));
+        }
+};
+
+
+// db_stats - what is in a template_db, see template_db::get_stats()
+//
+// Kloc_hist[i] counts the kmers with 2^i up to 2^(i+1) klocs.  Most_shared
+// has the kmers in the most sequences, most first.  Degenerate bases make a
+// sequence have more klocs than kmer positions; blowups has the sequences
+// with the highest ratio, highest first.  Backends has the memory estimates
+// made by estimate_memory.
+//
+struct db_stats
+{
+    static const std::size_t MAX_LIST = 10;
+
+    struct shared_kmer {
+        kmer_t kmer;
+        std::uint64_t n_seqs;
+        std::uint64_t n_klocs;
+    };
+
+    struct blowup {
+        std::string seq_id;
+        std::uint64_t n_positions;
+        std::uint64_t n_klocs;
+    };
+
+    // the estimated bytes of each structure of a backend
+    struct backend {
+        std::string name;
+        std::vector<std::pair<std::string,std::uint64_t> > parts;
+        std::uint64_t total() const;
+    };
+
+    std::string backend_name;       // the backend holding the db
+    int ksize = 0;
+    int max_vars = 0;
+    std::uint64_t n_seqs = 0;
+    std::uint64_t n_loci = 0;
+    std::uint64_t n_schemes = 0;
+    std::uint64_t n_id_bytes = 0;       // the sequence IDs, NULs included
+    std::uint64_t n_positions = 0;      // kmer positions in the sequences
+    std::uint64_t n_acc_words = 0;      // words in a hit_accumulator
+    std::uint64_t n_kmers = 0;          // distinct kmers
+    std::uint64_t n_klocs = 0;
+    std::uint64_t n_sketch = 0;         // kmers in the prescreen sketch
+    std::uint64_t n_blown = 0;          // sequences with more klocs than positions
+    std::vector<std::uint64_t> kloc_hist;
+    std::vector<std::uint64_t> scheme_kmers, scheme_klocs;
+    std::vector<std::uint64_t> part_bytes;  // the partitions of a peeked partitioned db
+    std::vector<shared_kmer> most_shared;
+    std::vector<blowup> blowups;
+    std::vector<backend> backends;
+};
+
+// estimate_memory - set st.backends to the estimated memory use of a db with
+//                   the sizes in st, for each kmer db backend, followed by
+//                   the accumulators that each concurrent query adds
+//
+extern void estimate_memory(db_stats& st);
+
+
 // template_db - holds the template sequences against which to run queries
 
-// This superclass defines the abstract interface for the two implementations
-// (vector versus map based, see kmer_db), and the factory methods to read a
-// template_db from either a FASTA file or an optimised binary file that it
-// has previously written.
+// This superclass defines the abstract interface for the implementations
+// (vector, map, or shared memory based, see kmer_db), and the factory methods
+// to read a template_db from either a FASTA file or an optimised binary file
+// that it has previously written, or to attach to one that was published in
+// shared memory.
 
 // Its main interface function is query(), which takes a filename or "-" for
-// stdin, and returns the list of sequences hit by the kmers in the file.
+// stdin, an input stream, or a buffer in memory, and returns the list of
+// sequences hit by the kmers in the input.  Queries may run concurrently.
+// Errors are raised as khc::error exceptions.
 
 class template_db
 {
     protected:
         std::vector<std::string> seq_ids_;
         std::vector<kcnt_t> seq_lens_;
+        std::vector<std::size_t> seq_offs_;  // word offsets for hit_accumulator
+        std::vector<nseq_t> seq_loci_;       // locus number of each sequence
+        std::vector<nseq_t> seq_schemes_;    // scheme number of each sequence
+        std::vector<std::string> scheme_ids_;
+
+        void set_offsets();
+        void set_loci();
+        void set_schemes();
+
+        // The prescreen sketch has the kmers that occur in one scheme only,
+        // and whose hash falls in a fixed sample, paired with their scheme
+        // and ordered by kmer.  It is built along with the db, or read from
+        // its binary file, and is empty when there are fewer than two
+        // schemes, as the prescreen does not apply then.  A db attached in
+        // shared memory builds it when sketch() is first called, so that
+        // attaching stays cheap when there is no prescreen.
+
+        typedef std::vector<std::pair<kmer_t,nseq_t> > scheme_sketch;
+        mutable scheme_sketch sketch_;
+        mutable std::once_flag sketch_set_;
+
+        const scheme_sketch& sketch() const;
+        virtual void build_sketch(scheme_sketch&) const = 0;
+        void read_sketch(std::istream&);
+        void write_sketch(std::ostream&) const;
+
+        virtual const char* backend_name() const = 0;
+        virtual void count_kmers(db_stats&) const = 0;
+
+        void prescreen(sequence_reader&, const query_options&,
+                std::vector<sequence>& buffered, std::vector<char>& allowed) const;
+
+        mutable accumulator_pool<hit_accumulator> hit_pool_;
+        mutable accumulator_pool<depth_accumulator> depth_pool_;
+
+        template <typename acc_t>
+        query_result tally(const acc_t&, double min_cov_pct) const;
+
+        typedef std::vector<std::pair<nseq_t,npos_t> > top_hits;
+        template <typename acc_t>
+        void get_top_hits(const acc_t&, double min_cov_pct, top_hits&) const;
 
         static std::unique_ptr<template_db> create_db(int ksize, int max_vars, int max_gb = 0);
 
-        virtual int ksize() const = 0;
+        void get_seq_stats(db_stats& st) const;
+
         virtual int max_vars() const = 0;
-        virtual std::istream& read_binary(std::istream&, nseq_t nseq) = 0;
+        void read_seqs(std::istream&, nseq_t nseq);
+        virtual void read_kmer_db(std::istream& is) = 0;
         virtual std::istream& read_fasta(std::istream&) = 0;
         virtual void write_kmer_db(std::ostream&) const = 0;
 
     public:
+        virtual ~template_db() { }
+
+        // the kmer size of this db
+        virtual int ksize() const = 0;
+
         static std::unique_ptr<template_db> read(std::istream&, int max_gb = 0, int ksize = 0, int max_vars = 0);
 
+        // open the file fname, which may also be a partitioned db (see
+        // write_partitioned), whose partitions are then loaded when needed
+        static std::unique_ptr<template_db> open(const std::string& fname, int max_gb = 0, int ksize = 0, int max_vars = 0);
+
+        // fill st with the sizes in the header of the db that open() would
+        // read from fname, without reading its kmers, and return true; or if
+        // fname is FASTA, set only the backend and sizes given, return false
+        static bool peek(const std::string& fname, db_stats& st, int max_gb = 0, int ksize = 0, int max_vars = 0);
+
+        // whether create_db makes a vector db rather than a map db
+        static bool use_vector_db(int ksize, int max_gb = 0);
+
+        // attach to the db published in shared memory segment shm_name, or
+        // return null if there is none (yet); when source is given, it must
+        // match the source the segment was published with
+        static std::unique_ptr<template_db> attach(const std::string& shm_name, const std::string& source = "");
+
+        // publish this db in shared memory segment shm_name, tagged with
+        // source; returns false if the segment already exists
+        virtual bool publish(const std::string& shm_name, const std::string& source) const = 0;
+
     public:
-        virtual query_result query(const std::string&, double min_cov_pct = 1.0, bool skip_degens = false) const = 0;
+        virtual query_result query(sequence_reader&, const query_options&) const = 0;
+        query_result query(std::istream&, const query_options&) const;
+        query_result query(const std::string&, const query_options&) const;
+        query_result query(const char *data, std::size_t len, const query_options&) const;
+
+        query_result query(const std::string& fname, double min_cov_pct = 1.0, bool skip_degens = false) const {
+            query_options opts;
+            opts.min_cov_pct = min_cov_pct;
+            opts.skip_degens = skip_degens;
+            return query(fname, opts);
+        }
 
         std::ostream& write(std::ostream&) const;
         bool write(const std::string&) const;
+
+        // write this db to file fname as a partitioned db, with a partition
+        // for each scheme, and the prescreen sketch
+        virtual void write_partitioned(const std::string& fname) const = 0;
+
+        // fill st with what is in this db, in a pass over all its kmers
+        void get_stats(db_stats& st) const;
 };
 
 template <typename kmer_db_t>
@@ -103,16 +407,33 @@ class template_db_impl : public template_db
         kmer_db_t kmer_db_;
         int max_vars_;
 
+        template <typename acc_t>
+        void collect(sequence_reader&, const query_options&, acc_t&) const;
+
     protected:
         virtual int ksize() const { return kmer_db_.ksize(); }
         virtual int max_vars() const { return max_vars_; }
-        virtual std::istream& read_binary(std::istream&, nseq_t nseq);
+        virtual void read_kmer_db(std::istream& is) { kmer_db_.read(is); }
         virtual std::istream& read_fasta(std::istream&);
         virtual void write_kmer_db(std::ostream& os) const { kmer_db_.write(os); }
+        virtual void build_sketch(scheme_sketch&) const;
+        virtual const char* backend_name() const;
+        virtual void count_kmers(db_stats&) const;
 
     public:
         template_db_impl(int ksize, int max_vars) : kmer_db_(ksize), max_vars_(max_vars) { }
-        virtual query_result query(const std::string&, double min_cov_pct = 1.0, bool skip_degens = false) const;
+        template_db_impl(kmer_db_t&& kmer_db, int max_vars) : kmer_db_(std::move(kmer_db)), max_vars_(max_vars) { }
+
+        virtual bool publish(const std::string& shm_name, const std::string& source) const {
+            return shared_kmer_db::publish(shm_name, kmer_db_, max_vars_, seq_ids_, seq_lens_, source);
+        }
+
+        virtual void write_partitioned(const std::string& fname) const {
+            partitioned_kmer_db::write(fname, kmer_db_, max_vars_, seq_ids_, seq_lens_, scheme_ids_, seq_schemes_, sketch());
+        }
+
+        using template_db::query;
+        virtual query_result query(sequence_reader&, const query_options&) const;
 };
 
 
@@ -0,0 +1,139 @@
+/* trace.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+
+namespace khc {
+
+namespace {
+
+struct event {
+    const char *name;
+    double start, end;
+    const char *arg_name;
+    std::uint64_t arg;
+};
+
+// thread_trace - the events of one thread, which only it appends to
+
+struct thread_trace {
+    int tid;
+    std::string name;
+    std::vector<event> events;
+};
+
+std::mutex traces_mutex;
+std::vector<std::unique_ptr<thread_trace> > traces;
+thread_local thread_trace *this_thread_trace = 0;
+double origin = 0.0;
+
+thread_trace&
+get_thread_trace()
+{
+    if (!this_thread_trace)
+    {
+        std::lock_guard<std::mutex> lock(traces_mutex);
+
+        traces.push_back(std::unique_ptr<thread_trace>(new thread_trace));
+        this_thread_trace = traces.back().get();
+        this_thread_trace->tid = traces.size();
+    }
+
+    return *this_thread_trace;
+}
+
+} // namespace
+
+bool tracer::enabled_ = false;
+
+void
+tracer::enable()
+{
+    origin = wall_time();
+    enabled_ = true;
+    name_thread("main");
+}
+
+void
+tracer::record(const char *name, double start, double end, const char *arg_name, std::uint64_t arg)
+{
+    get_thread_trace().events.push_back(event { name, start, end, arg_name, arg });
+}
+
+void
+tracer::name_thread(const std::string& name)
+{
+    if (enabled_)
+        get_thread_trace().name = name;
+}
+
+// write - write the events as complete ('X') events, with timestamps in
+//         microseconds since enable(), preceded by a thread name metadata
+//         event for each thread; call when the threads are done recording
+
+void
+tracer::write(const std::string& fname)
+{
+    std::FILE *f = std::fopen(fname.c_str(), "w");
+
+    if (!f)
+        raise_error("failed to open trace file: %s", fname.c_str());
+
+    std::lock_guard<std::mutex> lock(traces_mutex);
+    const char *sep = "\n";
+
+    std::fprintf(f, "{ \"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+
+    for (const auto& t : traces)
+    {
+        if (!t->name.empty())
+        {
+            std::fprintf(f, "%s{ \"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                    "\"args\": { \"name\": \"%s\" } }", sep, t->tid, t->name.c_str());
+            sep = ",\n";
+        }
+
+        for (const event& e : t->events)
+        {
+            std::fprintf(f, "%s{ \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    sep, e.name, t->tid, 1e6 * (e.start - origin), 1e6 * (e.end - e.start));
+
+            if (e.arg_name)
+                std::fprintf(f, ", \"args\": { \"%s\": %llu }", e.arg_name, static_cast<unsigned long long>(e.arg));
+
+            std::fprintf(f, " }");
+            sep = ",\n";
+        }
+    }
+
+    std::fprintf(f, "\n] }\n");
+
+    bool failed = std::ferror(f);
+
+    if (std::fclose(f) != 0 || failed)
+        raise_error("failed to write trace file: %s", fname.c_str());
+}
+
+
+} // namespace khc
+
+// vim: sts=4:sw=4:ai:si:et
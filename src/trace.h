@@ -0,0 +1,91 @@
+/* trace.h
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef trace_h_INCLUDED
+#define trace_h_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include "utils.h"
+
+namespace khc {
+
+// This header defines the tracer, which records spans of time on each thread
+// for a timeline of a khc run, and trace_span, which marks such a span.
+//
+// Spans are written in Chrome trace-event JSON, which trace viewers such as
+// chrome://tracing and Perfetto display with a row per thread.  Until the
+// tracer is enabled, a trace_span costs no more than testing a flag.
+
+
+// tracer - collects the spans of all threads, each in a buffer of its own
+//
+class tracer
+{
+    private:
+        static bool enabled_;
+
+    public:
+        // start tracing; must be called before the threads to trace start
+        static void enable();
+        static bool enabled() { return enabled_; }
+
+        // record span name on the calling thread, from start to end seconds
+        // of wall_time(), with an optional numeric argument; name and
+        // arg_name must be string literals
+        static void record(const char *name, double start, double end,
+                const char *arg_name = 0, std::uint64_t arg = 0);
+
+        // name the calling thread in the trace
+        static void name_thread(const std::string& name);
+
+        // write the spans recorded so far to fname
+        static void write(const std::string& fname);
+};
+
+
+// trace_span - records a span from its construction until its destruction
+//
+class trace_span
+{
+    private:
+        const char *name_;
+        const char *arg_name_;
+        std::uint64_t arg_;
+        double start_;
+
+    public:
+        explicit trace_span(const char *name, const char *arg_name = 0, std::uint64_t arg = 0)
+            : name_(name), arg_name_(arg_name), arg_(arg), start_(tracer::enabled() ? wall_time() : -1.0) { }
+
+        ~trace_span() {
+            if (start_ >= 0.0)
+                tracer::record(name_, start_, wall_time(), arg_name_, arg_);
+        }
+
+        // set the argument, when it is known only at the end of the span
+        void set_arg(std::uint64_t arg) { arg_ = arg; }
+
+        trace_span(const trace_span&) = delete;
+        trace_span& operator=(const trace_span&) = delete;
+};
+
+
+} // namespace khc
+
+#endif // trace_h_INCLUDED
+       // vim: sts=4:sw=4:ai:si:et
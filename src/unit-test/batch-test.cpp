@@ -0,0 +1,129 @@
+/* batch-test.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include "batch.h"
+#include "templatedb.h"
+
+using namespace khc;
+
+namespace {
+
+static const char infile_fasta[] = "data/test.templates";
+static const char query_fname[] = "data/test.query";
+static const char batch_fname[] = "data/test.batch.tmp";
+static const char out_dir[] = "data";
+static const char out_ext[] = ".batch.tmp";
+
+TEST(batch_test, read_batch) {
+    std::ofstream(batch_fname) << "# comment\n\nq1\t" << query_fname << "\n" << query_fname << "\n";
+
+    std::vector<query_job> jobs = { { "-", "-" } };
+    read_batch(batch_fname, jobs);
+    std::remove(batch_fname);
+
+    ASSERT_EQ(3, jobs.size());
+    EXPECT_EQ("q1", jobs[1].name);
+    EXPECT_EQ(query_fname, jobs[1].fname);
+    EXPECT_EQ(query_fname, jobs[2].name);
+    EXPECT_EQ(query_fname, jobs[2].fname);
+
+    std::ofstream(batch_fname) << "q1\t\n";
+    EXPECT_THROW(read_batch(batch_fname, jobs), std::runtime_error);
+    std::remove(batch_fname);
+
+    EXPECT_THROW(read_batch("data/no-such-file", jobs), std::runtime_error);
+}
+
+TEST(batch_test, output_paths) {
+    std::vector<query_job> jobs = { { "a/x.fa", "a/x.fa" }, { "y", "b/x.fa" } };
+
+    EXPECT_EQ("out/x.fa.khc", output_path("out", jobs[0], ".khc"));
+    EXPECT_EQ("out/y.khc", output_path("out", jobs[1], ".khc"));
+    EXPECT_NO_THROW(check_output_paths("out", jobs, ".khc"));
+
+    // files in different directories with the same name overwrite each other
+
+    jobs.push_back({ "b/x.fa", "b/x.fa" });
+    EXPECT_THROW(check_output_paths("out", jobs, ".khc"), std::runtime_error);
+}
+
+TEST(batch_test, run_batch) {
+    for (int n_threads : { 1, 4 })
+    {
+        std::vector<std::atomic<int> > runs(20);
+
+        for (auto& r : runs)
+            r = 0;
+
+        run_batch(runs.size(), n_threads, [&](std::size_t i) { ++runs[i]; });
+
+        for (const auto& r : runs)
+            EXPECT_EQ(1, r);
+    }
+}
+
+TEST(batch_test, query_batch) {
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    query_result expect = db->query(query_fname, 0.0);
+
+    // the same query under three names, run on two threads, each to a file
+
+    std::ofstream(batch_fname) << "b1\t" << query_fname << "\nb2\t" << query_fname << "\nb3\t" << query_fname << "\n";
+    std::vector<query_job> jobs;
+    read_batch(batch_fname, jobs);
+    std::remove(batch_fname);
+
+    ASSERT_EQ(3, jobs.size());
+    check_output_paths(out_dir, jobs, out_ext);
+
+    run_batch(jobs.size(), 2, [&](std::size_t i) {
+        query_result res = db->query(jobs[i].fname, 0.0);
+        std::ofstream os(output_path(out_dir, jobs[i], out_ext));
+        for (const auto& hit : res)
+            os << hit.seqid << ' ' << hit.hits << '\n';
+    });
+
+    std::ostringstream want;
+    for (const auto& hit : expect)
+        want << hit.seqid << ' ' << hit.hits << '\n';
+
+    for (const auto& job : jobs)
+    {
+        std::string fname = output_path(out_dir, job, out_ext);
+        std::ifstream is(fname);
+        std::ostringstream got;
+        got << is.rdbuf();
+        std::remove(fname.c_str());
+
+        EXPECT_EQ(want.str(), got.str());
+    }
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,160 @@
+/* estimate-test.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <gtest/gtest.h>
+#include "estimate.h"
+#include "utils.h"
+
+using namespace khc;
+
+namespace {
+
+static const char infile_fasta[] = "data/test.fasta";
+static const char infile_fastq[] = "data/test.fastq";
+static const char infile_gzip[] = "data/test.fa.gz";
+static const char scratch_fname[] = "data/test.coefs.tmp";
+
+TEST(estimate_test, size_fasta) {
+    input_size sz = size_input(infile_fasta, 2);
+
+    EXPECT_EQ(sz.format, "fasta");
+    EXPECT_FALSE(sz.compressed);
+    EXPECT_EQ(sz.file_bytes, 47);
+    EXPECT_EQ(sz.bytes, 47);
+    EXPECT_EQ(sz.seqs, 2);
+    EXPECT_EQ(sz.id_bytes, 2);
+    EXPECT_EQ(sz.bases, 6);
+    EXPECT_EQ(sz.kmers, 4);
+}
+
+TEST(estimate_test, size_fastq) {
+    input_size sz = size_input(infile_fastq, 5);
+
+    EXPECT_EQ(sz.format, "fastq");
+    EXPECT_EQ(sz.seqs, 2);
+    EXPECT_EQ(sz.bases, 24);
+    EXPECT_EQ(sz.kmers, 16);
+}
+
+#ifndef NO_ZLIB
+TEST(estimate_test, size_gzip) {
+    input_size sz = size_input(infile_gzip, 2);
+
+    EXPECT_EQ(sz.format, "fasta");
+    EXPECT_TRUE(sz.compressed);
+    EXPECT_EQ(sz.file_bytes, 68);
+    EXPECT_EQ(sz.bytes, 47);
+    EXPECT_EQ(sz.seqs, 2);
+    EXPECT_EQ(sz.kmers, 4);
+}
+#endif
+
+TEST(estimate_test, size_not_a_file) {
+    EXPECT_THROW(size_input("-", 2), khc::error);
+    EXPECT_THROW(size_input("data", 2), khc::error);
+}
+
+TEST(estimate_test, coefs) {
+    estimate_coefs coefs;
+    coefs.kmerise_ns_per_kmer = 12.5;
+
+    {
+        std::ofstream os(scratch_fname);
+        os << "# measured\n\n";
+        coefs.write(os);
+        os << "map_ns_per_lookup_level 3  # faster\n";
+    }
+
+    estimate_coefs read;
+    read.read(scratch_fname);
+
+    EXPECT_EQ(read.kmerise_ns_per_kmer, 12.5);
+    EXPECT_EQ(read.map_ns_per_lookup_level, 3.0);
+    EXPECT_EQ(read.vector_ns_per_lookup, coefs.vector_ns_per_lookup);
+
+    std::ofstream(scratch_fname) << "kmerise_ns_per_kmer\n";
+    EXPECT_THROW(read.read(scratch_fname), khc::error);
+
+    std::ofstream(scratch_fname) << "no_such_coef 1\n";
+    EXPECT_THROW(read.read(scratch_fname), khc::error);
+
+    std::remove(scratch_fname);
+}
+
+TEST(estimate_test, run) {
+    db_stats st;
+    st.backend_name = "map";
+    st.ksize = 15;
+    st.n_seqs = 1000;
+    st.n_id_bytes = 10000;
+    st.n_positions = st.n_klocs = 1000000;
+    st.n_acc_words = 17000;
+    st.n_kmers = 100000;
+    estimate_memory(st);
+
+    input_size q;
+    q.bytes = 100 << 20;
+    q.bases = 50 << 20;
+    q.kmers = 40 << 20;
+    std::vector<input_size> queries(2, q);
+
+    estimate_coefs coefs;
+    query_options opts;
+
+    std::vector<run_estimate> ests = estimate_run(st, false, queries, opts, 1, coefs);
+
+    ASSERT_EQ(ests.size(), st.backends.size());
+    EXPECT_EQ(ests[0].backend, "vector");
+    EXPECT_FALSE(ests[0].used);
+    EXPECT_TRUE(ests[1].used);
+
+    // the vector db allocates its kmer index, but looks up faster
+    EXPECT_GT(ests[0].db_bytes, ests[1].db_bytes);
+    EXPECT_GT(ests[0].load_secs, ests[1].load_secs);
+    EXPECT_LT(ests[0].query_secs, ests[1].query_secs);
+
+    // a query maps its input file; both run one after the other
+    EXPECT_GT(ests[1].query_bytes, q.bytes);
+    EXPECT_EQ(ests[1].peak_bytes, static_cast<std::uint64_t>(coefs.base_mb * (1 << 20)) + ests[1].db_bytes + ests[1].query_bytes);
+    ASSERT_EQ(ests[1].secs.size(), 2);
+    EXPECT_DOUBLE_EQ(ests[1].query_secs, ests[1].secs[0] + ests[1].secs[1]);
+
+    // counting the kmers takes memory, and saves lookups in the map
+    opts.dedup_kmers = true;
+    std::vector<run_estimate> dedup = estimate_run(st, false, queries, opts, 1, coefs);
+    EXPECT_GT(dedup[1].query_bytes, ests[1].query_bytes);
+
+    // only solid kmers (-n above 1) are counted in a sketch
+    opts.dedup_kmers = false;
+    opts.min_kmer_count = 2;
+    std::vector<run_estimate> solid = estimate_run(st, false, queries, opts, 1, coefs);
+    EXPECT_EQ(solid[1].query_bytes, ests[1].query_bytes + (16 << 20));
+
+    // concurrent queries add their memory
+    opts.min_kmer_count = 1;
+    std::vector<run_estimate> conc = estimate_run(st, false, queries, opts, 2, coefs);
+    EXPECT_EQ(conc[1].query_bytes, 2 * ests[1].query_bytes);
+    EXPECT_LE(conc[1].query_secs, ests[1].query_secs);
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,223 @@
+/* inflater-test.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef NO_ZLIB
+
+#include <sstream>
+#include <zlib.h>
+#include <gtest/gtest.h>
+#include "seqreader.h"
+#include "utils.h"
+
+using namespace khc;
+
+namespace {
+
+// test_data - n bytes of FASTA that does not compress to nothing
+//
+static std::string
+test_data(std::size_t n)
+{
+    std::string s;
+    unsigned x = 42;
+
+    while (s.size() < n)
+    {
+        s += ">seq" + std::to_string(s.size()) + "\n";
+        for (int i = 0; i != 60; ++i)
+            s += "ACGT"[(x = x * 1103515245 + 12345) >> 30];
+        s += '\n';
+    }
+
+    s.resize(n);
+    return s;
+}
+
+// deflated - s deflated with windowBits as for deflateInit2
+//
+static std::string
+deflated(const std::string& s, int window_bits)
+{
+    z_stream zs = z_stream();
+    deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+
+    std::string out(deflateBound(&zs, s.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(s.data()));
+    zs.avail_in = s.size();
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = out.size();
+
+    deflate(&zs, Z_FINISH);
+    out.resize(out.size() - zs.avail_out);
+    deflateEnd(&zs);
+
+    return out;
+}
+
+static void
+put_le(std::string& s, std::uint32_t v, int n)
+{
+    for (int i = 0; i != n; ++i, v >>= 8)
+        s += static_cast<char>(v & 0xff);
+}
+
+// bgzf - s compressed as BGZF in blocks of block_size, with the EOF block
+//
+static std::string
+bgzf(const std::string& s, std::size_t block_size)
+{
+    std::vector<std::string> blocks;
+
+    for (std::size_t p = 0; p < s.size(); p += block_size)
+        blocks.push_back(s.substr(p, block_size));
+
+    blocks.push_back("");
+
+    std::string out;
+
+    for (const std::string& data : blocks)
+    {
+        std::string cdata = deflated(data, -15);
+
+        out += std::string("\x1f\x8b\x08\x04\0\0\0\0\0\xff\x06\0BC\x02\0", 16);
+        put_le(out, cdata.size() + 25, 2);
+        out += cdata;
+        put_le(out, crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size()), 4);
+        put_le(out, data.size(), 4);
+    }
+
+    return out;
+}
+
+static std::string
+read_all(gzip_inflater& gz, std::size_t chunk = 4096)
+{
+    std::string ret;
+    std::vector<char> buf(chunk);
+    std::size_t n;
+
+    while ((n = gz.read(buf.data(), buf.size())) != 0)
+        ret.append(buf.data(), n);
+
+    return ret;
+}
+
+TEST(inflater_test, bgzf_block_size) {
+
+    std::string z = bgzf("ACGT", 100);
+
+    EXPECT_EQ(z.size() - 28, gzip_inflater::bgzf_block_size(z.data(), z.size()));
+    EXPECT_EQ(0, gzip_inflater::bgzf_block_size(z.data(), 10));
+    EXPECT_EQ(0, gzip_inflater::bgzf_block_size(deflated("ACGT", 31).data(), 18));
+}
+
+TEST(inflater_test, plain_gzip) {
+
+    std::string s = test_data(3 * gzip_inflater::BLOCK_SIZE + 123);
+    std::istringstream is(deflated(s, 31));
+    gzip_inflater gz(is, 2);
+
+    EXPECT_EQ(s, read_all(gz));
+}
+
+TEST(inflater_test, multi_member) {
+
+    std::string s1 = test_data(1000), s2 = test_data(50000);
+    std::istringstream is(deflated(s1, 31) + deflated(s2, 31) + "trailing garbage");
+    gzip_inflater gz(is);
+
+    EXPECT_EQ(s1 + s2, read_all(gz, 7));
+}
+
+TEST(inflater_test, bgzf) {
+
+    std::string s = test_data(5000000);
+
+    for (int n_threads : { 1, 2, 5 })
+    {
+        std::istringstream is(bgzf(s, 65280));
+        gzip_inflater gz(is, n_threads);
+        EXPECT_EQ(s, read_all(gz, 100000));
+    }
+}
+
+TEST(inflater_test, bgzf_then_gzip) {
+
+    std::string s1 = test_data(300000), s2 = test_data(2500000);
+
+    for (int n_threads : { 1, 3 })
+    {
+        std::istringstream is(bgzf(s1, 10000) + deflated(s2, 31) + bgzf(s1, 10000) + "trailing garbage");
+        gzip_inflater gz(is, n_threads);
+        EXPECT_EQ(s1 + s2 + s1, read_all(gz, 100000));
+    }
+}
+
+TEST(inflater_test, bgzf_bad_crc) {
+
+    std::string z = bgzf(test_data(10000), 1000);
+    z[z.size() - 28 - 8] ^= 1;
+
+    std::istringstream is(z);
+    gzip_inflater gz(is, 3);
+
+    EXPECT_THROW(read_all(gz), khc::error);
+}
+
+TEST(inflater_test, truncated) {
+
+    std::string z = deflated(test_data(100000), 31);
+    std::istringstream is(z.substr(0, z.size() / 2));
+    gzip_inflater gz(is);
+
+    EXPECT_THROW(read_all(gz), khc::error);
+}
+
+TEST(inflater_test, stop_early) {
+
+    std::istringstream is(bgzf(test_data(20000000), 65280));
+    gzip_inflater gz(is, 2);
+    char buf[100];
+
+    EXPECT_EQ(100, gz.read(buf, 100));
+}
+
+TEST(inflater_test, sequence_reader) {
+
+    std::string s = test_data(200000);
+    s.resize(s.rfind('>'));
+
+    std::istringstream is1(s), is2(bgzf(s, 10000));
+    sequence_reader r1(is1), r2(is2);
+    sequence q1, q2;
+
+    while (r1.next(q1))
+    {
+        EXPECT_TRUE(r2.next(q2));
+        EXPECT_EQ(q1.header, q2.header);
+        EXPECT_EQ(q1.data, q2.data);
+    }
+
+    EXPECT_FALSE(r2.next(q2));
+}
+
+} // namespace
+
+#endif // NO_ZLIB
+
+// vim: sts=4:sw=4:ai:si:et
@@ -30,19 +30,19 @@ const int   A_VAL = 0, C_VAL = 1, G_VAL = 2, T_VAL = 3;
 
 TEST(kmerator_test, no_ksize_zero) {
     kmerator *r = 0;
-    EXPECT_DEATH(r = new kmerator(0), ".*");
+    EXPECT_THROW(r = new kmerator(0), std::runtime_error);
     delete r;
 }
 
 TEST(kmerator_test, no_ksize_too_big) {
     kmerator *r = 0;
-    EXPECT_DEATH(r = new kmerator(kmerator::max_ksize+1), ".*");
+    EXPECT_THROW(r = new kmerator(kmerator::max_ksize+1), std::runtime_error);
     delete r;
 }
 
 TEST(kmerator_test, no_ksize_even) {
     kmerator *r = 0;
-    EXPECT_DEATH(r = new kmerator(6), ".*");
+    EXPECT_THROW(r = new kmerator(6), std::runtime_error);
     delete r;
 }
 
@@ -143,14 +143,14 @@ TEST(kmerator_test, variant_limit) {
     kmerator r(3,8);
     char seq[] = "abcdg";   // variants 1x3x1x3 = 9 is too many
     r.set(seq, seq+5);
-    EXPECT_DEATH(r.knums(), ".*");
+    EXPECT_THROW(r.knums(), std::runtime_error);
 }
 
 TEST(kmerator_test, set_limit) {
     kmerator r(3,1);
     char seq[] = "acsct";   // variants 2 is too many
     r.set(seq, seq+5);
-    EXPECT_DEATH(r.knums(), ".*");
+    EXPECT_THROW(r.knums(), std::runtime_error);
 }
 
 TEST(kmerator_test, no_limit) {
@@ -0,0 +1,95 @@
+/* kmercounter-test.cpp
+ * 
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <map>
+#include "kmercount.h"
+
+using namespace khc;
+
+namespace {
+
+TEST(kmercounter_test, empty) {
+    kmer_counter c;
+
+    EXPECT_EQ(0, c.size());
+    EXPECT_EQ(0, c.count(0));
+    EXPECT_EQ(0, c.count(42));
+}
+
+TEST(kmercounter_test, add_one) {
+    kmer_counter c;
+
+    EXPECT_EQ(1, c.add(42));
+    EXPECT_EQ(1, c.size());
+    EXPECT_EQ(1, c.count(42));
+    EXPECT_EQ(0, c.count(43));
+}
+
+TEST(kmercounter_test, add_repeated) {
+    kmer_counter c;
+
+    c.add(0);
+    c.add(42);
+    EXPECT_EQ(2, c.add(42));
+    EXPECT_EQ(3, c.add(42));
+    EXPECT_EQ(2, c.size());
+    EXPECT_EQ(1, c.count(0));
+    EXPECT_EQ(3, c.count(42));
+}
+
+TEST(kmercounter_test, grow) {
+    kmer_counter c(2);
+
+    for (knum_t i = 0; i != 1000; ++i)
+        for (knum_t j = 0; j <= i % 3; ++j)
+            c.add(i * 7919);
+
+    EXPECT_EQ(1000, c.size());
+
+    for (knum_t i = 0; i != 1000; ++i)
+        EXPECT_EQ(i % 3 + 1, c.count(i * 7919));
+}
+
+TEST(kmercounter_test, for_each) {
+    kmer_counter c;
+
+    c.add(1); c.add(2); c.add(2); c.add(3); c.add(3); c.add(3);
+
+    std::map<knum_t,kmer_counter::count_t> seen;
+    c.for_each([&](knum_t k, kmer_counter::count_t n) { seen[k] = n; });
+
+    ASSERT_EQ(3, seen.size());
+    EXPECT_EQ(1, seen[1]);
+    EXPECT_EQ(2, seen[2]);
+    EXPECT_EQ(3, seen[3]);
+}
+
+TEST(kmercounter_test, clear) {
+    kmer_counter c;
+
+    c.add(1); c.add(2);
+    c.clear();
+    EXPECT_EQ(0, c.size());
+    EXPECT_EQ(0, c.count(1));
+    EXPECT_EQ(1, c.add(1));
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
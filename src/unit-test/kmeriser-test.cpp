@@ -28,22 +28,19 @@ const int   A_VAL = 0, C_VAL = 1, G_VAL = 2, T_VAL = 3;
 
 TEST(kmeriser_test, no_ksize_zero) {
     kmeriser *r = 0;
-    //EXPECT_THROW(r = new kmeriser(0), std::runtime_error);
-    EXPECT_DEATH(r = new kmeriser(0), ".*");
+    EXPECT_THROW(r = new kmeriser(0), std::runtime_error);
     delete r;
 }
 
 TEST(kmeriser_test, no_ksize_too_big) {
     kmeriser *r = 0;
-    //EXPECT_THROW(r = new kmeriser(kmeriser::max_ksize+1), std::runtime_error);
-    EXPECT_DEATH(r = new kmeriser(kmeriser::max_ksize+1), ".*");
+    EXPECT_THROW(r = new kmeriser(kmeriser::max_ksize+1), std::runtime_error);
     delete r;
 }
 
 TEST(kmeriser_test, no_ksize_even) {
     kmeriser *r = 0;
-    //EXPECT_THROW(r = new kmeriser(6), std::runtime_error);
-    EXPECT_DEATH(r = new kmeriser(6), ".*");
+    EXPECT_THROW(r = new kmeriser(6), std::runtime_error);
     delete r;
 }
 
@@ -152,7 +149,7 @@ TEST(kmeriser_test, balk_degen) {
     char seq[] = "cgn";
     r.set(seq,seq+strlen(seq));
     EXPECT_TRUE(r.next());
-    EXPECT_DEATH(r.knum(), ".*");
+    EXPECT_THROW(r.knum(), std::runtime_error);
 }
 
 TEST(kmeriser_test, skip_n) {
@@ -180,7 +177,37 @@ TEST(kmeriser_test, no_skip_bad) {
     char seq[] = "cgxaaa";
     r.set(seq,seq+strlen(seq));
     EXPECT_TRUE(r.next());
-    EXPECT_DEATH(r.knum(), ".*");
+    EXPECT_THROW(r.knum(), std::runtime_error);
+}
+
+TEST(kmeriser_test, skip_low_qual) {
+    kmeriser r(3, false, 20);
+    char seq[] = "cgtaaacgt";
+    char qul[] = "IIII+IIII";  // '+' is phred 10
+    r.set(seq, seq+strlen(seq), qul);
+    EXPECT_TRUE(r.next());
+    EXPECT_EQ(6,r.knum()); // cgt -> acg -> 00110
+    EXPECT_TRUE(r.next());
+    EXPECT_TRUE(r.next());
+    EXPECT_EQ(6,r.knum()); // acg -> 00110
+    EXPECT_TRUE(r.next());
+    EXPECT_EQ(6,r.knum()); // cgt -> acg -> 00110
+    EXPECT_FALSE(r.next());
+}
+
+TEST(kmeriser_test, no_qual_no_skip) {
+    kmeriser r(3, false, 20);
+    char seq[] = "cgtaaacgt";
+    r.set(seq, seq+strlen(seq));
+    EXPECT_EQ(7, r.knums().size());
+}
+
+TEST(kmeriser_test, skip_qual_and_degen) {
+    kmeriser r(3, true, 20);
+    char seq[] = "aaanaaaaaaaa";
+    char qul[] = "IIIIIII!IIII";
+    r.set(seq, seq+strlen(seq), qul);
+    EXPECT_EQ(4, r.knums().size());  // at positions 0, 4, 8, 9
 }
 
 TEST(kmeriser_test, same_as_ator) {
@@ -194,6 +221,16 @@ TEST(kmeriser_test, same_as_ator) {
     EXPECT_FALSE(ka.next());
 }
 
+TEST(kmeriser_test, knum_to_string) {
+    kmeriser r(5);
+    char seq[] = "aactta";
+    r.set(seq, seq+strlen(seq));
+    ASSERT_TRUE(r.next());
+    EXPECT_EQ("aactt", knum_to_string(r.knum(), 5));
+    ASSERT_TRUE(r.next());
+    EXPECT_EQ("taagt", knum_to_string(r.knum(), 5));   // actta reversed
+}
+
 
 } // namespace
 // vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,73 @@
+/* kmersketch-test.cpp
+ * 
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include "kmercount.h"
+
+using namespace khc;
+
+namespace {
+
+TEST(kmersketch_test, empty) {
+    kmer_sketch s(10);
+
+    EXPECT_EQ(0, s.count(0));
+    EXPECT_EQ(0, s.count(42));
+}
+
+TEST(kmersketch_test, add_counts_up) {
+    kmer_sketch s(10);
+
+    EXPECT_EQ(1, s.add(42));
+    EXPECT_EQ(2, s.add(42));
+    EXPECT_EQ(3, s.add(42));
+    EXPECT_EQ(3, s.count(42));
+}
+
+TEST(kmersketch_test, never_under) {
+    kmer_sketch s(4, 2);  // tiny, so plenty of collisions
+
+    for (knum_t i = 0; i != 100; ++i)
+        for (knum_t j = 0; j <= i % 4; ++j)
+            s.add(i);
+
+    for (knum_t i = 0; i != 100; ++i)
+        EXPECT_LE(i % 4 + 1, s.count(i));
+}
+
+TEST(kmersketch_test, saturates) {
+    kmer_sketch s(10);
+
+    for (int i = 0; i != 300; ++i)
+        s.add(7);
+
+    EXPECT_EQ(kmer_sketch::max_count, s.count(7));
+    EXPECT_EQ(kmer_sketch::max_count, s.add(7));
+}
+
+TEST(kmersketch_test, clear) {
+    kmer_sketch s(10);
+
+    s.add(1); s.add(1);
+    s.clear();
+    EXPECT_EQ(0, s.count(1));
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,97 @@
+/* libkhc-test.cpp
+ * 
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include "libkhc.h"
+
+namespace {
+
+static const char infile_fasta[] = "data/test.templates";
+static const char query_fname[] = "data/test.query";
+
+TEST(libkhc_test, open_missing) {
+    EXPECT_EQ(0, khc_db_open("data/no-such-file", 0, 5, 64));
+    EXPECT_NE(0, std::strlen(khc_last_error()));
+}
+
+TEST(libkhc_test, query_buffer) {
+    khc_db *db = khc_db_open(infile_fasta, 0, 5, 64);
+    ASSERT_NE((khc_db*)0, db);
+
+    khc_options opts;
+    khc_options_init(&opts);
+    opts.min_cov_pct = 0.0;
+
+    khc_result *res1 = khc_query_file(db, query_fname, &opts);
+    ASSERT_NE((khc_result*)0, res1);
+
+    std::string data = ">q\ncatatta\n>r\nacatagc\n";
+    khc_result *res2 = khc_query_buffer(db, data.data(), data.length(), &opts);
+    ASSERT_NE((khc_result*)0, res2);
+
+    ASSERT_EQ(khc_result_size(res1), khc_result_size(res2));
+    ASSERT_LT(0, khc_result_size(res1));
+
+    for (size_t i = 0; i != khc_result_size(res1); ++i)
+    {
+        EXPECT_STREQ(khc_result_hit(res1, i)->seqid, khc_result_hit(res2, i)->seqid);
+        EXPECT_EQ(khc_result_hit(res1, i)->hits, khc_result_hit(res2, i)->hits);
+    }
+
+    EXPECT_EQ(0, khc_result_hit(res1, khc_result_size(res1)));
+
+    khc_result_free(res1);
+    khc_result_free(res2);
+    khc_db_close(db);
+}
+
+TEST(libkhc_test, query_error) {
+    khc_db *db = khc_db_open(infile_fasta, 0, 5, 64);
+    ASSERT_NE((khc_db*)0, db);
+
+    std::string data = "acgtnacgt";
+    EXPECT_EQ(0, khc_query_buffer(db, data.data(), data.length(), 0));
+    EXPECT_NE(0, std::strlen(khc_last_error()));
+
+    khc_db_close(db);
+}
+
+TEST(libkhc_test, query_bad_options) {
+    khc_db *db = khc_db_open(infile_fasta, 0, 5, 64);
+    ASSERT_NE((khc_db*)0, db);
+
+    khc_options opts;
+    khc_options_init(&opts);
+    opts.min_cov_pct = -1.0;
+
+    std::string data = "acgtacgt";
+    EXPECT_EQ(0, khc_query_buffer(db, data.data(), data.length(), &opts));
+    EXPECT_NE(0, std::strlen(khc_last_error()));
+
+    khc_options_init(&opts);
+    opts.min_cov_pct = 101.0;
+    EXPECT_EQ(0, khc_query_buffer(db, data.data(), data.length(), &opts));
+
+    khc_db_close(db);
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
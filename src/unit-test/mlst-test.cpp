@@ -0,0 +1,89 @@
+/* mlst-test.cpp
+ * 
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <sstream>
+#include "mlst.h"
+
+using namespace khc;
+
+namespace {
+
+static const char db_dir[] = "data/mlst";
+
+static std::string
+type(const query_result& res)
+{
+    mlst_typer typer(db_dir);
+    std::ostringstream os;
+    typer.type(res, "q", os);
+    return os.str();
+}
+
+TEST(mlst_test, missing_dir) {
+    EXPECT_THROW(mlst_typer("data/no-such-dir"), std::runtime_error);
+}
+
+TEST(mlst_test, query_id) {
+    EXPECT_EQ("sample", mlst_typer::query_id("/some/dir/sample.fq.gz"));
+    EXPECT_EQ("sample", mlst_typer::query_id("sample"));
+    EXPECT_EQ("-", mlst_typer::query_id("-"));
+}
+
+TEST(mlst_test, exact_st) {
+    query_result res = {
+        { "sa:x:1", 10, 10, 100.0, 0.0 },
+        { "sa:y:2", 10, 10, 100.0, 0.0 },
+        { "sa:y:1", 10,  9,  90.0, 0.0 } };
+    EXPECT_EQ("q\tScheme A\tST2\t1-2\tx-y\t1\t2\n", type(res));
+}
+
+TEST(mlst_test, inexact_st) {
+    query_result res = {
+        { "sa:x:2", 10,  9,  90.0, 0.0 },
+        { "sa:y:1", 10, 10, 100.0, 0.0 } };
+    EXPECT_EQ("q\tScheme A\tST3*\t2*-1\tx-y\t2*\t1\n", type(res));
+}
+
+TEST(mlst_test, not_found) {
+    query_result res = {
+        { "sa:x:2", 10, 10, 100.0, 0.0 },
+        { "sa:y:2", 10,  9,  90.0, 0.0 } };
+    EXPECT_EQ("q\tScheme A\tNF*\t2-2*\tx-y\t2\t2*\n", type(res));
+}
+
+TEST(mlst_test, ties) {
+    query_result res = {
+        { "sa:x:1", 10, 10, 100.0, 0.0 },
+        { "sa:y:10", 10, 10, 100.0, 0.0 },
+        { "sa:y:2", 10, 10, 100.0, 0.0 } };
+    EXPECT_EQ("q\tScheme A\tST2\t1-2\tx-y\t1\t2\n"
+              "q\tScheme A\tNF\t1-10\tx-y\t1\t10\n", type(res));
+}
+
+TEST(mlst_test, incomplete) {
+    query_result res = {
+        { "sb:p:1", 10, 10, 100.0, 0.0 },
+        { "sb:q:1", 10, 10, 100.0, 0.0 },
+        { "sa:x:1", 10, 10, 100.0, 0.0 } };
+    EXPECT_EQ("", type(res));
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
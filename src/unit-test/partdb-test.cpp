@@ -0,0 +1,170 @@
+/* partdb-test.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include "kmerdb.h"
+#include "templatedb.h"
+
+using namespace khc;
+
+namespace {
+
+static const int ksize = 5;
+static const int kbits = 2*ksize - 1;
+static const int kmers = 1<<kbits; // 512
+
+static const char infile_fasta[] = "data/test.templates";
+static const char scratch_fname[] = "data/test.partitioned.tmp";
+
+TEST(partdb_test, open_other) {
+    partitioned_kmer_db db(ksize);
+    EXPECT_FALSE(db.open("data/no-such-file"));
+    EXPECT_FALSE(db.open(infile_fasta));
+}
+
+TEST(partdb_test, write_and_open) {
+    map_kmer_db src(ksize);
+    src.add_kloc(0, 0x000000000);
+    src.add_kloc(0, 0x100000001);
+    src.add_kloc(0, 0x200000002);
+    src.add_kloc(200, 0x100000007);
+    src.add_kloc(kmers-1, 0x200000013);
+
+    std::vector<std::string> ids = { "a:x:1", "b:x:1", "a:y:1" };
+    std::vector<kcnt_t> lens = { 10, 20, 30 };
+    std::vector<std::string> names = { "a", "b" };
+    std::vector<std::uint32_t> schemes = { 0, 1, 0 };
+    partitioned_kmer_db::sketch_t sketch = { { 200, 1 } };
+
+    partitioned_kmer_db::write(scratch_fname, src, 64, ids, lens, names, schemes, sketch);
+
+    partitioned_kmer_db db(0);
+    ASSERT_TRUE(db.open(scratch_fname));
+    std::remove(scratch_fname);
+
+    EXPECT_EQ(ksize, db.ksize());
+    EXPECT_EQ(64, db.max_vars());
+    EXPECT_EQ(ids, db.seq_ids());
+    EXPECT_EQ(lens, db.seq_lens());
+    EXPECT_EQ(sketch, db.sketch());
+    ASSERT_EQ(2, db.nparts());
+    EXPECT_EQ("b", db.part_name(1));
+
+    EXPECT_EQ(2, db.partition(0).get_klocs(0).size());
+    EXPECT_EQ(1, db.partition(1).get_klocs(0).size());
+    EXPECT_TRUE(db.partition(0).get_klocs(200).empty());
+    EXPECT_EQ(0x100000007, db.partition(1).get_klocs(200)[0]);
+
+    // the merged partitions have the klocs of src, in partition order
+
+    int n = 0;
+    db.for_each([&](kmer_t kmer, kloc_range r) {
+        kloc_range e = src.get_klocs(kmer);
+        ASSERT_EQ(e.size(), r.size());
+        ++n;
+    });
+    EXPECT_EQ(3, n);
+}
+
+// patch - overwrite the uint64 at offset off in file fname with value
+
+static void
+patch(const char *fname, std::uint64_t off, std::uint64_t value)
+{
+    std::fstream f(fname, std::ios_base::in|std::ios_base::out|std::ios_base::binary);
+    f.seekp(off);
+    f.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+TEST(partdb_test, open_corrupt) {
+    map_kmer_db src(ksize);
+    src.add_kloc(200, 0x100000007);
+
+    std::vector<std::string> ids = { "a:x:1", "b:x:1" };
+    std::vector<kcnt_t> lens = { 10, 20 };
+    std::vector<std::string> names = { "a", "b" };
+    std::vector<std::uint32_t> schemes = { 0, 1 };
+    partitioned_kmer_db::sketch_t sketch = { { 200, 1 } };
+
+    // the header offsets of off_parts, off_sketch, off_lens, off_str_offs and
+    // off_strings, each set beyond the end of the file, or near the maximum
+
+    for (std::uint64_t off : { 56, 64, 72, 80, 88 })
+        for (std::uint64_t value : { 1ULL << 40, ~0ULL - 7 })
+        {
+            partitioned_kmer_db::write(scratch_fname, src, 64, ids, lens, names, schemes, sketch);
+            patch(scratch_fname, off, value);
+
+            partitioned_kmer_db db(0);
+            EXPECT_THROW(db.open(scratch_fname), std::runtime_error);
+        }
+
+    // a name that starts beyond the strings
+
+    partitioned_kmer_db::write(scratch_fname, src, 64, ids, lens, names, schemes, sketch);
+    std::uint64_t off_str_offs = 0;
+    std::ifstream(scratch_fname, std::ios_base::binary).seekg(80).read(reinterpret_cast<char*>(&off_str_offs), 8);
+    patch(scratch_fname, off_str_offs + 8, 1 << 20);
+
+    partitioned_kmer_db db(0);
+    EXPECT_THROW(db.open(scratch_fname), std::runtime_error);
+    std::remove(scratch_fname);
+}
+
+TEST(partdb_test, query_partitioned) {
+
+    const std::string seq_a("gctaaagacaattacataacatacacgtcagcacgaaacttgttggcccagtgtgaatcgcttaagggttaagtaagtgtgatgcatacgcctttacttgctgtgtccaccccatcggac");
+    const std::string seq_b("tggcatttttattacactcagaaacagaactcgggtaattttgacaggtcacgcagaggcgcgccctcctgaagtgcgtggacactcgctatgaatctctgatttacccactctgccaaa");
+
+    std::stringstream fi(">sa:x:1\n" + seq_a + "\n>sb:x:1\n" + seq_b + "\n");
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    db->write_partitioned(scratch_fname);
+
+    std::unique_ptr<template_db> part = template_db::open(scratch_fname, 0, 5, 64);
+    std::remove(scratch_fname);
+    ASSERT_TRUE(part.get());
+
+    std::string qry(">q1\n" + seq_a + "\n>q2\n" + seq_b.substr(0, 30) + "\n");
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+
+    for (int prescreen = 0; prescreen != 3; ++prescreen)
+    {
+        opts.prescreen = prescreen;
+
+        query_result res1 = db->query(qry.data(), qry.length(), opts);
+        query_result res2 = part->query(qry.data(), qry.length(), opts);
+        ASSERT_EQ(res1.size(), res2.size());
+
+        for (size_t i = 0; i != res1.size(); ++i)
+        {
+            EXPECT_EQ(res1[i].seqid, res2[i].seqid);
+            EXPECT_EQ(res1[i].hits, res2[i].hits);
+        }
+    }
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,192 @@
+/* pipeline-test.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sstream>
+#include <gtest/gtest.h>
+#include "pipeline.h"
+#include "utils.h"
+
+using namespace khc;
+
+namespace {
+
+// test_reads - FASTQ with n reads of varying length
+//
+static std::string
+test_reads(int n)
+{
+    std::string s;
+    unsigned x = 7;
+
+    for (int i = 0; i != n; ++i)
+    {
+        std::string bases, quals;
+
+        for (int j = 0; j != 20 + i % 100; ++j)
+        {
+            x = x * 1103515245 + 12345;
+            bases += "ACGT"[x >> 30];
+            quals += static_cast<char>('!' + (x >> 8) % 40);
+        }
+
+        s += "@r" + std::to_string(i) + "\n" + bases + "\n+\n" + quals + "\n";
+    }
+
+    return s;
+}
+
+TEST(pipeline_test, ring) {
+
+    spsc_ring<int> r(3);
+    int v;
+
+    EXPECT_FALSE(r.try_pop(v));
+
+    for (int i = 0; i != 3; ++i)
+    {
+        v = i;
+        EXPECT_TRUE(r.try_push(v));
+    }
+
+    v = 3;
+    EXPECT_FALSE(r.try_push(v));
+
+    EXPECT_TRUE(r.try_pop(v));
+    EXPECT_EQ(0, v);
+
+    v = 3;
+    EXPECT_TRUE(r.try_push(v));
+    EXPECT_FALSE(r.is_closed());
+    r.close();
+    EXPECT_TRUE(r.is_closed());
+
+    for (int i = 1; i != 4; ++i)
+    {
+        EXPECT_TRUE(r.try_pop(v));
+        EXPECT_EQ(i, v);
+    }
+
+    EXPECT_FALSE(r.try_pop(v));
+}
+
+TEST(pipeline_test, ring_threaded) {
+
+    const int n = 100000;
+    spsc_ring<int> r(16);
+
+    std::thread producer([&]() {
+        for (int i = 0; i != n; ++i)
+            while (!r.try_push(i))
+                std::this_thread::yield();
+        r.close();
+    });
+
+    int expected = 0, v;
+
+    for (;;)
+    {
+        bool closed = r.is_closed();
+
+        if (r.try_pop(v))
+            EXPECT_EQ(expected++, v);
+        else if (closed)
+            break;
+        else
+            std::this_thread::yield();
+    }
+
+    producer.join();
+    EXPECT_EQ(n, expected);
+}
+
+TEST(pipeline_test, same_as_serial) {
+
+    std::string reads = test_reads(5000);
+
+    for (int n_threads : { 1, 3 })
+    {
+        std::istringstream is1(reads), is2(reads);
+        sequence_reader r1(is1), r2(is2);
+        kmeriser k(11, false, 20);
+
+        kmer_pipeline pipe([&](sequence_span& s) { return r2.next(s); }, 11, false, 20, n_threads);
+        const kmer_pipeline::batch *b;
+        sequence_span seq;
+        int n_batches = 0;
+
+        while ((b = pipe.next()))
+        {
+            ++n_batches;
+
+            for (std::size_t i = 0, j = 0; i != b->kmer_ends.size(); ++i)
+            {
+                ASSERT_TRUE(r1.next(seq));
+                k.set(seq.data, seq.data + seq.data_len, seq.qual);
+
+                for (; j != b->kmer_ends[i]; ++j)
+                {
+                    ASSERT_TRUE(k.next());
+                    EXPECT_EQ(k.knum(), b->kmers[j]);
+                }
+
+                EXPECT_FALSE(k.next());
+            }
+        }
+
+        EXPECT_FALSE(r1.next(seq));
+        EXPECT_GT(n_batches, 1);
+
+        pipe.finish();
+
+        std::vector<stage_stats> stats = pipe.stats();
+        ASSERT_EQ(3, stats.size());
+        EXPECT_EQ("kmerise", stats[1].name);
+        EXPECT_EQ(n_threads, stats[1].threads);
+        EXPECT_GE(stats[1].utilisation(), 0.0);
+        EXPECT_LE(stats[1].utilisation(), 1.0);
+    }
+}
+
+TEST(pipeline_test, error) {
+
+    std::istringstream is(">a\nACGTACGTAC\n>b\nACGTNACGTA\n");
+    sequence_reader r(is);
+
+    kmer_pipeline pipe([&](sequence_span& s) { return r.next(s); }, 3, false, 0, 2);
+
+    while (pipe.next())
+        ;
+
+    EXPECT_THROW(pipe.finish(), khc::error);
+}
+
+TEST(pipeline_test, stop_early) {
+
+    std::string reads = test_reads(50000);
+    std::istringstream is(reads);
+    sequence_reader r(is);
+
+    kmer_pipeline pipe([&](sequence_span& s) { return r.next(s); }, 11, false, 0, 2);
+
+    EXPECT_TRUE(pipe.next() != 0);
+    pipe.finish();
+}
+
+} // namespace
+
+// vim: sts=4:sw=4:ai:si:et
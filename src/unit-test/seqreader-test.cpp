@@ -17,6 +17,8 @@
  */
 
 #include <fstream>
+#include <sstream>
+#include <vector>
 #include <gtest/gtest.h>
 #include "seqreader.h"
 
@@ -58,10 +60,12 @@ TEST(seqreader_test, read_fastq) {
     EXPECT_EQ(std::string("1"), s.id);
     EXPECT_EQ(std::string("@1 First FASTQ Stanza"), s.header);
     EXPECT_EQ(std::string("ABCABCABCABC"), s.data);
+    EXPECT_EQ(std::string("AA1>AB31D1DD"), s.qual);
     EXPECT_TRUE(r.next(s));
     EXPECT_EQ(std::string("2"), s.id);
     EXPECT_EQ(std::string("@2 Second FASTQ Stanza"), s.header);
     EXPECT_EQ(std::string("DEFDEFDEFDEF"), s.data);
+    EXPECT_EQ(std::string("AAAAA111>1AC"), s.qual);
     EXPECT_FALSE(r.next(s));
 }
 
@@ -97,6 +101,219 @@ TEST(seqreader_test, read_gzipped) {
     EXPECT_FALSE(r.next(s));
 }
 
+TEST(seqreader_test, read_spans) {
+
+    std::ifstream f;
+    f.open(fastq_fname);
+    sequence_reader r(f);
+    sequence_span s;
+
+    EXPECT_TRUE(r.next(s));
+    EXPECT_EQ(std::string("1"), std::string(s.header + 1, s.id_len));
+    EXPECT_EQ(std::string("@1 First FASTQ Stanza"), std::string(s.header, s.header_len));
+    EXPECT_EQ(std::string("ABCABCABCABC"), std::string(s.data, s.data_len));
+    EXPECT_EQ(std::string("AA1>AB31D1DD"), std::string(s.qual, s.data_len));
+    EXPECT_TRUE(r.next(s));
+    EXPECT_EQ(std::string("DEFDEFDEFDEF"), std::string(s.data, s.data_len));
+    EXPECT_FALSE(r.next(s));
+}
+
+TEST(seqreader_test, small_blocks) {
+
+    // lines longer than the block, records straddling blocks, and a last
+    // line without newline must read the same as with the default block
+
+    const std::string in(">1 First\nACGT\nAC\n\n>2\nGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGGG\n>3 Third one\nTT");
+
+    for (std::size_t block = 1; block != 12; ++block)
+    {
+        std::istringstream is(in);
+        sequence_reader r(is, sequence_reader::detect, block);
+        sequence s;
+
+        EXPECT_TRUE(r.next(s));
+        EXPECT_EQ(std::string(">1 First"), s.header);
+        EXPECT_EQ(std::string("ACGTAC"), s.data);
+        EXPECT_TRUE(r.next(s));
+        EXPECT_EQ(std::string("2"), s.id);
+        EXPECT_EQ(std::string(32, 'G'), s.data);
+        EXPECT_TRUE(r.next(s));
+        EXPECT_EQ(std::string("3"), s.id);
+        EXPECT_EQ(std::string("TT"), s.data);
+        EXPECT_FALSE(r.next(s));
+    }
+}
+
+TEST(seqreader_test, invalid_fastq) {
+
+    std::istringstream is("@1\nACGT\n+\nAAA\n");
+    sequence_reader r(is);
+    sequence s;
+
+    EXPECT_THROW(r.next(s), std::runtime_error);
+}
+
+TEST(seqreader_test, read_memory) {
+
+    // single line sequences are handed out in place
+
+    const std::string in("@1\nACGT\n+\nIIII\n@2\nGG\n+\nII");
+    sequence_reader r(in.data(), in.length());
+    sequence_span s;
+    std::size_t pos, len;
+
+    EXPECT_TRUE(r.next(s));
+    EXPECT_EQ(in.data() + 3, s.data);
+    EXPECT_EQ(4, s.data_len);
+    EXPECT_EQ(in.data() + 10, s.qual);
+    EXPECT_TRUE(r.input_progress(pos, len));
+    EXPECT_EQ(in.length(), len);
+    EXPECT_LT(pos, len);
+
+    EXPECT_TRUE(r.next(s));
+    EXPECT_EQ(std::string("GG"), std::string(s.data, s.data_len));
+    EXPECT_FALSE(r.next(s));
+    EXPECT_TRUE(r.input_progress(pos, len));
+    EXPECT_EQ(len, pos);
+}
+
+TEST(seqreader_test, read_file) {
+
+    for (const char *fname : { fasta_fname, gzip_fname })
+    {
+        sequence_reader r{std::string(fname)};
+        sequence s;
+        std::size_t pos, len;
+
+        EXPECT_TRUE(r.next(s));
+        EXPECT_EQ(std::string(">1 First Sequence"), s.header);
+        EXPECT_EQ(std::string("ABC"), s.data);
+        EXPECT_TRUE(r.next(s));
+        EXPECT_EQ(std::string("DEF"), s.data);
+        EXPECT_FALSE(r.next(s));
+
+        std::ifstream f(fname, std::ios_base::binary|std::ios_base::ate);
+        EXPECT_TRUE(r.input_progress(pos, len));
+        EXPECT_EQ(static_cast<std::size_t>(f.tellg()), len);
+        EXPECT_EQ(len, pos);
+    }
+
+    // a stream does not tell its size
+
+    std::ifstream f(gzip_fname, std::ios_base::binary);
+    sequence_reader r(f);
+    sequence s;
+    std::size_t pos, len;
+
+    EXPECT_TRUE(r.next(s));
+    EXPECT_FALSE(r.input_progress(pos, len));
+
+    EXPECT_THROW(sequence_reader(std::string("data/no-such-file")), std::runtime_error);
+}
+
+
+// read_all - the sequences read by r, with chunks joined up again by dropping
+//            the overlap at the start of each continuing chunk
+//
+static std::vector<sequence>
+read_all(sequence_reader& r, std::size_t overlap = 0)
+{
+    std::vector<sequence> ret;
+    sequence s;
+    bool cont = false;
+
+    while (r.next(s))
+    {
+        if (cont)
+        {
+            EXPECT_EQ(ret.back().header, s.header);
+            EXPECT_EQ(ret.back().data.substr(ret.back().data.size() - overlap), s.data.substr(0, overlap));
+            ret.back().data += s.data.substr(overlap);
+        }
+        else
+            ret.push_back(s);
+
+        cont = s.partial;
+    }
+
+    EXPECT_FALSE(cont);
+    return ret;
+}
+
+TEST(seqreader_test, chunked) {
+
+    std::string fasta, bare;
+    unsigned x = 7;
+
+    for (int n : { 5, 0, 3000, 90, 1, 700 })
+    {
+        fasta += ">seq" + std::to_string(n) + " len\n";
+
+        for (int i = 0; i != n; ++i)
+        {
+            char c = "ACGT"[(x = x * 1103515245 + 12345) >> 30];
+            fasta += c;
+            bare += c;
+
+            if ((x >> 8) % (n > 1000 ? 997 : 31) == 0)
+            {
+                fasta += '\n';
+                bare += i % 2 ? "\n" : "  ";
+            }
+        }
+
+        fasta += '\n';
+    }
+
+    for (const std::string& data : { fasta, bare })
+    {
+        std::istringstream is(data);
+        sequence_reader r(is);
+        std::vector<sequence> whole = read_all(r);
+
+        for (std::size_t chunk : { 1, 2, 10, 64, 1000 })
+            for (std::size_t overlap : { 0, 1, 4, 30 })
+            {
+                sequence_reader r1(data.data(), data.size());
+                r1.set_chunking(overlap, chunk);
+
+                std::istringstream is2(data);
+                sequence_reader r2(is2, sequence_reader::detect, 16);
+                r2.set_chunking(overlap, chunk);
+
+                for (sequence_reader *pr : { &r1, &r2 })
+                {
+                    std::vector<sequence> got = read_all(*pr, overlap);
+
+                    ASSERT_EQ(whole.size(), got.size());
+
+                    for (std::size_t i = 0; i != whole.size(); ++i)
+                    {
+                        EXPECT_EQ(whole[i].header, got[i].header);
+                        EXPECT_EQ(whole[i].id, got[i].id);
+                        EXPECT_EQ(whole[i].data, got[i].data);
+                    }
+                }
+            }
+    }
+}
+
+TEST(seqreader_test, chunked_fastq) {
+
+    std::ifstream f(fastq_fname);
+    sequence_reader r(f);
+    r.set_chunking(3, 5);
+    sequence s;
+
+    EXPECT_TRUE(r.next(s));
+    EXPECT_EQ(std::string("ABCABCABCABC"), s.data);
+    EXPECT_EQ(std::string("AA1>AB31D1DD"), s.qual);
+    EXPECT_FALSE(s.partial);
+    EXPECT_TRUE(r.next(s));
+    EXPECT_EQ(std::string("DEFDEFDEFDEF"), s.data);
+    EXPECT_FALSE(r.next(s));
+}
+
 
 } // namespace
 // vim: sts=4:sw=4:ai:si:et
@@ -0,0 +1,191 @@
+/* shareddb-test.cpp
+ * 
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <gtest/gtest.h>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "kmerdb.h"
+#include "templatedb.h"
+
+using namespace khc;
+
+namespace {
+
+static const int ksize = 5;
+static const int kbits = 2*ksize - 1;
+static const int kmers = 1<<kbits; // 512
+
+static const char infile_fasta[] = "data/test.templates";
+static const char query_fname[] = "data/test.query";
+
+static std::string
+shm_name()
+{
+    return "khc-unit-test-" + std::to_string(getpid());
+}
+
+TEST(shareddb_test, attach_missing) {
+    shared_kmer_db db(ksize);
+    EXPECT_FALSE(db.attach(shm_name()));
+}
+
+TEST(shareddb_test, publish_and_attach) {
+    map_kmer_db src(ksize);
+    src.add_kloc(0,42);
+    src.add_kloc(0,99);
+    src.add_kloc(200,7);
+    src.add_kloc(kmers-1,13);
+
+    std::vector<std::string> ids = { "one", "two" };
+    std::vector<kcnt_t> lens = { 10, 20 };
+
+    ASSERT_TRUE(shared_kmer_db::publish(shm_name(), src, 64, ids, lens, "test"));
+    EXPECT_FALSE(shared_kmer_db::publish(shm_name(), src, 64, ids, lens, "test"));
+
+    shared_kmer_db db(0);
+    ASSERT_TRUE(db.attach(shm_name()));
+    EXPECT_TRUE(shared_kmer_db::remove(shm_name()));
+
+    EXPECT_EQ(ksize, db.ksize());
+    EXPECT_EQ(64, db.max_vars());
+    EXPECT_EQ("test", db.source());
+    ASSERT_EQ(2, db.nseq());
+    EXPECT_STREQ("two", db.seq_id(1));
+    EXPECT_EQ(20, db.seq_len(1));
+
+    for (int i = 0; i < kmers; ++i)
+    {
+        kloc_range r = db.get_klocs(i);
+        kloc_range e = src.get_klocs(i);
+        ASSERT_EQ(e.size(), r.size());
+        for (size_t j = 0; j != e.size(); ++j)
+            EXPECT_EQ(e[j], r[j]);
+    }
+}
+
+// make_incomplete - create an empty segment, as a publisher does first
+
+static void
+make_incomplete(const std::string& name)
+{
+    int fd = shm_open(("/" + name).c_str(), O_RDWR|O_CREAT|O_EXCL, 0644);
+    ASSERT_LE(0, fd);
+    close(fd);
+}
+
+TEST(shareddb_test, incomplete_segment) {
+    map_kmer_db src(ksize);
+    src.add_kloc(200,7);
+    std::vector<std::string> ids = { "one" };
+    std::vector<kcnt_t> lens = { 10 };
+
+    make_incomplete(shm_name());
+
+    // while it is young, it is being published by another process
+
+    EXPECT_FALSE(shared_kmer_db::publish(shm_name(), src, 64, ids, lens, "test"));
+
+    // after the timeout, it is stale, and replaced
+
+    shared_kmer_db db(0);
+    EXPECT_FALSE(db.attach(shm_name(), 0.2));
+    EXPECT_TRUE(shared_kmer_db::publish(shm_name(), src, 64, ids, lens, "test", 0.2));
+    EXPECT_TRUE(db.attach(shm_name(), 0.2));
+    EXPECT_TRUE(shared_kmer_db::remove(shm_name()));
+    EXPECT_EQ(1, db.get_klocs(200).size());
+}
+
+// failing_db - a kmer db that fails while it is being published
+
+struct failing_db
+{
+    mutable int calls = 0;
+    int ksize() const { return 5; }
+    template <typename F> void for_each(F f) const {
+        if (calls++)
+            throw std::runtime_error("failing_db");
+        f(200, kloc_range(0, 0));
+    }
+};
+
+TEST(shareddb_test, publish_failure) {
+    std::vector<std::string> ids = { "one" };
+    std::vector<kcnt_t> lens = { 10 };
+
+    EXPECT_THROW(shared_kmer_db::publish(shm_name(), failing_db(), 64, ids, lens, "test"), std::runtime_error);
+    EXPECT_FALSE(shared_kmer_db::remove(shm_name()));
+}
+
+TEST(shareddb_test, query_attached) {
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    ASSERT_TRUE(db->publish(shm_name(), "test"));
+    EXPECT_THROW(template_db::attach(shm_name(), "other"), std::runtime_error);
+
+    std::unique_ptr<template_db> shared = template_db::attach(shm_name(), "test");
+    EXPECT_TRUE(shared_kmer_db::remove(shm_name()));
+    ASSERT_TRUE(shared.get());
+
+    query_result res1 = db->query(query_fname, 0.0);
+    query_result res2 = shared->query(query_fname, 0.0);
+    ASSERT_EQ(res1.size(), res2.size());
+
+    for (size_t i = 0; i != res1.size(); ++i)
+    {
+        EXPECT_EQ(res1[i].seqid, res2[i].seqid);
+        EXPECT_EQ(res1[i].hits, res2[i].hits);
+    }
+}
+
+TEST(shareddb_test, prescreen_attached) {
+
+    const std::string seq_a("gctaaagacaattacataacatacacgtcagcacgaaacttgttggcccagtgtgaatcgcttaagggttaagtaagtgtgatgcatacgcctttacttgctgtgtccaccccatcggac");
+    const std::string seq_b("tggcatttttattacactcagaaacagaactcgggtaattttgacaggtcacgcagaggcgcgccctcctgaagtgcgtggacactcgctatgaatctctgatttacccactctgccaaa");
+
+    std::stringstream fi(">sa:x:1\n" + seq_a + "\n>sb:x:1\n" + seq_b + "\n");
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    ASSERT_TRUE(db->publish(shm_name(), "test"));
+    std::unique_ptr<template_db> shared = template_db::attach(shm_name(), "test");
+    EXPECT_TRUE(shared_kmer_db::remove(shm_name()));
+    ASSERT_TRUE(shared.get());
+
+    // the attached db builds its sketch when the prescreen first needs it
+
+    std::string qry(">q1\n" + seq_a + "\n>q2\n" + seq_b.substr(0, 30) + "\n");
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+    opts.prescreen = 1;
+
+    query_result res = shared->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(2, res.size());
+    EXPECT_EQ(116, res[0].hits);
+    EXPECT_EQ(0, res[1].hits);
+}
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
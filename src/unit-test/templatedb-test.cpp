@@ -17,8 +17,10 @@
  */
 
 #include <gtest/gtest.h>
+#include <cstdio>
 #include <fstream>
 #include <memory>
+#include <sstream>
 #include "templatedb.h"
 
 using namespace khc;
@@ -33,6 +35,7 @@ static const char infile_empty[] = "data/test.empty";
 static const char infile_fasta[] = "data/test.templates";
 static const char infile_binary[] = "data/test.templates.bin";
 static const char scratch_fname[] = "data/test.templates.tmp";
+static const char query_fname[] = "data/test.query";
 
 TEST(templatedb_test, read_empty) {
 
@@ -61,6 +64,466 @@ TEST(templatedb_test, read_fasta) {
     std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
 }
 
+TEST(templatedb_test, query_fasta) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    query_result res = db->query(query_fname, 0.0);
+    ASSERT_EQ(2, res.size());
+    EXPECT_EQ(std::string("template-1"), res[0].seqid);
+    EXPECT_EQ(18, res[0].len);
+    EXPECT_EQ(3, res[0].hits);
+    EXPECT_EQ(std::string("template-2"), res[1].seqid);
+    EXPECT_EQ(18, res[1].len);
+    EXPECT_EQ(4, res[1].hits);
+
+    res = db->query(query_fname, 20.0);
+    ASSERT_EQ(1, res.size());
+    EXPECT_EQ(std::string("template-2"), res[0].seqid);
+}
+
+TEST(templatedb_test, query_depth) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+    opts.min_depth = 1;
+
+    query_result res = db->query(query_fname, opts);
+    ASSERT_EQ(2, res.size());
+    EXPECT_EQ(3, res[0].hits);
+    EXPECT_DOUBLE_EQ(3.0/18.0, res[0].depth);
+    EXPECT_EQ(4, res[1].hits);
+    EXPECT_DOUBLE_EQ(6.0/18.0, res[1].depth);
+
+    opts.min_depth = 2;
+    res = db->query(query_fname, opts);
+    ASSERT_EQ(2, res.size());
+    EXPECT_EQ(0, res[0].hits);
+    EXPECT_DOUBLE_EQ(3.0/18.0, res[0].depth);
+    EXPECT_EQ(2, res[1].hits);
+}
+
+TEST(templatedb_test, query_repeated) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    query_result res1 = db->query(query_fname, 0.0);
+    query_result res2 = db->query(query_fname, 0.0);
+    ASSERT_EQ(res1.size(), res2.size());
+
+    for (size_t i = 0; i != res1.size(); ++i)
+        EXPECT_EQ(res1[i].hits, res2[i].hits);
+
+    // nothing of the first query carries over to the next
+
+    query_options opts;
+    opts.min_cov_pct = 10.0;
+
+    std::string empty(">q\n");
+    EXPECT_EQ(2, db->query(query_fname, opts).size());
+    EXPECT_EQ(0, db->query(empty.data(), empty.length(), opts).size());
+
+    std::string part(">q2\nacatagc\n");
+    std::ifstream fi2(infile_fasta);
+    query_result fresh = template_db::read(fi2, 0, 5, 64)->query(part.data(), part.length(), opts);
+
+    EXPECT_EQ(2, db->query(query_fname, opts).size());
+    query_result after = db->query(part.data(), part.length(), opts);
+    ASSERT_EQ(1, fresh.size());
+    ASSERT_EQ(fresh.size(), after.size());
+
+    for (size_t i = 0; i != fresh.size(); ++i)
+    {
+        EXPECT_EQ(fresh[i].seqid, after[i].seqid);
+        EXPECT_EQ(fresh[i].hits, after[i].hits);
+    }
+}
+
+TEST(templatedb_test, query_dedup) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    // the query file three times over, and a read repeating a kmer
+
+    std::ifstream fq(query_fname);
+    std::ostringstream one;
+    one << fq.rdbuf();
+    std::string read(">r\ncatatcatatcatat\n");
+    std::string qry = one.str() + one.str() + one.str() + read;
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+
+    for (int depth : { 0, 1, 2 })
+    {
+        opts.min_depth = depth;
+        opts.dedup_kmers = false;
+        query_result res1 = db->query(qry.data(), qry.length(), opts);
+
+        opts.dedup_kmers = true;
+        query_result res2 = db->query(qry.data(), qry.length(), opts);
+
+        ASSERT_EQ(2, res1.size());
+        ASSERT_EQ(res1.size(), res2.size());
+
+        for (size_t i = 0; i != res1.size(); ++i)
+        {
+            EXPECT_EQ(res1[i].hits, res2[i].hits);
+            EXPECT_DOUBLE_EQ(res1[i].depth, res2[i].depth);
+        }
+    }
+
+    // the depth is weighted by multiplicity: each kmer of the file counts
+    // three times (see query_depth for once), and those of the read add up
+
+    opts.min_depth = 1;
+    query_result res_read = db->query(read.data(), read.length(), opts);
+    query_result res = db->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(2, res.size());
+    EXPECT_DOUBLE_EQ(3 * 3.0/18.0 + res_read[0].depth, res[0].depth);
+    EXPECT_DOUBLE_EQ(3 * 6.0/18.0 + res_read[1].depth, res[1].depth);
+    EXPECT_LT(0.0, res_read[0].depth);
+}
+
+TEST(templatedb_test, query_solid) {
+
+    std::istringstream is(">s1\nAAAAACCCCC\n");
+    std::unique_ptr<template_db> db = template_db::read(is, 0, 5, 64);
+
+    auto copies = [](int n) {
+        std::string qry;
+        for (int i = 0; i != n; ++i)
+            qry += ">q\nAAAAACCCCC\n";
+        return qry;
+    };
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+    opts.min_depth = 1;
+    opts.min_kmer_count = 3;
+
+    std::string qry = copies(2);
+    query_result res = db->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(1, res.size());
+    EXPECT_EQ(0, res[0].hits);
+
+    // once solid, every occurrence counts towards the depth exactly once
+
+    qry = copies(3);
+    res = db->query(qry.data(), qry.length(), opts);
+    EXPECT_EQ(6, res[0].hits);
+    EXPECT_DOUBLE_EQ(3.0, res[0].depth);
+
+    opts.min_kmer_count = 255;
+    qry = copies(300);
+    res = db->query(qry.data(), qry.length(), opts);
+    EXPECT_EQ(6, res[0].hits);
+    EXPECT_DOUBLE_EQ(300.0, res[0].depth);
+}
+
+// random_seq - a deterministic random sequence of len bases
+
+static std::string
+random_seq(std::size_t len)
+{
+    std::string seq;
+    std::uint64_t x = 42;
+
+    while (seq.length() != len)
+    {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        seq.push_back("acgt"[x >> 62]);
+    }
+
+    return seq;
+}
+
+TEST(templatedb_test, query_converge) {
+
+    // reads of 100 bases at each next position of the template; checks are
+    // made after every 1M kmers, at the end of a read
+
+    const std::size_t read_len = 100, kmers_per_read = read_len - 15 + 1;
+    const std::string tpl = random_seq(50000);
+
+    std::istringstream is(">s:x:1\n" + tpl + "\n");
+    std::unique_ptr<template_db> db = template_db::read(is, 0, 15, 64);
+
+    auto reads = [&](std::size_t n, int times) {
+        std::string qry;
+        for (int t = 0; t != times; ++t)
+            for (std::size_t i = 0; i != n; ++i)
+                qry += ">r\n" + tpl.substr(i, read_len) + "\n";
+        return qry;
+    };
+
+    query_stats st;
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+    opts.converge_batches = 1;
+    opts.stats = &st;
+
+    // while each batch covers more of the template, its hits keep changing
+
+    std::string qry = reads(37000, 1);
+    query_result res = db->query(qry.data(), qry.length(), opts);
+    EXPECT_EQ(37000 * kmers_per_read, st.n_kmers);
+
+    // once the reads repeat, the hits are the same at the third check
+
+    qry = reads(12500, 3);
+    res = db->query(qry.data(), qry.length(), opts);
+    EXPECT_GT(st.n_kmers, 3000000);
+    EXPECT_LT(st.n_kmers, 37500 * kmers_per_read);
+
+    opts.converge_batches = 0;
+    qry = reads(12500, 1);
+    query_result once = db->query(qry.data(), qry.length(), opts);
+
+    ASSERT_EQ(1, res.size());
+    ASSERT_EQ(1, once.size());
+    EXPECT_EQ(once[0].hits, res[0].hits);
+}
+
+TEST(templatedb_test, query_stream) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    std::ifstream fq(query_fname);
+    std::stringstream ss;
+    ss << fq.rdbuf();
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+
+    query_result res1 = db->query(query_fname, opts);
+    query_result res2 = db->query(ss, opts);
+    ASSERT_EQ(res1.size(), res2.size());
+
+    for (size_t i = 0; i != res1.size(); ++i)
+        EXPECT_EQ(res1[i].hits, res2[i].hits);
+}
+
+TEST(templatedb_test, query_missing_file) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    EXPECT_THROW(db->query("data/no-such-file", 0.0), std::runtime_error);
+}
+
+TEST(templatedb_test, query_prescreen) {
+
+    const std::string seq_a("gctaaagacaattacataacatacacgtcagcacgaaacttgttggcccagtgtgaatcgcttaagggttaagtaagtgtgatgcatacgcctttacttgctgtgtccaccccatcggac");
+    const std::string seq_b("tggcatttttattacactcagaaacagaactcgggtaattttgacaggtcacgcagaggcgcgccctcctgaagtgcgtggacactcgctatgaatctctgatttacccactctgccaaa");
+
+    std::stringstream fi(">sa:x:1\n" + seq_a + "\n>sb:x:1\n" + seq_b + "\n");
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    std::string qry(">q1\n" + seq_a + "\n>q2\n" + seq_b.substr(0, 30) + "\n");
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+
+    query_result res1 = db->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(2, res1.size());
+    EXPECT_EQ(116, res1[0].hits);
+    EXPECT_GT(res1[1].hits, 0);
+
+    opts.prescreen = 1;
+
+    query_result res2 = db->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(2, res2.size());
+    EXPECT_EQ(116, res2[0].hits);
+    EXPECT_EQ(0, res2[1].hits);
+
+    opts.prescreen = 2;
+
+    query_result res3 = db->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(2, res3.size());
+    EXPECT_EQ(res1[1].hits, res3[1].hits);
+
+    // the sketch is stored in the binary file, marked by a version in its
+    // header, and read back with it
+
+    std::stringstream bin;
+    db->write(bin);
+    EXPECT_EQ(0, bin.str().find("~khc~ v2 nseq 2 "));
+    EXPECT_NE(std::string::npos, bin.str().find("\nsketch "));
+
+    std::unique_ptr<template_db> db2 = template_db::read(bin);
+    opts.prescreen = 1;
+
+    query_result res4 = db2->query(qry.data(), qry.length(), opts);
+    ASSERT_EQ(2, res4.size());
+    EXPECT_EQ(116, res4[0].hits);
+    EXPECT_EQ(0, res4[1].hits);
+
+    // a later version is refused
+
+    std::string v3(bin.str());
+    v3[7] = '3';
+    std::stringstream bin3(v3);
+    EXPECT_THROW(template_db::read(bin3), std::runtime_error);
+
+    // a db with one scheme has no sketch, and is written without a version
+
+    std::stringstream fi1(">sa:x:1\n" + seq_a + "\n>sa:y:1\n" + seq_b + "\n");
+    std::stringstream bin1;
+    template_db::read(fi1, 0, 5, 64)->write(bin1);
+    EXPECT_EQ(0, bin1.str().find("~khc~ nseq 2 "));
+    EXPECT_EQ(std::string::npos, bin1.str().find("\nsketch "));
+    EXPECT_EQ(2, template_db::read(bin1)->query(qry.data(), qry.length(), opts).size());
+}
+
+TEST(templatedb_test, query_pipeline) {
+
+    std::ifstream fi(infile_fasta);
+    ASSERT_TRUE(fi.is_open());
+    std::unique_ptr<template_db> db = template_db::read(fi, 0, 5, 64);
+
+    query_options opts;
+    opts.min_cov_pct = 0.0;
+    opts.min_depth = 1;
+
+    query_result res1 = db->query(query_fname, opts);
+
+    for (int n = 1; n != 4; ++n)
+    {
+        opts.pipeline = n;
+
+        query_result res2 = db->query(query_fname, opts);
+        ASSERT_EQ(res1.size(), res2.size());
+
+        for (size_t i = 0; i != res1.size(); ++i)
+        {
+            EXPECT_EQ(res1[i].hits, res2[i].hits);
+            EXPECT_DOUBLE_EQ(res1[i].depth, res2[i].depth);
+        }
+    }
+
+    std::string bad(">q\nacgtx\n");
+    EXPECT_THROW(db->query(bad.data(), bad.length(), opts), std::runtime_error);
+}
+
+TEST(templatedb_test, query_stats) {
+
+    std::istringstream is(">s1\nAAAAACCCCC\n>s2\nAAAAAGGGGG\n");
+    std::unique_ptr<template_db> db = template_db::read(is, 0, 5, 64);
+
+    // AAAAA is in both, AAAAC and AAACC in s1; the kmers with N are skipped
+    std::string qry(">q\nAAAAACCNCC\n");
+
+    query_stats st;
+    query_options opts;
+    opts.skip_degens = true;
+    opts.stats = &st;
+
+    for (int n = 0; n != 2; ++n)
+    {
+        opts.pipeline = n;
+        db->query(qry.data(), qry.length(), opts);
+
+        EXPECT_EQ(1, st.n_seqs);
+        EXPECT_EQ(3, st.n_kmers);
+        EXPECT_EQ(3, st.n_skipped);
+        EXPECT_EQ(3, st.n_hits);
+        EXPECT_EQ(0, st.n_misses);
+        EXPECT_EQ(4, st.n_klocs);
+        ASSERT_EQ(3, st.longest.size());
+        EXPECT_EQ(2, st.longest[0].second);
+        EXPECT_GE(st.total.wall, st.lookup.wall);
+    }
+}
+
+TEST(templatedb_test, get_stats) {
+
+    // s3 has 5 kmer positions, each of which has 4 variants for the N
+    std::istringstream is(">s1\nAAAAACCCCC\n>s2\nAAAAAGGGGG\n>s3\nAAAANCCCC\n");
+    std::unique_ptr<template_db> db = template_db::read(is, 0, 5, 64);
+
+    db_stats st;
+    db->get_stats(st);
+
+    EXPECT_EQ(st.ksize, 5);
+    EXPECT_EQ(st.n_seqs, 3);
+    EXPECT_EQ(st.n_positions, 17);
+    EXPECT_EQ(st.n_klocs, 32);
+    EXPECT_EQ(st.n_blown, 1);
+    ASSERT_EQ(st.blowups.size(), 1);
+    EXPECT_EQ(st.blowups[0].seq_id, "s3");
+    EXPECT_EQ(st.blowups[0].n_klocs, 20);
+
+    std::uint64_t n = 0;
+    for (std::uint64_t h : st.kloc_hist)
+        n += h;
+    EXPECT_EQ(n, st.n_kmers);
+
+    ASSERT_FALSE(st.most_shared.empty());
+    EXPECT_EQ(st.most_shared[0].n_seqs, 3);     // AAAAA
+
+    ASSERT_FALSE(st.backends.empty());
+    EXPECT_EQ(st.backends[0].name, "vector");
+    EXPECT_GT(st.backends[0].total(), st.n_klocs * sizeof(kloc_t));
+}
+
+TEST(templatedb_test, peek) {
+
+    std::istringstream is(">a:s1\nAAAAACCCCC\n>a:s2\nAAAAAGGGGG\n>b:s3\nAAAATCCCC\n");
+    std::unique_ptr<template_db> db = template_db::read(is, 0, 5, 64);
+
+    db_stats st, pk;
+    db->get_stats(st);
+
+    EXPECT_FALSE(template_db::peek(infile_fasta, pk, 0, 5, 64));
+    EXPECT_EQ(pk.ksize, 5);
+    EXPECT_EQ(pk.n_seqs, 0);
+
+    ASSERT_TRUE(db->write(scratch_fname));
+    ASSERT_TRUE(template_db::peek(scratch_fname, pk));
+
+    EXPECT_EQ(pk.ksize, 5);
+    EXPECT_EQ(pk.n_seqs, 3);
+    EXPECT_EQ(pk.n_schemes, 2);
+    EXPECT_EQ(pk.n_positions, st.n_positions);
+    EXPECT_EQ(pk.n_kmers, st.n_kmers);
+    EXPECT_EQ(pk.n_klocs, st.n_klocs);      // no degenerate bases
+    EXPECT_EQ(pk.n_acc_words, st.n_acc_words);
+    EXPECT_EQ(pk.n_id_bytes, st.n_id_bytes);
+
+    ASSERT_EQ(pk.backends.size(), 3);       // the kmers per scheme are not in the header
+    for (std::size_t i = 0; i != pk.backends.size(); ++i)
+    {
+        EXPECT_EQ(pk.backends[i].name, st.backends[i].name);
+        EXPECT_EQ(pk.backends[i].total(), st.backends[i].total());
+    }
+
+    db->write_partitioned(scratch_fname);
+    ASSERT_TRUE(template_db::peek(scratch_fname, pk));
+    std::remove(scratch_fname);
+
+    EXPECT_EQ(pk.backend_name, "partitioned");
+    EXPECT_EQ(pk.n_seqs, 3);
+    EXPECT_EQ(pk.n_positions, st.n_positions);
+    EXPECT_EQ(pk.part_bytes.size(), 2);
+    ASSERT_EQ(pk.backends.size(), 2);
+    EXPECT_EQ(pk.backends[0].name, "partitioned");
+    EXPECT_GT(pk.backends[0].total(), pk.backends[1].total());
+}
+
 
 } // namespace
 // vim: sts=4:sw=4:ai:si:et
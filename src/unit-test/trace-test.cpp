@@ -0,0 +1,69 @@
+/* trace-test.cpp
+ *
+ * Copyright (C) 2018  Marco van Zwetselaar <io@zwets.it>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <gtest/gtest.h>
+#include "trace.h"
+
+using namespace khc;
+
+namespace {
+
+static const char scratch_fname[] = "data/test.trace.tmp";
+
+TEST(trace_test, disabled) {
+    EXPECT_FALSE(tracer::enabled());
+}
+
+TEST(trace_test, write) {
+    tracer::enable();
+    ASSERT_TRUE(tracer::enabled());
+
+    {
+        trace_span span("outer", "n", 1);
+        span.set_arg(7);
+    }
+
+    std::thread t([]() {
+        tracer::name_thread("other");
+        trace_span span("inner");
+    });
+    t.join();
+
+    tracer::write(scratch_fname);
+
+    std::ifstream f(scratch_fname);
+    std::stringstream ss;
+    ss << f.rdbuf();
+    std::string s = ss.str();
+
+    EXPECT_EQ(s.find("{ \"displayTimeUnit\""), 0);
+    EXPECT_NE(s.find("\"name\": \"outer\", \"ph\": \"X\""), std::string::npos);
+    EXPECT_NE(s.find("\"args\": { \"n\": 7 }"), std::string::npos);
+    EXPECT_NE(s.find("\"args\": { \"name\": \"other\" }"), std::string::npos);
+    EXPECT_NE(s.find("\"name\": \"inner\""), std::string::npos);
+
+    std::remove(scratch_fname);
+}
+
+
+} // namespace
+// vim: sts=4:sw=4:ai:si:et
@@ -21,6 +21,8 @@
 #include <cstdio>
 #include <cstdarg>
 #include <cstdlib>
+#include <ctime>
+#include <sys/resource.h>
 #include <unistd.h>
 #include "utils.h"
 
@@ -41,6 +43,12 @@ set_verbose(bool v)
     verbose = v;
 }
 
+bool
+is_verbose()
+{
+    return verbose;
+}
+
 void
 raise_error(const char *fmt, ...)
 {
@@ -51,8 +59,13 @@ raise_error(const char *fmt, ...)
     vsnprintf(buf, sizeof(buf), fmt, ap);
     va_end(ap);
 
-    std::cerr << progname << ": error: " << buf << std::endl;
-    std::exit(1);
+    throw error(buf);
+}
+
+void
+report_error(const char *msg)
+{
+    std::cerr << std::string(progname) + ": error: " + msg + "\n" << std::flush;
 }
 
 void
@@ -67,7 +80,8 @@ verbose_emit(const char *fmt, ...)
         vsnprintf(buf, sizeof(buf), fmt, ap);
         va_end(ap);
 
-        std::cerr << progname << ": " << buf << std::endl;
+        // emit as a single write, so lines from concurrent threads don't mix
+        std::cerr << std::string(progname) + ": " + buf + "\n" << std::flush;
     }
 }
 
@@ -77,6 +91,57 @@ get_system_memory()
     return (static_cast<unsigned long long>(sysconf(_SC_PHYS_PAGES)) * static_cast<unsigned long long>(sysconf(_SC_PAGE_SIZE)));
 }
 
+unsigned long long
+get_peak_rss()
+{
+    struct rusage ru;
+
+    return getrusage(RUSAGE_SELF, &ru) == 0 ? static_cast<unsigned long long>(ru.ru_maxrss) << 10 : 0;
+}
+
+static double
+clock_seconds(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+double
+wall_time()
+{
+    return clock_seconds(CLOCK_MONOTONIC);
+}
+
+double
+thread_cpu_time()
+{
+    return clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+double
+process_cpu_time()
+{
+    return clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+std::string
+json_string(const std::string& s)
+{
+    std::string ret("\"");
+
+    for (char c : s)
+        if (c == '"' || c == '\\')
+            ret += std::string("\\") + c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+            ret += ' ';
+        else
+            ret += c;
+
+    return ret + "\"";
+}
+
 } // namespace khc
 
 // vim: sts=4:sw=4:ai:si:et
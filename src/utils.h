@@ -19,16 +19,39 @@
 #define utils_h_INCLUDED
 
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 namespace khc {
 
+// error - the exception thrown by raise_error
+//
+class error : public std::runtime_error
+{
+    public:
+        explicit error(const std::string& what) : std::runtime_error(what) { }
+};
+
 extern void raise_error(const char* t, ...);
+extern void report_error(const char* msg);
 
 extern void set_progname(const char *name);
 extern void set_verbose(bool verbose);
+extern bool is_verbose();
 extern void verbose_emit(const char* t, ...);
 
 extern unsigned long long get_system_memory();
+extern unsigned long long get_peak_rss();
+
+// wall_time - seconds on a steady clock, for measuring intervals
+// thread_cpu_time, process_cpu_time - CPU seconds used by the calling thread
+//                                     and by the whole process
+extern double wall_time();
+extern double thread_cpu_time();
+extern double process_cpu_time();
+
+// json_string - s as a JSON string literal, with control characters blanked
+extern std::string json_string(const std::string& s);
 
 /* Alternative for varargs using the C++ approach, see:
  * https://github.com/isocpp/CppCoreGuidelines/blob/master/CppCoreGuidelines.md#-es34-dont-define-a-c-style-variadic-function
@@ -45,7 +45,7 @@ vector_kmer_db::add_kloc(kmer_t kmer, kloc_t loc)
         kloc_vecs_[pos].push_back(loc);
 }
 
-const std::vector<kloc_t>&
+kloc_range
 vector_kmer_db::get_klocs(kmer_t kmer) const
 {
     return kloc_vecs_[vec_ptrs_[kmer]];